@@ -0,0 +1,345 @@
+#include "Assembler.h"
+#include "ParseUtils.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+static bool is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == ',';
+}
+
+std::string_view Assembler::next_token(std::string_view& line) {
+    size_t start = 0;
+    while (start < line.size() && is_separator(line[start]))
+        ++start;
+
+    if (start == line.size() || line[start] == ';') {
+        line = {};
+        return {};
+    }
+
+    size_t end = start + 1;
+    if (line[start] == '\'') {
+        // character literals may contain separators: ' ' or ','
+        while (end < line.size() && line[end] != '\'') {
+            if (line[end] == '\\' && end + 1 < line.size())
+                ++end;
+            ++end;
+        }
+        end = std::min(end + 1, line.size());
+    } else if (line[start] == '[') {
+        // memory operands may contain spaces: [EBX + 4]
+        end = line.find(']', start);
+        end = end == std::string_view::npos ? line.size() : end + 1;
+    } else {
+        while (end < line.size() && !is_separator(line[end]) && line[end] != ';')
+            ++end;
+    }
+
+    std::string_view token = line.substr(start, end - start);
+    line.remove_prefix(end);
+    return token;
+}
+
+bool Assembler::is_identifier(std::string_view token) {
+    if (token.empty() || !(std::isalpha(static_cast<unsigned char>(token[0])) || token[0] == '_' || token[0] == '.'))
+        return false;
+
+    return std::all_of(token.begin(), token.end(), [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.';
+    });
+}
+
+bool Assembler::is_label_definition(std::string_view token) {
+    return token.size() > 1 && token.back() == ':';
+}
+
+std::string_view Assembler::next_line(std::string_view& source) {
+    size_t eol = source.find('\n');
+    std::string_view line = source.substr(0, eol);
+    source.remove_prefix(eol == std::string_view::npos ? source.size() : eol + 1);
+    return line;
+}
+
+bool Assembler::decode_instruction(std::string_view line, const Labels& labels, DecodedInstruction& out) {
+    std::string_view op = next_token(line);
+    if (op.empty()) {
+        return false;
+    }
+
+    out = {};
+    out.prefix = str_to_prefix(op);
+    if (out.prefix != RepPrefix::None) {
+        op = next_token(line);
+    }
+
+    out.opcode = str_to_opcode(op);
+    if (out.opcode == InstructionOpcode::INVALID) {
+        throw std::invalid_argument("Unknown instruction: " + std::string(op));
+    }
+    if (out.prefix != RepPrefix::None && !is_string_opcode(out.opcode)) {
+        throw std::invalid_argument("REP prefix requires a string instruction");
+    }
+
+    uint32_t width = 0;         // from a BYTE/WORD/DWORD prefix
+    int memory_index = -1;
+    for (std::string_view token = next_token(line); !token.empty(); token = next_token(line)) {
+        if (uint32_t w = size_keyword(token)) {
+            width = w;
+            continue;
+        }
+        if (ParseUtils::to_upper(std::string(token)) == "PTR") {
+            continue;
+        }
+
+        OperandKind kind;
+        uint32_t value;
+        if (token.front() == '[') {
+            if (memory_index >= 0) {
+                throw std::invalid_argument("Only one memory operand is allowed");
+            }
+            memory_index = out.argc;
+            decode_memory_operand(token, labels, out.mem_base, value);
+            kind = width == 1 ? OperandKind::Mem8 : width == 2 ? OperandKind::Mem16 : OperandKind::Mem32;
+        } else {
+            decode_operand(token, labels, kind, value);
+        }
+
+        if (out.argc < DecodedInstruction::MAX_OPERANDS) {
+            out.kinds[out.argc] = kind;
+            out.values[out.argc] = value;
+        }
+        ++out.argc;
+    }
+
+    if (memory_index >= 0 && memory_index < static_cast<int>(DecodedInstruction::MAX_OPERANDS)) {
+        resolve_memory_width(out, memory_index, width);
+    } else if (width) {
+        throw std::invalid_argument("Size prefix without a memory operand");
+    }
+
+    bind_branch_target(out);
+    return true;
+}
+
+RepPrefix Assembler::str_to_prefix(std::string_view token) {
+    std::string up = ParseUtils::to_upper(std::string(token));
+    if (up == "REP") return RepPrefix::Rep;
+    if (up == "REPE" || up == "REPZ") return RepPrefix::RepE;
+    if (up == "REPNE" || up == "REPNZ") return RepPrefix::RepNE;
+    return RepPrefix::None;
+}
+
+uint32_t Assembler::size_keyword(std::string_view token) {
+    std::string up = ParseUtils::to_upper(std::string(token));
+    if (up == "BYTE") return 1;
+    if (up == "WORD") return 2;
+    if (up == "DWORD") return 4;
+    return 0;
+}
+
+// Without a size prefix the width comes from the register operand: MOV [EBX], AL is a byte store.
+void Assembler::resolve_memory_width(DecodedInstruction& instr, int memory_index, uint32_t width) {
+    const int other = 1 - memory_index;
+    const bool has_register = other < instr.argc && instr.kinds[other] == OperandKind::Register;
+    const uint32_t reg_width = has_register ? register_width(instr.reg(other)) : 0;
+
+    if (!width) {
+        if (!reg_width) {
+            throw std::invalid_argument("Operand size not specified: use BYTE, WORD or DWORD");
+        }
+        width = reg_width;
+    } else if (reg_width && reg_width != width) {
+        throw std::invalid_argument("Operand size mismatch");
+    }
+
+    instr.kinds[memory_index] = width == 1 ? OperandKind::Mem8 : width == 2 ? OperandKind::Mem16 : OperandKind::Mem32;
+}
+
+// Parses "[base + disp]": at most one register, any number of integer or
+// label terms joined by + and -.
+void Assembler::decode_memory_operand(std::string_view token, const Labels& labels, uint8_t& base, uint32_t& disp) {
+    if (token.size() < 2 || token.back() != ']') {
+        throw std::invalid_argument("Unterminated memory operand: " + std::string(token));
+    }
+
+    std::string expr;
+    for (char c : token.substr(1, token.size() - 2)) {
+        if (!std::isspace(static_cast<unsigned char>(c))) expr += c;
+    }
+    if (expr.empty()) {
+        throw std::invalid_argument("Empty memory operand");
+    }
+
+    base = DecodedInstruction::NO_BASE;
+    disp = 0;
+
+    size_t pos = 0;
+    while (pos < expr.size()) {
+        bool negative = false;
+        if (expr[pos] == '+' || expr[pos] == '-') {
+            negative = expr[pos] == '-';
+            ++pos;
+        } else if (pos != 0) {
+            throw std::invalid_argument("Invalid memory operand: " + std::string(token));
+        }
+
+        size_t end = expr.find_first_of("+-", pos);
+        std::string term = expr.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        pos = end == std::string::npos ? expr.size() : end;
+
+        RegisterOpcode reg = str_to_register_opcode(term);
+        if (reg != RegisterOpcode::INVALID_REG) {
+            if (negative || base != DecodedInstruction::NO_BASE) {
+                throw std::invalid_argument("Memory operand takes one added base register: " + std::string(token));
+            }
+            base = static_cast<uint8_t>(reg);
+            continue;
+        }
+
+        uint32_t value;
+        if (auto it = labels.find(term); it != labels.end()) {
+            value = it->second;
+        } else if (ParseUtils::is_int(term)) {
+            value = static_cast<uint32_t>(ParseUtils::string_to_int(term));
+        } else if (is_identifier(term)) {
+            throw std::invalid_argument("Undefined label: " + term);
+        } else {
+            throw std::invalid_argument("Invalid memory operand: " + std::string(token));
+        }
+        disp += negative ? 0u - value : value;
+    }
+}
+
+bool Assembler::assemble_line(std::string_view line, DecodedInstruction& out) {
+    static const Labels no_labels;
+    return decode_instruction(line, no_labels, out);
+}
+
+void Assembler::define_label(std::string_view definition, Labels& labels, uint32_t index) {
+    std::string name(definition.substr(0, definition.size() - 1));
+    if (!is_identifier(name) || str_to_register_opcode(name) != RegisterOpcode::INVALID_REG || ParseUtils::is_int(name) ||
+        size_keyword(name) || ParseUtils::to_upper(name) == "PTR" || str_to_prefix(name) != RepPrefix::None) {
+        throw std::invalid_argument("Invalid label name: " + name);
+    }
+    if (!labels.emplace(name, index).second) {
+        throw std::invalid_argument("Duplicate label: " + name);
+    }
+}
+
+bool Assembler::assemble_line(std::string_view line, DecodedInstruction& out, Labels& labels, uint32_t index) {
+    std::string_view rest = line;
+    std::string_view first = next_token(rest);
+
+    if (is_label_definition(first)) {
+        define_label(first, labels, index);
+        line = rest;
+    }
+
+    return decode_instruction(line, labels, out);
+}
+
+Assembler::Program Assembler::assemble(std::string_view source) {
+    Program program;
+    Labels& labels = program.labels;
+
+    // Pass 1: find label definitions and count instructions.
+    uint32_t count = 0;
+    size_t line_number = 0;
+    for (std::string_view rest = source; !rest.empty();) {
+        std::string_view line = next_line(rest);
+        ++line_number;
+
+        try {
+            std::string_view first = next_token(line);
+            if (is_label_definition(first)) {
+                define_label(first, labels, count);
+                first = next_token(line);
+            }
+            if (!first.empty()) {
+                ++count;
+            }
+        } catch (const std::exception& e) {
+            throw std::invalid_argument("line " + std::to_string(line_number) + ": " + e.what());
+        }
+    }
+
+    // Pass 2: decode with every label known.
+    program.code.reserve(count);
+    program.source_lines.reserve(count);
+
+    line_number = 0;
+    for (std::string_view rest = source; !rest.empty();) {
+        std::string_view line = next_line(rest);
+        ++line_number;
+
+        try {
+            std::string_view after_label = line;
+            if (is_label_definition(next_token(after_label))) {
+                line = after_label;
+            }
+
+            DecodedInstruction instr;
+            if (decode_instruction(line, labels, instr)) {
+                program.code.push_back(instr);
+                program.source_lines.push_back(static_cast<uint32_t>(line_number));
+            }
+        } catch (const std::exception& e) {
+            throw std::invalid_argument("line " + std::to_string(line_number) + ": " + e.what());
+        }
+    }
+
+    return program;
+}
+
+Assembler::Program Assembler::assemble_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return assemble(ss.str());
+}
+
+void Assembler::decode_operand(std::string_view token, const Labels& labels, OperandKind& kind, uint32_t& value) {
+    std::string str(token);
+
+    RegisterOpcode reg_op = str_to_register_opcode(token);
+    if (reg_op != RegisterOpcode::INVALID_REG) {
+        kind = OperandKind::Register;
+        value = static_cast<uint32_t>(reg_op);
+    } else if (auto it = labels.find(str); it != labels.end()) {
+        kind = OperandKind::Immediate;
+        value = it->second;
+    } else if (ParseUtils::is_int(str)) {
+        kind = OperandKind::Immediate;
+        value = static_cast<uint32_t>(ParseUtils::string_to_int(str));
+    } else if (ParseUtils::is_double(str)) {
+        kind = OperandKind::Float;
+        value = 0;
+    } else if (ParseUtils::is_char(str)) {
+        kind = OperandKind::Immediate;
+        value = static_cast<uint32_t>((int)ParseUtils::string_to_char(str));
+    } else if (is_identifier(str)) {
+        throw std::invalid_argument("Undefined label: " + str);
+    } else {
+        throw std::invalid_argument("Unknown type of operand: " + str);
+    }
+}
+
+InstructionOpcode Assembler::str_to_opcode(std::string_view instr) {
+    auto up = ParseUtils::to_upper(std::string(instr));
+    auto it = ParseUtils::instr_map.find(up);
+    return it != ParseUtils::instr_map.end() ? it->second : InstructionOpcode::INVALID;
+}
+
+RegisterOpcode Assembler::str_to_register_opcode(std::string_view reg) {
+    auto up = ParseUtils::to_upper(std::string(reg));
+    auto it = ParseUtils::reg_map.find(up);
+    return it != ParseUtils::reg_map.end() ? it->second : RegisterOpcode::INVALID_REG;
+}
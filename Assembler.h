@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "Instruction.h"
+
+class Assembler {
+public:
+    // Label name -> index of the instruction it precedes.
+    using Labels = std::unordered_map<std::string, uint32_t>;
+
+    // Decodes one source line. Returns false if the line holds no instruction
+    // (blank, comment or label only).
+    static bool assemble_line(std::string_view line, DecodedInstruction& out);
+
+    // Same, but a leading "label:" is defined at `index` and label operands are
+    // resolved against `labels`. Used by the REPL, so only backward references work.
+    static bool assemble_line(std::string_view line, DecodedInstruction& out, Labels& labels, uint32_t index);
+
+    struct Program {
+        std::vector<DecodedInstruction> code;
+        Labels labels;
+        std::vector<uint32_t> source_lines;   // 1-based source line of each instruction
+    };
+
+    // Two-pass assembly of a whole program: the first pass collects label
+    // definitions, the second decodes instructions with every label resolved
+    // to an instruction index. Errors are reported with their line number.
+    static Program assemble(std::string_view source);
+    static Program assemble_file(const std::string& path);
+
+private:
+    static InstructionOpcode str_to_opcode(std::string_view instr);
+    static RegisterOpcode str_to_register_opcode(std::string_view reg);
+    static void decode_operand(std::string_view token, const Labels& labels, OperandKind& kind, uint32_t& value);
+    static void decode_memory_operand(std::string_view token, const Labels& labels, uint8_t& base, uint32_t& disp);
+    static uint32_t size_keyword(std::string_view token);
+    static RepPrefix str_to_prefix(std::string_view token);
+    static void resolve_memory_width(DecodedInstruction& instr, int memory_index, uint32_t width);
+    static bool decode_instruction(std::string_view line, const Labels& labels, DecodedInstruction& out);
+    static std::string_view next_token(std::string_view& line);
+    static bool is_label_definition(std::string_view token);
+    static void define_label(std::string_view definition, Labels& labels, uint32_t index);
+    static bool is_identifier(std::string_view token);
+    static std::string_view next_line(std::string_view& source);
+};
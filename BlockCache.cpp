@@ -0,0 +1,83 @@
+#include "BlockCache.h"
+
+#include <algorithm>
+
+// Grows `block` from its current end up to the next control transfer.
+void BlockCache::scan(Block& block, std::span<const DecodedInstruction> code) {
+    while (block.end < code.size()) {
+        const DecodedInstruction& instr = code[block.end++];
+        if (!transfers_control(instr.opcode)) {
+            continue;
+        }
+
+        block.terminated = true;
+        if (is_fused_opcode(instr.opcode)) {
+            // The handler consumes the second record as well.
+            block.next_pc = block.end + 1;
+            if (instr.opcode != InstructionOpcode::MOV_ADD && block.end < code.size() &&
+                code[block.end].kinds[0] == OperandKind::Target) {
+                block.target_pc = code[block.end].values[0];
+            }
+        } else {
+            block.next_pc = block.end;
+            if (instr.kinds[0] == OperandKind::Target) {
+                block.target_pc = instr.values[0];
+            }
+        }
+        return;
+    }
+
+    block.next_pc = block.end;
+}
+
+uint32_t BlockCache::lookup(uint32_t pc, std::span<const DecodedInstruction> code) {
+    if (pc >= code.size()) {
+        return NO_BLOCK;
+    }
+    if (m_block_at.size() < code.size()) {
+        m_block_at.resize(code.size(), NO_BLOCK);
+    }
+    if (m_block_at[pc] != NO_BLOCK) {
+        return m_block_at[pc];
+    }
+
+    Block block { pc, pc, pc };
+    scan(block, code);
+
+    const uint32_t id = static_cast<uint32_t>(m_blocks.size());
+    m_blocks.push_back(block);
+    m_block_at[pc] = id;
+    if (!block.terminated) {
+        m_open.push_back(id);
+    }
+    return id;
+}
+
+// Slow path of next(): finds the successor and caches it as a link.
+uint32_t BlockCache::link(uint32_t from, uint32_t pc, std::span<const DecodedInstruction> code) {
+    const bool is_fallthrough = pc == m_blocks[from].next_pc;
+    const bool is_taken = pc == m_blocks[from].target_pc;
+
+    // lookup() may add a block and move m_blocks.
+    const uint32_t id = lookup(pc, code);
+    if (id != NO_BLOCK) {
+        if (is_fallthrough) m_blocks[from].fallthrough = id;
+        else if (is_taken) m_blocks[from].taken = id;
+    }
+    return id;
+}
+
+void BlockCache::extend(std::span<const DecodedInstruction> code) {
+    m_block_at.resize(code.size(), NO_BLOCK);
+
+    for (uint32_t id : m_open) {
+        scan(m_blocks[id], code);
+    }
+    std::erase_if(m_open, [&](uint32_t id) { return m_blocks[id].terminated; });
+}
+
+void BlockCache::reset() {
+    m_blocks.clear();
+    m_block_at.clear();
+    m_open.clear();
+}
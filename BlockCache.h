@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "Instruction.h"
+
+// Lazily built basic blocks of the running program, keyed by entry pc.
+//
+// A block runs from its entry up to and including the first instruction that
+// sets the pc itself (a jump or a fused pair), or to the end of the program.
+// Blocks are formed at whatever pc control actually arrives at, so they may
+// overlap. Each block caches the ids of its fall-through and taken successors
+// once they have been followed, so chained execution normally skips the pc
+// lookup entirely.
+class BlockCache {
+public:
+    static constexpr uint32_t NO_BLOCK = UINT32_MAX;
+
+    struct Block {
+        uint32_t start;
+        uint32_t end;                       // one past the last instruction
+        uint32_t next_pc;                   // pc after the block when no jump is taken
+        uint32_t target_pc = NO_BLOCK;      // static jump target, if the terminator has one
+        uint32_t fallthrough = NO_BLOCK;
+        uint32_t taken = NO_BLOCK;
+        bool terminated = false;            // ends in a control transfer, not at the program end
+    };
+
+    // Block entered at `pc`, built on first use; NO_BLOCK past the program end.
+    uint32_t lookup(uint32_t pc, std::span<const DecodedInstruction> code);
+    // Block control moves to after leaving `from` with the pc at `pc`.
+    uint32_t next(uint32_t from, uint32_t pc, std::span<const DecodedInstruction> code);
+
+    const Block& operator[](uint32_t id) const { return m_blocks[id]; }
+
+    // Instructions were appended: blocks that ran into the old program end grow.
+    void extend(std::span<const DecodedInstruction> code);
+    void reset();
+
+    size_t size() const { return m_blocks.size(); }
+
+private:
+    std::vector<Block> m_blocks;
+    std::vector<uint32_t> m_block_at;   // entry pc -> block id
+    std::vector<uint32_t> m_open;       // blocks that are not terminated yet
+
+    static void scan(Block& block, std::span<const DecodedInstruction> code);
+    uint32_t link(uint32_t from, uint32_t pc, std::span<const DecodedInstruction> code);
+};
+
+inline uint32_t BlockCache::next(uint32_t from, uint32_t pc, std::span<const DecodedInstruction> code) {
+    const Block& block = m_blocks[from];
+    if (pc == block.next_pc && block.fallthrough != NO_BLOCK) {
+        return block.fallthrough;
+    }
+    if (pc == block.target_pc && block.taken != NO_BLOCK) {
+        return block.taken;
+    }
+    return link(from, pc, code);
+}
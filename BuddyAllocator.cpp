@@ -0,0 +1,86 @@
+#include "BuddyAllocator.h"
+
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+
+BuddyAllocator::BuddyAllocator(uint32_t base, uint32_t order) : m_base(base), m_order(order) {
+    if (order > MAX_ORDER || uint64_t(base) + (uint64_t(PARAGRAPH) << order) > (uint64_t(1) << 32)) {
+        throw std::invalid_argument("Heap does not fit in the address space");
+    }
+    reset();
+}
+
+void BuddyAllocator::reset() {
+    for (uint32_t bits = m_nonempty; bits; bits &= bits - 1) {
+        m_free[std::countr_zero(bits)].clear();
+    }
+    m_nonempty = 0;
+    m_allocated.clear();
+    insert(m_order, 0);
+}
+
+void BuddyAllocator::insert(uint32_t order, uint32_t offset) {
+    m_free[order].insert(offset);
+    m_nonempty |= 1u << order;
+}
+
+void BuddyAllocator::erase(uint32_t order, std::set<uint32_t>::iterator it) {
+    m_free[order].erase(it);
+    if (m_free[order].empty()) {
+        m_nonempty &= ~(1u << order);
+    }
+}
+
+uint32_t BuddyAllocator::allocate(uint32_t paragraphs) {
+    if (paragraphs > (1u << m_order)) {
+        return NO_BLOCK;
+    }
+    const uint32_t order = std::bit_width(std::max(paragraphs, 1u) - 1);
+
+    // Smallest nonempty free list at or above `order`.
+    const uint32_t fits = m_nonempty & ~((1u << order) - 1);
+    if (fits == 0) {
+        return NO_BLOCK;
+    }
+    uint32_t from = std::countr_zero(fits);
+    const uint32_t offset = *m_free[from].begin();
+    erase(from, m_free[from].begin());
+
+    // Hand the upper halves back until the block has the size asked for.
+    while (from > order) {
+        --from;
+        insert(from, offset + (1u << from));
+    }
+    m_allocated.emplace(offset, static_cast<uint8_t>(order));
+    return m_base + offset * PARAGRAPH;
+}
+
+bool BuddyAllocator::free(uint32_t address) {
+    if (address < m_base || (address - m_base) % PARAGRAPH != 0) {
+        return false;
+    }
+    auto it = m_allocated.find((address - m_base) / PARAGRAPH);
+    if (it == m_allocated.end()) {
+        return false;
+    }
+    uint32_t offset = it->first;
+    uint32_t order = it->second;
+    m_allocated.erase(it);
+
+    while (order < m_order) {
+        auto buddy = m_free[order].find(offset ^ (1u << order));
+        if (buddy == m_free[order].end()) {
+            break;
+        }
+        erase(order, buddy);
+        offset &= ~(1u << order);
+        ++order;
+    }
+    insert(order, offset);
+    return true;
+}
+
+uint32_t BuddyAllocator::largest_free() const {
+    return m_nonempty ? 1u << (31 - std::countl_zero(m_nonempty)) : 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+
+// Buddy allocator over a power-of-two range of guest addresses, in 16-byte
+// paragraphs.
+//
+// A request is rounded up to a power of two paragraphs and carved out of the
+// smallest free block that fits, splitting it in halves; a freed block merges
+// with its buddy for as long as the buddy is free too. Both take O(log n).
+// Free blocks of each size are kept in address order, so the lowest fitting
+// address always wins and runs are reproducible. All bookkeeping lives on the
+// host: a guest writing past its block can corrupt its data, not the heap.
+class BuddyAllocator {
+public:
+    static constexpr uint32_t PARAGRAPH = 16;
+    static constexpr uint32_t NO_BLOCK = UINT32_MAX;
+
+    // Manages [base, base + (PARAGRAPH << order)).
+    BuddyAllocator(uint32_t base, uint32_t order);
+
+    // Address of a block of at least `paragraphs` paragraphs, or NO_BLOCK.
+    uint32_t allocate(uint32_t paragraphs);
+    // Frees the block at `address`; false if no block starts there.
+    bool free(uint32_t address);
+    // Frees every block at once.
+    void reset();
+
+    // Paragraphs in the largest block allocate() could return right now.
+    uint32_t largest_free() const;
+    size_t allocated_blocks() const { return m_allocated.size(); }
+    uint32_t base() const { return m_base; }
+    uint32_t size() const { return PARAGRAPH << m_order; }
+
+private:
+    static constexpr uint32_t MAX_ORDER = 27;   // 2 GiB
+
+    uint32_t m_base;
+    uint32_t m_order;
+    std::array<std::set<uint32_t>, MAX_ORDER + 1> m_free;   // paragraph offsets, by order
+    uint32_t m_nonempty {};                                 // bit k: m_free[k] has a block
+    std::unordered_map<uint32_t, uint8_t> m_allocated;      // paragraph offset -> order
+
+    void insert(uint32_t order, uint32_t offset);
+    void erase(uint32_t order, std::set<uint32_t>::iterator it);
+};
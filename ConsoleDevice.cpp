@@ -0,0 +1,68 @@
+#include "ConsoleDevice.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+ConsoleDevice::ConsoleDevice(int fd, size_t capacity) : m_fd(fd), m_buffer(capacity ? capacity : 1) {}
+
+ConsoleDevice::~ConsoleDevice() {
+    try {
+        flush();
+    } catch (const std::exception&) {
+        // Nowhere left to report it.
+    }
+}
+
+void ConsoleDevice::write(char c) {
+    write(std::string_view(&c, 1));
+}
+
+void ConsoleDevice::write(std::string_view text) {
+    append(text);
+    if (!m_raw) {
+        append("\n");
+    }
+    if (m_policy.on_newline && m_used && (!m_raw || text.find('\n') != std::string_view::npos)) {
+        flush();
+    }
+}
+
+void ConsoleDevice::input_requested() {
+    if (m_policy.on_input) {
+        flush();
+    }
+}
+
+// Flushes whenever the buffer fills up, so text of any length fits.
+void ConsoleDevice::append(std::string_view text) {
+    while (!text.empty()) {
+        if (m_used == m_buffer.size()) {
+            flush();
+        }
+        const size_t chunk = std::min(text.size(), m_buffer.size() - m_used);
+        std::memcpy(m_buffer.data() + m_used, text.data(), chunk);
+        m_used += chunk;
+        text.remove_prefix(chunk);
+    }
+}
+
+void ConsoleDevice::flush() {
+    size_t done = 0;
+    while (done < m_used) {
+        const ssize_t n = ::write(m_fd, m_buffer.data() + done, m_used - done);
+        ++m_syscalls;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            m_used = 0;
+            throw std::runtime_error(std::string("Console write failed: ") + std::strerror(errno));
+        }
+        done += n;
+    }
+    m_used = 0;
+}
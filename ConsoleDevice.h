@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Guest console output, buffered in front of a file descriptor.
+//
+// The buffer is always written out when it is full, and when the device is
+// destroyed. The policy adds the other points where the guest expects to see
+// its output: after a line break, and before the program waits for input.
+// In cooked mode every write ends its own line, as the console always did;
+// raw mode passes the guest's bytes through untouched.
+class ConsoleDevice {
+public:
+    struct FlushPolicy {
+        bool on_newline = true;
+        bool on_input = true;
+    };
+
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+    explicit ConsoleDevice(int fd, size_t capacity = DEFAULT_CAPACITY);
+    ~ConsoleDevice();
+
+    ConsoleDevice(const ConsoleDevice&) = delete;
+    ConsoleDevice& operator=(const ConsoleDevice&) = delete;
+
+    void set_policy(const FlushPolicy& policy) { m_policy = policy; }
+    const FlushPolicy& policy() const { return m_policy; }
+    void set_raw(bool raw) { m_raw = raw; }
+    bool raw() const { return m_raw; }
+
+    // Guest output.
+    void write(char c);
+    void write(std::string_view text);
+    // Host text such as prompts: never followed by a line break.
+    void prompt(std::string_view text) { append(text); }
+    // Called before a read from the console.
+    void input_requested();
+    void flush();
+
+    // write() system calls made so far.
+    uint64_t syscalls() const { return m_syscalls; }
+
+private:
+    int m_fd;
+    std::vector<char> m_buffer;
+    size_t m_used {};
+    FlushPolicy m_policy;
+    bool m_raw = false;
+    uint64_t m_syscalls {};
+
+    void append(std::string_view text);
+};
@@ -10,5 +10,5 @@ std::string Debugger::info_about_registers(const Registers& registers) {
 std::string Debugger::info_about_flags(const Registers& registers) {
     return "[DEBUG] CF: " + std::to_string(registers.get_flag(Flag::Carry)) + ", PF: " + std::to_string(registers.get_flag(Flag::Parity)) +
 	   ", AF: " + std::to_string(registers.get_flag(Flag::Auxiliary)) + ", ZF: " + std::to_string(registers.get_flag(Flag::Zero)) +
-	   ", SF: " + std::to_string(registers.get_flag(Flag::Sign)) + ", OF: " + std::to_string(registers.get_flag(Flag::Overflow));
+	   ", SF: " + std::to_string(registers.get_flag(Flag::Sign)) + ", DF: " + std::to_string(registers.get_flag(Flag::Direction)) + ", OF: " + std::to_string(registers.get_flag(Flag::Overflow));
 }
@@ -0,0 +1,272 @@
+#include "Engine.h"
+#include "TimeUtils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+Engine::Engine(std::shared_ptr<const ProgramImage> image, const Options& options)
+    : m_image(std::move(image)), m_options(options) {
+    if (m_options.instances == 0) {
+        throw std::invalid_argument("Engine needs at least one instance");
+    }
+    if (m_options.slice == 0) {
+        throw std::invalid_argument("Engine time slice must be at least one instruction");
+    }
+    if (m_options.threads == 0) {
+        m_options.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    m_options.threads = std::min(m_options.threads, m_options.instances);
+
+    auto service = [this](void (Engine::*handler)(Instance&, const Interrupt&)) {
+        return [this, handler](const Interrupt& intr) {
+            (this->*handler)(*static_cast<Instance*>(intr.vm.host()), intr);
+        };
+    };
+    m_interrupt_manager.set_service(InterruptType::WriteChar, service(&Engine::intr_write_char), this);
+    m_interrupt_manager.set_service(InterruptType::WriteString, service(&Engine::intr_write_string), this);
+    m_interrupt_manager.set_service(InterruptType::GetSystemDate, service(&Engine::intr_get_system_date), this);
+    if (m_options.input >= 0) {
+        m_interrupt_manager.set_service(InterruptType::ReadCharWithEcho, service(&Engine::intr_read_char), this);
+        m_interrupt_manager.set_service(InterruptType::ReadCharNoEcho, service(&Engine::intr_read_char), this);
+    }
+
+    if (!m_options.root.empty()) {
+        m_files = std::make_unique<FileServices>(m_options.root);
+        m_files->install(m_interrupt_manager);
+        // AH=40h to handles 1 and 2 lands in the instance output, in order
+        // with AH=02h/09h, and is passed through as written.
+        m_files->set_output([](VM& vm, std::string_view text) {
+            static_cast<Instance*>(vm.host())->output += text;
+        });
+    }
+
+    m_instances.reserve(m_options.instances);
+    for (size_t i = 0; i < m_options.instances; ++i) {
+        auto instance = std::make_unique<Instance>();
+        instance->vm.set_interrupt_manager(&m_interrupt_manager);
+        instance->vm.set_jit_mode(m_options.jit);
+        instance->vm.load(m_image);
+        instance->vm.set_host(instance.get());
+        m_instances.push_back(std::move(instance));
+    }
+}
+
+Engine::~Engine() {
+    m_interrupt_manager.remove_services(this);
+}
+
+Engine::Report Engine::run() {
+    // Deal the pending instances out round-robin.
+    m_queues.clear();
+    for (size_t i = 0; i < m_options.threads; ++i) {
+        m_queues.push_back(std::make_unique<WorkQueue>());
+    }
+    size_t pending = 0;
+    for (size_t i = 0; i < m_instances.size(); ++i) {
+        if (m_instances[i]->status == Status::Pending) {
+            m_queues[pending++ % m_queues.size()]->ids.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    m_remaining = pending;
+    m_parked = 0;
+
+    std::vector<uint64_t> executed_before;
+    for (const auto& instance : m_instances) {
+        executed_before.push_back(instance->vm.executed());
+    }
+
+    std::vector<WorkerStats> stats(m_queues.size());
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::atomic<bool> stopping = false;
+        std::jthread io;
+        if (m_options.input >= 0) {
+            io = std::jthread([this, &stopping] {
+                while (!stopping.load(std::memory_order_acquire)) {
+                    m_events.poll(-1);
+                }
+            });
+        }
+        struct StopIo {
+            std::atomic<bool>& stopping;
+            EventLoop& events;
+            ~StopIo() {
+                stopping.store(true, std::memory_order_release);
+                events.wake();
+            }
+        } stop_io { stopping, m_events };
+
+        std::vector<std::jthread> workers;
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            workers.emplace_back([this, i, &stats] { work(i, stats[i]); });
+        }
+        work(0, stats[0]);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    Report report;
+    report.instances = m_instances.size();
+    report.threads = m_queues.size();
+    report.seconds = std::chrono::duration<double>(end - start).count();
+    for (size_t i = 0; i < m_instances.size(); ++i) {
+        const Instance& instance = *m_instances[i];
+        report.instructions += instance.vm.executed() - executed_before[i];
+        report.finished += instance.status == Status::Finished;
+        report.failed += instance.status == Status::Failed;
+    }
+    for (const WorkerStats& s : stats) {
+        report.slices += s.slices;
+        report.steals += s.steals;
+        report.parks += s.parks;
+    }
+    return report;
+}
+
+void Engine::work(size_t self, WorkerStats& stats) {
+    while (m_remaining.load(std::memory_order_acquire) > 0) {
+        const uint32_t wakeups = m_wakeups.load(std::memory_order_acquire);
+        uint32_t id;
+        if (!take(self, id, stats)) {
+            if (m_parked.load(std::memory_order_acquire) == m_remaining.load(std::memory_order_acquire)) {
+                // Everything left is waiting for input: sleep until a completion.
+                m_wakeups.wait(wakeups, std::memory_order_acquire);
+            } else {
+                // Everything left is running on other workers.
+                std::this_thread::yield();
+            }
+            continue;
+        }
+        run_slice(*m_instances[id], self, id, stats);
+    }
+}
+
+// Own queue first, oldest instance first; otherwise steal the newest
+// instance of the first other worker that has one.
+bool Engine::take(size_t self, uint32_t& id, WorkerStats& stats) {
+    {
+        WorkQueue& own = *m_queues[self];
+        std::lock_guard<std::mutex> lk(own.mtx);
+        if (!own.ids.empty()) {
+            id = own.ids.front();
+            own.ids.pop_front();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < m_queues.size(); ++i) {
+        WorkQueue& victim = *m_queues[(self + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lk(victim.mtx);
+        if (!victim.ids.empty()) {
+            id = victim.ids.back();
+            victim.ids.pop_back();
+            ++stats.steals;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Engine::run_slice(Instance& instance, size_t self, uint32_t id, WorkerStats& stats) {
+    ++stats.slices;
+    try {
+        switch (instance.vm.run(m_options.slice)) {
+            case RunStatus::Yielded: {
+                WorkQueue& own = *m_queues[self];
+                std::lock_guard<std::mutex> lk(own.mtx);
+                own.ids.push_back(id);
+                return;
+            }
+            case RunStatus::Parked:
+                // Only submitted now that no worker is running the VM, so the
+                // completion can never race with this slice.
+                ++stats.parks;
+                m_parked.fetch_add(1, std::memory_order_release);
+                submit(id);
+                return;
+            case RunStatus::Finished:
+            case RunStatus::Halted:
+                break;
+        }
+        instance.status = Status::Finished;
+    } catch (const std::exception& e) {
+        uint32_t line = m_image->source_line(instance.vm.pc());
+        instance.error = line ? "line " + std::to_string(line) + ": " + e.what() : e.what();
+        instance.status = Status::Failed;
+    }
+    if (m_files) {
+        m_files->release(instance.vm);
+    }
+    if (m_remaining.fetch_sub(1, std::memory_order_release) == 1) {
+        wake_workers();
+    }
+}
+
+// Reads the character the parked instance asked for. The completion runs on
+// the event loop thread while no worker holds the instance, then puts it
+// back on a queue. Like the REPL, a read takes the character and the line
+// break typed after it.
+void Engine::submit(uint32_t id) {
+    m_events.submit_read(m_options.input, 2, [this, id](std::string_view data, int) {
+        Instance& instance = *m_instances[id];
+        const char ch = data.empty() ? Interrupt::END_OF_INPUT : data[0];
+        if (instance.request == InterruptType::ReadCharWithEcho) {
+            write(instance, std::string_view(&ch, 1));
+        }
+        instance.vm.on_read_char(ch);
+        instance.vm.resume();
+        m_parked.fetch_sub(1, std::memory_order_release);
+
+        WorkQueue& queue = *m_queues[id % m_queues.size()];
+        {
+            std::lock_guard<std::mutex> lk(queue.mtx);
+            queue.ids.push_back(id);
+        }
+        wake_workers();
+    });
+}
+
+void Engine::write(Instance& instance, std::string_view text) const {
+    instance.output += text;
+    if (!m_options.raw) {
+        instance.output += '\n';
+    }
+}
+
+void Engine::wake_workers() {
+    m_wakeups.fetch_add(1, std::memory_order_release);
+    m_wakeups.notify_all();
+}
+
+void Engine::intr_write_char(Instance& instance, const Interrupt& intr) {
+    const char ch = static_cast<char>(intr.registers.get(RegisterOpcode::DL));
+    write(instance, std::string_view(&ch, 1));
+}
+
+void Engine::intr_write_string(Instance& instance, const Interrupt& intr) {
+    write(instance, instance.vm.memory().read_string(intr.registers.get(RegisterOpcode::EDX), '$'));
+}
+
+// AH=01h/07h: parks the instance; submit() completes the read.
+void Engine::intr_read_char(Instance& instance, const Interrupt& intr) {
+    instance.request = intr.type;
+    instance.vm.park();
+}
+
+void Engine::intr_get_system_date(Instance& instance, const Interrupt&) {
+    instance.vm.on_get_system_date(
+        TimeUtils::get_current_year(),
+        TimeUtils::get_current_month(),
+        TimeUtils::get_current_day(),
+        TimeUtils::get_current_day_of_week()
+    );
+}
+
+std::string Engine::Report::to_string() const {
+    std::ostringstream ss;
+    ss << "engine: " << instances << " instances (" << finished << " finished, " << failed << " failed) on "
+       << threads << " threads: " << instructions << " instructions in " << seconds << " s ("
+       << mips() << " MIPS), " << slices << " slices, " << steals << " steals, " << parks << " parks";
+    return ss.str();
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "VM.h"
+#include "InterruptManager.h"
+#include "EventLoop.h"
+#include "FileServices.h"
+#include "ProgramImage.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Runs many independent instances of one program on a thread pool.
+//
+// Every instance is a VM of its own, but all of them execute the same
+// immutable ProgramImage. Each worker thread owns a queue of instances. It
+// runs the instance at the front for one time slice of `slice` instructions
+// and puts it back at the end if it has not finished. A worker with an empty
+// queue steals from the back of another worker's queue, so uneven programs
+// still keep every core busy.
+//
+// Console input is asynchronous: INT 21h AH=01h/07h parks the instance and
+// hands the read to an event loop on a thread of its own. The worker moves on
+// to other instances, and the completion queues the instance up again.
+//
+// Every instance's VM has the Instance as its host pointer, so the INT 21h
+// services reach it directly.
+class Engine {
+public:
+    struct Options {
+        size_t instances = 1;
+        size_t threads = 0;             // 0: one per hardware thread
+        uint64_t slice = 100000;        // instruction budget of one time slice
+        JitMode jit = JitMode::Off;
+        int input = -1;                 // descriptor INT 21h reads characters from; -1: none
+        std::string root;               // sandbox of the DOS file services; empty: none
+        bool raw = false;               // output as ConsoleDevice's raw mode; else every write ends a line
+    };
+
+    enum class Status : uint8_t {
+        Pending,
+        Finished,
+        Failed
+    };
+
+    struct Instance {
+        VM vm;
+        Status status = Status::Pending;
+        std::string output;     // written with INT 21h AH=02h/09h, and AH=40h to handles 1 and 2
+        std::string error;
+        InterruptType request {};   // the service the instance is parked in
+    };
+
+    struct Report {
+        size_t instances = 0;
+        size_t finished = 0;
+        size_t failed = 0;
+        size_t threads = 0;
+        uint64_t instructions = 0;
+        uint64_t slices = 0;
+        uint64_t steals = 0;
+        uint64_t parks = 0;
+        double seconds = 0;
+
+        double mips() const { return seconds > 0 ? instructions / seconds / 1e6 : 0; }
+        std::string to_string() const;
+    };
+
+    Engine(std::shared_ptr<const ProgramImage> image, const Options& options);
+    ~Engine();
+
+    // Runs every instance to completion or failure.
+    Report run();
+
+    size_t size() const { return m_instances.size(); }
+    const Instance& instance(size_t index) const { return *m_instances[index]; }
+
+private:
+    struct WorkQueue {
+        std::mutex mtx;
+        std::deque<uint32_t> ids;
+    };
+
+    struct WorkerStats {
+        uint64_t slices = 0;
+        uint64_t steals = 0;
+        uint64_t parks = 0;
+    };
+
+    std::shared_ptr<const ProgramImage> m_image;
+    Options m_options;
+    InterruptManager m_interrupt_manager;
+    std::unique_ptr<FileServices> m_files;
+    std::vector<std::unique_ptr<Instance>> m_instances;
+    std::vector<std::unique_ptr<WorkQueue>> m_queues;
+    std::atomic<size_t> m_remaining {};
+    std::atomic<size_t> m_parked {};
+    std::atomic<uint32_t> m_wakeups {};     // bumped whenever an idle worker may have work
+    EventLoop m_events;
+
+    void work(size_t self, WorkerStats& stats);
+    bool take(size_t self, uint32_t& id, WorkerStats& stats);
+    void run_slice(Instance& instance, size_t self, uint32_t id, WorkerStats& stats);
+    void submit(uint32_t id);
+    // Guest console output of `instance`, formatted like ConsoleDevice::write().
+    void write(Instance& instance, std::string_view text) const;
+
+    // INT 21h services, called on whichever worker runs the instance, so
+    // each instance's output is only ever touched by one thread at a time.
+    void intr_write_char(Instance& instance, const Interrupt& intr);
+    void intr_write_string(Instance& instance, const Interrupt& intr);
+    void intr_read_char(Instance& instance, const Interrupt& intr);
+    void intr_get_system_date(Instance& instance, const Interrupt& intr);
+    void wake_workers();
+};
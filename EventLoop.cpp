@@ -0,0 +1,144 @@
+#include "EventLoop.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+EventLoop::EventLoop() {
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll < 0) {
+        throw std::runtime_error(std::string("Cannot create event loop: ") + std::strerror(errno));
+    }
+    m_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.fd = m_wakeup;
+    if (m_wakeup < 0 || epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &event) < 0) {
+        int error = errno;
+        if (m_wakeup >= 0) {
+            close(m_wakeup);
+        }
+        close(m_epoll);
+        throw std::runtime_error(std::string("Cannot create event loop: ") + std::strerror(error));
+    }
+}
+
+EventLoop::~EventLoop() {
+    close(m_wakeup);
+    close(m_epoll);
+}
+
+void EventLoop::submit_read(int fd, size_t count, ReadCallback done) {
+    {
+        std::lock_guard<std::mutex> lk(m_mtx);
+        auto& queue = m_requests[fd];
+        if (queue.empty() && !m_always_ready.contains(fd)) {
+            epoll_event event {};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+                if (errno != EPERM) {
+                    throw std::runtime_error(std::string("Cannot watch descriptor ") + std::to_string(fd) +
+                                             ": " + std::strerror(errno));
+                }
+                m_always_ready.insert(fd);
+            }
+        }
+        queue.push_back({ count, {}, std::move(done) });
+        ++m_pending;
+    }
+    // A poll() already waiting does not know about always-ready descriptors.
+    wake();
+}
+
+void EventLoop::service(int fd, std::vector<Completion>& completed) {
+    auto it = m_requests.find(fd);
+    if (it == m_requests.end() || it->second.empty()) {
+        return;
+    }
+    Request& request = it->second.front();
+
+    char buffer[4096];
+    const size_t want = std::min(request.count - request.data.size(), sizeof(buffer));
+    const ssize_t n = want ? read(fd, buffer, want) : 0;
+    int error = 0;
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        error = errno;
+    } else {
+        request.data.append(buffer, n);
+        if (n > 0 && request.data.size() < request.count) {
+            return;
+        }
+    }
+
+    completed.push_back({ std::move(request.done), std::move(request.data), error });
+    it->second.pop_front();
+    --m_pending;
+    if (it->second.empty()) {
+        if (!m_always_ready.erase(fd)) {
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        m_requests.erase(it);
+    }
+}
+
+size_t EventLoop::poll(int timeout_ms) {
+    std::vector<Completion> completed;
+    {
+        std::lock_guard<std::mutex> lk(m_mtx);
+        std::vector<int> ready(m_always_ready.begin(), m_always_ready.end());
+        for (int fd : ready) {
+            service(fd, completed);
+        }
+        if (!m_always_ready.empty()) {
+            timeout_ms = 0;
+        }
+    }
+    if (!completed.empty()) {
+        timeout_ms = 0;
+    }
+
+    epoll_event events[64];
+    int n = epoll_wait(m_epoll, events, std::size(events), timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR) {
+            throw std::runtime_error(std::string("Event loop wait failed: ") + std::strerror(errno));
+        }
+        n = 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        const int fd = events[i].data.fd;
+        if (fd == m_wakeup) {
+            uint64_t count;
+            while (read(m_wakeup, &count, sizeof(count)) > 0) {
+            }
+            continue;
+        }
+        std::lock_guard<std::mutex> lk(m_mtx);
+        service(fd, completed);
+    }
+
+    for (Completion& completion : completed) {
+        completion.done(completion.data, completion.error);
+    }
+    return completed.size();
+}
+
+void EventLoop::wake() {
+    const uint64_t one = 1;
+    [[maybe_unused]] ssize_t n = write(m_wakeup, &one, sizeof(one));
+}
+
+size_t EventLoop::pending() const {
+    std::lock_guard<std::mutex> lk(m_mtx);
+    return m_pending;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Completes reads from file descriptors without blocking the threads that
+// ask for them, on top of epoll.
+//
+// submit_read() may be called from any thread. Completions run on the thread
+// that calls poll(), with the mutex released. Reads from one descriptor are
+// served in the order they were submitted. Every readiness event does exactly
+// one read(), so descriptors shared with other code, such as stdin, never
+// have to be switched to non-blocking mode. epoll refuses regular files;
+// those are always ready and are read directly by poll().
+class EventLoop {
+public:
+    // `data` is what was read; it is shorter than asked for at end of file.
+    // `error` is an errno value, or 0.
+    using ReadCallback = std::function<void(std::string_view data, int error)>;
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Reads `count` bytes from `fd`, or as many as there are before end of file.
+    void submit_read(int fd, size_t count, ReadCallback done);
+
+    // Runs whatever completions are ready, waiting up to `timeout_ms` (-1: no
+    // limit) for the first one. Returns the number of completions run.
+    size_t poll(int timeout_ms);
+    // Makes a poll() that is waiting on another thread return.
+    void wake();
+    // Reads submitted and not yet completed.
+    size_t pending() const;
+
+private:
+    struct Request {
+        size_t count;
+        std::string data;
+        ReadCallback done;
+    };
+
+    struct Completion {
+        ReadCallback done;
+        std::string data;
+        int error;
+    };
+
+    int m_epoll = -1;
+    int m_wakeup = -1;      // eventfd
+    mutable std::mutex m_mtx;
+    std::unordered_map<int, std::deque<Request>> m_requests;
+    std::unordered_set<int> m_always_ready;     // regular files
+    size_t m_pending {};
+
+    // Does one read() for the oldest request on `fd`.
+    void service(int fd, std::vector<Completion>& completed);
+};
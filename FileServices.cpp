@@ -0,0 +1,409 @@
+#include "FileServices.h"
+#include "ConsoleDevice.h"
+#include "Interrupt.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// Builds the iovecs for [address, address + count) of guest memory, at most
+// IOV_MAX of them (one per page span).
+template<typename Span>
+size_t gather(std::vector<iovec>& iov, uint32_t address, size_t count, Span&& span) {
+    iov.clear();
+    size_t total = 0;
+    while (total < count && iov.size() < IOV_MAX) {
+        auto bytes = span(static_cast<uint32_t>(address + total), count - total);
+        iov.push_back({ const_cast<uint8_t*>(bytes.data()), bytes.size() });
+        total += bytes.size();
+    }
+    return total;
+}
+
+// openat() that fails with ELOOP on a link. With O_DIRECTORY, O_NOFOLLOW
+// alone reports ENOTDIR for a link, as for a plain file.
+int openat_nofollow(int dir, const char* name, int flags, mode_t mode) {
+    const int fd = openat(dir, name, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+    struct stat st;
+    if (fd < 0 && errno == ENOTDIR && fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode)) {
+        errno = ELOOP;
+    }
+    return fd;
+}
+
+}
+
+FileServices::FileServices(const std::filesystem::path& root) {
+    std::error_code ec;
+    m_root = std::filesystem::canonical(root, ec);
+    if (ec || !std::filesystem::is_directory(m_root)) {
+        throw std::invalid_argument("File services root is not a directory: " + root.string());
+    }
+    m_root_fd = open(m_root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (m_root_fd < 0) {
+        throw std::runtime_error("Cannot open file services root: " + m_root.string());
+    }
+}
+
+FileServices::~FileServices() {
+    if (m_manager) {
+        m_manager->remove_services(this);
+    }
+    for (auto& [vm, handles] : m_tables) {
+        for (size_t handle = FIRST_FILE_HANDLE; handle < MAX_HANDLES; ++handle) {
+            if ((*handles)[handle] >= 0) {
+                close((*handles)[handle]);
+            }
+        }
+    }
+    close(m_root_fd);
+}
+
+void FileServices::install(InterruptManager& manager) {
+    auto service = [this](void (FileServices::*handler)(const Interrupt&)) {
+        return [this, handler](const Interrupt& intr) { (this->*handler)(intr); };
+    };
+
+    m_manager = &manager;
+    manager.set_service(InterruptType::CreateFile, service(&FileServices::create_file), this);
+    manager.set_service(InterruptType::OpenFile, service(&FileServices::open_file), this);
+    manager.set_service(InterruptType::CloseFile, service(&FileServices::close_file), this);
+    manager.set_service(InterruptType::ReadFile, service(&FileServices::read_file), this);
+    manager.set_service(InterruptType::WriteFile, service(&FileServices::write_file), this);
+    manager.set_service(InterruptType::DeleteFile, service(&FileServices::delete_file), this);
+    manager.set_service(InterruptType::MoveFilePointer, service(&FileServices::move_file_pointer), this);
+}
+
+void FileServices::release(const VM& vm) {
+    std::unique_ptr<HandleTable> handles;
+    {
+        std::lock_guard<std::mutex> lk(m_mtx);
+        auto it = m_tables.find(&vm);
+        if (it == m_tables.end()) {
+            return;
+        }
+        handles = std::move(it->second);
+        m_tables.erase(it);
+    }
+    for (size_t handle = FIRST_FILE_HANDLE; handle < MAX_HANDLES; ++handle) {
+        if ((*handles)[handle] >= 0) {
+            close((*handles)[handle]);
+        }
+    }
+}
+
+FileServices::HandleTable& FileServices::table(const VM& vm) {
+    std::lock_guard<std::mutex> lk(m_mtx);
+    std::unique_ptr<HandleTable>& handles = m_tables[&vm];
+    if (!handles) {
+        handles = std::make_unique<HandleTable>();
+        handles->fill(-1);
+        (*handles)[0] = STDIN_FILENO;
+        (*handles)[1] = STDOUT_FILENO;
+        (*handles)[2] = STDERR_FILENO;
+    }
+    return *handles;
+}
+
+std::optional<std::filesystem::path> FileServices::resolve(const Interrupt& intr) const {
+    std::string name = intr.vm.memory().read_string(intr.registers.get(RegisterOpcode::EDX), 0);
+    std::replace(name.begin(), name.end(), '\\', '/');
+    name.erase(0, name.find_first_not_of('/'));
+
+    std::filesystem::path path = std::filesystem::path(name).lexically_normal();
+    if (!path.has_filename()) {
+        path = path.parent_path();
+    }
+    if (path.empty() || path == "." || *path.begin() == "..") {
+        return std::nullopt;
+    }
+    return path;
+}
+
+// The kernel resolves the path with RESOLVE_BENEATH, so a symlink, dangling or
+// not, that points outside the root fails with EXDEV instead of being followed,
+// and nothing can move the path out of the root between a check and the open.
+// Kernels without openat2() get a walk that follows no symlink at all.
+int FileServices::open_beneath(const std::filesystem::path& relative, int flags) const {
+    flags |= O_CLOEXEC;
+    const mode_t mode = (flags & O_CREAT) ? 0666 : 0;
+
+    open_how how {};
+    how.flags = static_cast<uint64_t>(flags);
+    how.mode = mode;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    const long fd = syscall(SYS_openat2, m_root_fd, relative.c_str(), &how, sizeof how);
+    if (fd >= 0 || errno != ENOSYS) {
+        return static_cast<int>(fd);
+    }
+
+    // resolve() left no `..` in the path, and O_NOFOLLOW refuses every link.
+    int dir = m_root_fd;
+    const std::filesystem::path parent = relative.parent_path();
+    for (const std::filesystem::path& component : parent) {
+        const int next = openat_nofollow(dir, component.c_str(), O_RDONLY | O_DIRECTORY, 0);
+        const int error = errno;
+        if (dir != m_root_fd) {
+            close(dir);
+        }
+        if (next < 0) {
+            errno = error;
+            return -1;
+        }
+        dir = next;
+    }
+    const int file = openat_nofollow(dir, relative.filename().c_str(), flags, mode);
+    const int error = errno;
+    if (dir != m_root_fd) {
+        close(dir);
+    }
+    errno = error;
+    return file;
+}
+
+void FileServices::open_handle(const Interrupt& intr, int flags) {
+    std::optional<std::filesystem::path> path = resolve(intr);
+    if (!path) {
+        fail(intr, AccessDenied);
+        return;
+    }
+
+    HandleTable& handles = table(intr.vm);
+    auto slot = std::find(handles.begin() + FIRST_FILE_HANDLE, handles.end(), -1);
+    if (slot == handles.end()) {
+        fail(intr, TooManyOpenFiles);
+        return;
+    }
+
+    const int fd = open_beneath(*path, flags);
+    if (fd < 0) {
+        fail(intr, error_from_errno(errno));
+        return;
+    }
+    if ((flags & O_ACCMODE) == O_RDONLY) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    *slot = fd;
+    intr.vm.registers().set(RegisterOpcode::AX, static_cast<uint32_t>(slot - handles.begin()));
+    succeed(intr);
+}
+
+int FileServices::descriptor(const Interrupt& intr) {
+    const uint32_t handle = intr.registers.get(RegisterOpcode::BX);
+    const int fd = handle < MAX_HANDLES ? table(intr.vm)[handle] : -1;
+    if (fd < 0) {
+        fail(intr, InvalidHandle);
+    }
+    return fd;
+}
+
+// AH=3Ch: CX holds DOS attributes, which have no host equivalent here.
+void FileServices::create_file(const Interrupt& intr) {
+    open_handle(intr, O_RDWR | O_CREAT | O_TRUNC);
+}
+
+// AH=3Dh: AL = 0 read, 1 write, 2 read/write.
+void FileServices::open_file(const Interrupt& intr) {
+    static constexpr int modes[] = { O_RDONLY, O_WRONLY, O_RDWR };
+    const uint32_t mode = intr.registers.get(RegisterOpcode::AL) & 0x07;
+    if (mode > 2) {
+        fail(intr, InvalidAccessCode);
+        return;
+    }
+    open_handle(intr, modes[mode]);
+}
+
+// AH=3Eh: the standard handles are only dropped from the table, never closed.
+void FileServices::close_file(const Interrupt& intr) {
+    const int fd = descriptor(intr);
+    if (fd < 0) {
+        return;
+    }
+    const uint32_t handle = intr.registers.get(RegisterOpcode::BX);
+    table(intr.vm)[handle] = -1;
+    if (handle >= FIRST_FILE_HANDLE && close(fd) != 0) {
+        fail(intr, error_from_errno(errno));
+        return;
+    }
+    succeed(intr);
+}
+
+// AH=3Fh: EAX = bytes read, 0 at end of file.
+void FileServices::read_file(const Interrupt& intr) {
+    const int fd = descriptor(intr);
+    if (fd < 0) {
+        return;
+    }
+    Memory& memory = intr.vm.memory();
+    const uint32_t address = intr.registers.get(RegisterOpcode::EDX);
+    const size_t count = intr.registers.get(RegisterOpcode::ECX);
+    memory.check(address, count);
+
+    std::vector<iovec> iov;
+    size_t done = 0;
+    while (done < count) {
+        const size_t want = gather(iov, address + done, count - done, [&](uint32_t at, size_t n) {
+            return memory.writable_span(at, n);
+        });
+        const ssize_t n = readv(fd, iov.data(), static_cast<int>(iov.size()));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail(intr, error_from_errno(errno));
+            return;
+        }
+        done += n;
+        if (static_cast<size_t>(n) < want) {
+            break;
+        }
+    }
+    intr.vm.registers().set(RegisterOpcode::EAX, static_cast<uint32_t>(done));
+    succeed(intr);
+}
+
+// AH=40h: EAX = bytes written. ECX = 0 truncates the file at the file pointer.
+void FileServices::write_file(const Interrupt& intr) {
+    const int fd = descriptor(intr);
+    if (fd < 0) {
+        return;
+    }
+    const Memory& memory = intr.vm.memory();
+    const uint32_t address = intr.registers.get(RegisterOpcode::EDX);
+    const size_t count = intr.registers.get(RegisterOpcode::ECX);
+    memory.check(address, count);
+
+    if (m_output && (fd == STDOUT_FILENO || fd == STDERR_FILENO)) {
+        std::string text(count, '\0');
+        memory.read(address, text.data(), count);
+        m_output(intr.vm, text);
+        intr.vm.registers().set(RegisterOpcode::EAX, static_cast<uint32_t>(count));
+        succeed(intr);
+        return;
+    }
+    if (count == 0) {
+        const off_t position = lseek(fd, 0, SEEK_CUR);
+        if (position < 0 || ftruncate(fd, position) != 0) {
+            fail(intr, error_from_errno(errno));
+            return;
+        }
+        intr.vm.registers().set(RegisterOpcode::EAX, 0);
+        succeed(intr);
+        return;
+    }
+    if (m_console && (fd == STDOUT_FILENO || fd == STDERR_FILENO)) {
+        m_console->flush();
+    }
+
+    std::vector<iovec> iov;
+    size_t done = 0;
+    while (done < count) {
+        gather(iov, address + done, count - done, [&](uint32_t at, size_t n) {
+            return memory.readable_span(at, n);
+        });
+        const ssize_t n = writev(fd, iov.data(), static_cast<int>(iov.size()));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail(intr, error_from_errno(errno));
+            return;
+        }
+        done += n;
+    }
+    intr.vm.registers().set(RegisterOpcode::EAX, static_cast<uint32_t>(done));
+    succeed(intr);
+}
+
+// AH=41h: the directory is opened beneath the root and the name removed from
+// it, so a symlink is deleted itself and never the file it points to.
+void FileServices::delete_file(const Interrupt& intr) {
+    std::optional<std::filesystem::path> path = resolve(intr);
+    if (!path) {
+        fail(intr, AccessDenied);
+        return;
+    }
+    const std::filesystem::path parent = path->has_parent_path() ? path->parent_path() : ".";
+    const int dir = open_beneath(parent, O_RDONLY | O_DIRECTORY);
+    if (dir < 0) {
+        fail(intr, error_from_errno(errno));
+        return;
+    }
+    const int result = unlinkat(dir, path->filename().c_str(), 0);
+    const int error = errno;
+    close(dir);
+    if (result != 0) {
+        fail(intr, error_from_errno(error));
+        return;
+    }
+    succeed(intr);
+}
+
+// AH=42h: CX:DX is a signed offset from the start (AL=0), the current
+// position (AL=1) or the end (AL=2); the new position is returned in DX:AX.
+void FileServices::move_file_pointer(const Interrupt& intr) {
+    static constexpr int whence[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+    const int fd = descriptor(intr);
+    if (fd < 0) {
+        return;
+    }
+    const uint32_t method = intr.registers.get(RegisterOpcode::AL);
+    if (method > 2) {
+        fail(intr, InvalidFunction);
+        return;
+    }
+    const auto offset = static_cast<int32_t>((intr.registers.get(RegisterOpcode::CX) << 16) |
+                                             intr.registers.get(RegisterOpcode::DX));
+    const off_t position = lseek(fd, offset, whence[method]);
+    if (position < 0) {
+        fail(intr, error_from_errno(errno));
+        return;
+    }
+    Registers& regs = intr.vm.registers();
+    regs.set(RegisterOpcode::DX, static_cast<uint32_t>(position >> 16) & 0xFFFF);
+    regs.set(RegisterOpcode::AX, static_cast<uint32_t>(position) & 0xFFFF);
+    succeed(intr);
+}
+
+void FileServices::succeed(const Interrupt& intr) {
+    intr.vm.registers().set_flag(Flag::Carry, false);
+}
+
+void FileServices::fail(const Interrupt& intr, uint16_t error) {
+    Registers& regs = intr.vm.registers();
+    regs.set_flag(Flag::Carry, true);
+    regs.set(RegisterOpcode::AX, error);
+}
+
+uint16_t FileServices::error_from_errno(int error) {
+    switch (error) {
+        case ENOENT:
+            return FileNotFound;
+        case ENOTDIR:
+        case ENAMETOOLONG:
+            return PathNotFound;
+        case EXDEV:         // open_beneath(): the path leads out of the root
+        case ELOOP:         // or through a link it does not follow
+            return AccessDenied;
+        case EMFILE:
+        case ENFILE:
+            return TooManyOpenFiles;
+        case EBADF:
+            return InvalidHandle;
+        case EINVAL:
+            return InvalidFunction;
+        default:
+            return AccessDenied;
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "InterruptManager.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+class ConsoleDevice;
+class VM;
+
+// DOS file services, INT 21h AH=3Ch-42h, on host files below a sandbox root.
+//
+// Every VM has a handle table of its own. Handles 0-2 are the host's standard
+// streams; files opened by the guest get handles from 5 up. Guest paths are
+// taken relative to the root, with or without a leading slash or backslash,
+// and are opened beneath a descriptor of the root, so neither `..` nor a
+// symlink can reach a host file outside it. Addresses are flat: the
+// name or buffer is at EDX, and reads and writes move ECX bytes between a
+// descriptor and guest memory with one readv/writev over the guest pages.
+// Failures set CF and return the DOS error code in AX.
+class FileServices {
+public:
+    enum Error : uint16_t {
+        InvalidFunction     = 0x01,
+        FileNotFound        = 0x02,
+        PathNotFound        = 0x03,
+        TooManyOpenFiles    = 0x04,
+        AccessDenied        = 0x05,
+        InvalidHandle       = 0x06,
+        InvalidAccessCode   = 0x0C,
+    };
+
+    static constexpr size_t MAX_HANDLES = 64;
+    static constexpr size_t FIRST_FILE_HANDLE = 5;
+
+    explicit FileServices(const std::filesystem::path& root);
+    ~FileServices();
+
+    FileServices(const FileServices&) = delete;
+    FileServices& operator=(const FileServices&) = delete;
+
+    // Installs AH=3Ch-42h in `manager`; they are removed again on destruction.
+    void install(InterruptManager& manager);
+    // Closes every file `vm` has open.
+    void release(const VM& vm);
+    // Flushed before writes to handles 1 and 2, so output stays in order.
+    void set_console(ConsoleDevice* console) { m_console = console; }
+    // Takes writes to handles 1 and 2 instead of the host's streams, for
+    // hosts that collect each VM's output themselves.
+    using Output = std::function<void(VM& vm, std::string_view text)>;
+    void set_output(Output output) { m_output = std::move(output); }
+
+    const std::filesystem::path& root() const { return m_root; }
+
+private:
+    using HandleTable = std::array<int, MAX_HANDLES>;   // host descriptor, or -1
+
+    std::filesystem::path m_root;
+    int m_root_fd = -1;                                 // O_PATH descriptor of m_root
+    InterruptManager* m_manager = nullptr;
+    ConsoleDevice* m_console = nullptr;
+    Output m_output;
+    // Guards the map only: a table is used by the one thread running its VM.
+    std::mutex m_mtx;
+    std::unordered_map<const VM*, std::unique_ptr<HandleTable>> m_tables;
+
+    HandleTable& table(const VM& vm);
+    // The ASCIIZ name at EDX as a normal path relative to the root, or
+    // nothing if it is empty or climbs out of the root.
+    std::optional<std::filesystem::path> resolve(const Interrupt& intr) const;
+    // openat() of `relative` beneath the root, following no symlink out of it.
+    // Returns -1 with errno set on failure.
+    int open_beneath(const std::filesystem::path& relative, int flags) const;
+    void open_handle(const Interrupt& intr, int flags);
+    // Host descriptor of the handle in BX, or -1 after reporting InvalidHandle.
+    int descriptor(const Interrupt& intr);
+
+    void create_file(const Interrupt& intr);
+    void open_file(const Interrupt& intr);
+    void close_file(const Interrupt& intr);
+    void read_file(const Interrupt& intr);
+    void write_file(const Interrupt& intr);
+    void delete_file(const Interrupt& intr);
+    void move_file_pointer(const Interrupt& intr);
+
+    static void succeed(const Interrupt& intr);
+    static void fail(const Interrupt& intr, uint16_t error);
+    static uint16_t error_from_errno(int error);
+};
@@ -0,0 +1,73 @@
+#include "Fusion.h"
+
+#include <sstream>
+
+bool Fusion::is_plain_source(OperandKind kind) {
+    return kind == OperandKind::Register || kind == OperandKind::Immediate;
+}
+
+bool Fusion::is_reg_source_pair(const DecodedInstruction& instr, InstructionOpcode opcode) {
+    return instr.opcode == opcode && instr.argc == 2 &&
+           instr.kinds[0] == OperandKind::Register && is_plain_source(instr.kinds[1]);
+}
+
+bool Fusion::is_conditional_jump(const DecodedInstruction& instr) {
+    return is_jump_opcode(instr.opcode) && instr.opcode != InstructionOpcode::JMP &&
+           instr.kinds[0] == OperandKind::Target;
+}
+
+InstructionOpcode Fusion::fuse(const DecodedInstruction& first, const DecodedInstruction& second) {
+    if (is_reg_source_pair(first, InstructionOpcode::CMP) && is_conditional_jump(second)) {
+        return InstructionOpcode::CMP_JCC;
+    }
+
+    if (first.opcode == InstructionOpcode::DEC && first.argc == 1 && first.kinds[0] == OperandKind::Register &&
+        (second.opcode == InstructionOpcode::JNZ || second.opcode == InstructionOpcode::JNE) &&
+        second.kinds[0] == OperandKind::Target) {
+        return InstructionOpcode::DEC_JNZ;
+    }
+
+    if (is_reg_source_pair(first, InstructionOpcode::MOV) && is_reg_source_pair(second, InstructionOpcode::ADD)) {
+        return InstructionOpcode::MOV_ADD;
+    }
+
+    return InstructionOpcode::INVALID;
+}
+
+void Fusion::run(std::vector<DecodedInstruction>& code) {
+    for (size_t i = 0; i + 1 < code.size(); ++i) {
+        InstructionOpcode fused = fuse(code[i], code[i + 1]);
+        if (fused != InstructionOpcode::INVALID) {
+            code[i].opcode = fused;
+            if (fused == InstructionOpcode::CMP_JCC) {
+                code[i].condition = static_cast<uint8_t>(compare_condition(code[i + 1].opcode));
+            }
+            ++i;    // the second half cannot start another pair
+        }
+    }
+}
+
+Fusion::Stats Fusion::analyze(std::span<const DecodedInstruction> code) {
+    Stats stats;
+    stats.instructions = code.size();
+
+    for (const DecodedInstruction& instr : code) {
+        switch (instr.opcode) {
+            case InstructionOpcode::CMP_JCC: ++stats.cmp_jcc; break;
+            case InstructionOpcode::DEC_JNZ: ++stats.dec_jnz; break;
+            case InstructionOpcode::MOV_ADD: ++stats.mov_add; break;
+            default: break;
+        }
+    }
+
+    return stats;
+}
+
+std::string Fusion::report(const Stats& stats, uint64_t executed) {
+    std::ostringstream ss;
+    ss << "fusion: " << stats.fused_pairs() << " pairs over " << stats.instructions << " instructions ("
+       << stats.hit_rate() * 100.0 << "% fused; CMP+Jcc " << stats.cmp_jcc
+       << ", DEC+JNZ " << stats.dec_jnz << ", MOV+ADD " << stats.mov_add << "), "
+       << executed << " fused pairs executed";
+    return ss.str();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+#include "Instruction.h"
+
+// Peephole pass that fuses common instruction pairs into superinstructions:
+//
+//   CMP reg, reg/imm + Jcc target   ->  CMP_JCC (with the Jcc's CompareCondition)
+//   DEC reg          + JNZ target   ->  DEC_JNZ
+//   MOV reg, reg/imm + ADD reg, reg/imm  ->  MOV_ADD
+//
+// Only the first record of a pair is rewritten; the second is left in place and
+// read by the fused handler. Instruction indices therefore do not move, and a
+// jump into the middle of a pair still runs the original second instruction.
+class Fusion {
+public:
+    struct Stats {
+        size_t instructions = 0;
+        size_t cmp_jcc = 0;
+        size_t dec_jnz = 0;
+        size_t mov_add = 0;
+
+        size_t fused_pairs() const { return cmp_jcc + dec_jnz + mov_add; }
+        // Share of instructions that are part of a fused pair.
+        double hit_rate() const { return instructions ? 2.0 * fused_pairs() / instructions : 0.0; }
+    };
+
+    static void run(std::vector<DecodedInstruction>& code);
+    static Stats analyze(std::span<const DecodedInstruction> code);
+    // `executed` is the number of fused pairs the VM actually dispatched.
+    static std::string report(const Stats& stats, uint64_t executed);
+
+private:
+    static bool is_plain_source(OperandKind kind);
+    static bool is_reg_source_pair(const DecodedInstruction& instr, InstructionOpcode opcode);
+    static bool is_conditional_jump(const DecodedInstruction& instr);
+    static InstructionOpcode fuse(const DecodedInstruction& first, const DecodedInstruction& second);
+};
@@ -1,8 +1,12 @@
 #pragma once
 
 #include <variant>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 
-enum class InstructionOpcode {
+enum class InstructionOpcode : uint8_t {
     MOV,
     ADD,
     SUB,
@@ -54,10 +58,130 @@ enum class InstructionOpcode {
     SHL,
     SHR,
     INT,
+    CALL,
+    RET,
+    ENTER,
+    LEAVE,
+    // String instructions: operands are implicit (ESI, EDI, ECX, AL/AX/EAX).
+    MOVSB, MOVSW, MOVSD,
+    STOSB, STOSW, STOSD,
+    LODSB, LODSW, LODSD,
+    SCASB, SCASW, SCASD,
+    CMPSB, CMPSW, CMPSD,
+    CLD,
+    STD,
+    IRET,
+    HLT,
+    // Superinstructions produced by Fusion; the assembler never emits them.
+    CMP_JCC,
+    DEC_JNZ,
+    MOV_ADD,
     INVALID
 };
 
-enum class RegisterOpcode {
+inline constexpr size_t OPCODE_COUNT = static_cast<size_t>(InstructionOpcode::INVALID) + 1;
+
+constexpr bool is_jump_opcode(InstructionOpcode op) {
+    switch (op) {
+        case InstructionOpcode::JMP:
+        case InstructionOpcode::JE:   case InstructionOpcode::JNE:
+        case InstructionOpcode::JZ:   case InstructionOpcode::JNZ:
+        case InstructionOpcode::JA:   case InstructionOpcode::JNBE:
+        case InstructionOpcode::JAE:  case InstructionOpcode::JNB:
+        case InstructionOpcode::JB:   case InstructionOpcode::JNAE:
+        case InstructionOpcode::JBE:  case InstructionOpcode::JNA:
+        case InstructionOpcode::JG:   case InstructionOpcode::JNLE:
+        case InstructionOpcode::JGE:  case InstructionOpcode::JNL:
+        case InstructionOpcode::JL:   case InstructionOpcode::JNGE:
+        case InstructionOpcode::JLE:  case InstructionOpcode::JNG:
+        case InstructionOpcode::JC:   case InstructionOpcode::JNC:
+        case InstructionOpcode::JO:   case InstructionOpcode::JNO:
+        case InstructionOpcode::JS:   case InstructionOpcode::JNS:
+        case InstructionOpcode::JP:   case InstructionOpcode::JPE:
+        case InstructionOpcode::JNP:  case InstructionOpcode::JPO:
+            return true;
+        default:
+            return false;
+    }
+}
+
+constexpr bool is_fused_opcode(InstructionOpcode op) {
+    return op == InstructionOpcode::CMP_JCC || op == InstructionOpcode::DEC_JNZ ||
+           op == InstructionOpcode::MOV_ADD;
+}
+
+constexpr bool is_string_opcode(InstructionOpcode op) {
+    return op >= InstructionOpcode::MOVSB && op <= InstructionOpcode::CMPSD;
+}
+
+// Element size of a string instruction: the B/W/D suffix.
+constexpr uint32_t string_operand_width(InstructionOpcode op) {
+    const auto index = static_cast<uint32_t>(op) - static_cast<uint32_t>(InstructionOpcode::MOVSB);
+    return 1u << (index % 3);
+}
+
+constexpr bool is_subroutine_opcode(InstructionOpcode op) {
+    return op == InstructionOpcode::CALL || op == InstructionOpcode::RET;
+}
+
+// INT may enter a guest interrupt handler, IRET leaves one.
+constexpr bool is_interrupt_opcode(InstructionOpcode op) {
+    return op == InstructionOpcode::INT || op == InstructionOpcode::IRET;
+}
+
+// Instructions whose handler sets the pc itself: jumps, CALL/RET, INT/IRET,
+// HLT and fused pairs.
+constexpr bool transfers_control(InstructionOpcode op) {
+    return is_jump_opcode(op) || is_subroutine_opcode(op) || is_interrupt_opcode(op) || is_fused_opcode(op) ||
+           op == InstructionOpcode::HLT;
+}
+
+// What the Jcc of a fused CMP+Jcc tests, in terms of the compared values.
+// Fusion stores it in the fused record so the handler need not decode the Jcc.
+enum class CompareCondition : uint8_t {
+    Equal, NotEqual,
+    Above, AboveOrEqual, Below, BelowOrEqual,           // unsigned
+    Greater, GreaterOrEqual, Less, LessOrEqual,         // signed
+    Overflow, NoOverflow, Sign, NoSign,
+    Parity, NoParity,                                   // CMP leaves PF as it was
+    COUNT
+};
+
+constexpr CompareCondition compare_condition(InstructionOpcode jcc) {
+    switch (jcc) {
+        case InstructionOpcode::JE:   case InstructionOpcode::JZ:   return CompareCondition::Equal;
+        case InstructionOpcode::JNE:  case InstructionOpcode::JNZ:  return CompareCondition::NotEqual;
+        case InstructionOpcode::JA:   case InstructionOpcode::JNBE: return CompareCondition::Above;
+        case InstructionOpcode::JAE:  case InstructionOpcode::JNB:
+        case InstructionOpcode::JNC:                                return CompareCondition::AboveOrEqual;
+        case InstructionOpcode::JB:   case InstructionOpcode::JNAE:
+        case InstructionOpcode::JC:                                 return CompareCondition::Below;
+        case InstructionOpcode::JBE:  case InstructionOpcode::JNA:  return CompareCondition::BelowOrEqual;
+        case InstructionOpcode::JG:   case InstructionOpcode::JNLE: return CompareCondition::Greater;
+        case InstructionOpcode::JGE:  case InstructionOpcode::JNL:  return CompareCondition::GreaterOrEqual;
+        case InstructionOpcode::JL:   case InstructionOpcode::JNGE: return CompareCondition::Less;
+        case InstructionOpcode::JLE:  case InstructionOpcode::JNG:  return CompareCondition::LessOrEqual;
+        case InstructionOpcode::JO:                                 return CompareCondition::Overflow;
+        case InstructionOpcode::JNO:                                return CompareCondition::NoOverflow;
+        case InstructionOpcode::JS:                                 return CompareCondition::Sign;
+        case InstructionOpcode::JNS:                                return CompareCondition::NoSign;
+        case InstructionOpcode::JP:   case InstructionOpcode::JPE:  return CompareCondition::Parity;
+        case InstructionOpcode::JNP:  case InstructionOpcode::JPO:  return CompareCondition::NoParity;
+        default:                                                    return CompareCondition::COUNT;
+    }
+}
+
+// Opcode of the first half of a fused pair; other opcodes map to themselves.
+constexpr InstructionOpcode base_opcode(InstructionOpcode op) {
+    switch (op) {
+        case InstructionOpcode::CMP_JCC: return InstructionOpcode::CMP;
+        case InstructionOpcode::DEC_JNZ: return InstructionOpcode::DEC;
+        case InstructionOpcode::MOV_ADD: return InstructionOpcode::MOV;
+        default:                         return op;
+    }
+}
+
+enum class RegisterOpcode : uint8_t {
     EAX, AX, AH, AL,
     EBX, BX, BH, BL,
     ECX, CX, CH, CL,
@@ -75,6 +199,7 @@ enum class Flag : uint8_t {
     Auxiliary = 4,
     Zero      = 6,
     Sign      = 7,
+    Direction = 10,
     Overflow = 11
 };
 
@@ -84,3 +209,73 @@ struct Instruction {
 	InstructionOpcode opcode;
 	std::vector<InstructionArg> operands;
 };
+
+enum class OperandKind : uint8_t {
+    None,
+    Register,
+    Immediate,
+    Float,
+    Target,     // resolved absolute branch target (program index) of a jump
+    Mem8,       // memory operand [mem_base + value] of the given width
+    Mem16,
+    Mem32
+};
+
+constexpr bool is_memory_operand(OperandKind kind) {
+    return kind == OperandKind::Mem8 || kind == OperandKind::Mem16 || kind == OperandKind::Mem32;
+}
+
+constexpr uint32_t memory_operand_width(OperandKind kind) {
+    return kind == OperandKind::Mem8 ? 1 : kind == OperandKind::Mem16 ? 2 : 4;
+}
+
+// Repeat prefix of a string instruction.
+enum class RepPrefix : uint8_t {
+    None,
+    Rep,        // REP: repeat ECX times
+    RepE,       // REPE/REPZ: also stop when ZF is clear
+    RepNE       // REPNE/REPNZ: also stop when ZF is set
+};
+
+// Width in bytes of a register view: EAX 4, AX 2, AH/AL 1.
+constexpr uint32_t register_width(RegisterOpcode reg) {
+    const auto index = static_cast<uint32_t>(reg);
+    if (index < static_cast<uint32_t>(RegisterOpcode::ESI)) {
+        return index % 4 == 0 ? 4 : index % 4 == 1 ? 2 : 1;
+    }
+    return index % 2 == 0 ? 4 : 2;
+}
+
+// Fixed-size form of an Instruction as the VM executes it: operands are stored
+// inline as register indices or raw 32-bit immediates. argc keeps the parsed
+// operand count so handlers still report arity errors. A memory operand keeps
+// its displacement in `values` and its base register in `mem_base`; there is
+// at most one per instruction. String instructions keep their repeat prefix
+// in `prefix`. A fused CMP+Jcc keeps its CompareCondition in `condition`.
+struct DecodedInstruction {
+    static constexpr size_t MAX_OPERANDS = 2;
+    static constexpr uint8_t NO_BASE = 0xFF;
+
+    InstructionOpcode opcode;
+    uint8_t argc;
+    OperandKind kinds[MAX_OPERANDS];
+    uint8_t mem_base;
+    RepPrefix prefix;
+    uint8_t condition;
+    uint8_t reserved;
+    uint32_t values[MAX_OPERANDS];
+
+    RegisterOpcode reg(size_t index) const { return static_cast<RegisterOpcode>(values[index]); }
+};
+
+// Marks the single immediate operand of a jump or CALL as a resolved target,
+// so the branch handlers can take it without any operand checks.
+inline void bind_branch_target(DecodedInstruction& instr) {
+    const bool has_target = is_jump_opcode(instr.opcode) || instr.opcode == InstructionOpcode::CALL;
+    if (has_target && instr.argc == 1 && instr.kinds[0] == OperandKind::Immediate) {
+        instr.kinds[0] = OperandKind::Target;
+    }
+}
+
+static_assert(std::is_trivially_copyable_v<DecodedInstruction>);
+static_assert(sizeof(DecodedInstruction) == 16);
@@ -5,6 +5,8 @@
 #include <variant>
 #include <functional>
 
+class VM;
+
 enum class InterruptType : uint8_t {
     // --- Console I/O ---
     ReadCharWithEcho        = 0x01, // AH=01h: read character with echo (stdin)
@@ -61,9 +63,11 @@ enum class InterruptType : uint8_t {
 
 struct Interrupt {
     static constexpr int API = 0x21;
+    static constexpr char END_OF_INPUT = 0x1A;     // Ctrl-Z: what a read returns once input runs out
 
     InterruptType type;
     const Registers& registers;
+    VM& vm;     // the VM that raised it; hosts running several VMs tell them apart by this
 
-    Interrupt(InterruptType t, const Registers& reg) : type(t), registers(reg) {}
+    Interrupt(InterruptType t, const Registers& reg, VM& raised_by) : type(t), registers(reg), vm(raised_by) {}
 };
\ No newline at end of file
@@ -1,22 +1,139 @@
 #include "InterruptManager.h"
 #include "Interrupt.h"
+#include "VM.h"
 
-void InterruptManager::register_handler(IInterruptHandler& handler) {
-    std::lock_guard<std::mutex> lk(m_mtx);
-    m_handlers.push_back(&handler);
+#include <thread>
+
+InterruptManager::InterruptManager() : m_table(new VectorTable()) {
+    set_default_service(&InterruptManager::invalid_function);
+
+    set_service(InterruptType::SetInterruptVector, [](const Interrupt& intr) {
+        intr.vm.set_vector(intr.registers.get(RegisterOpcode::AL), intr.registers.get(RegisterOpcode::EDX));
+    });
+    set_service(InterruptType::GetInterruptVector, [](const Interrupt& intr) {
+        intr.vm.registers().set(RegisterOpcode::EBX, intr.vm.get_vector(intr.registers.get(RegisterOpcode::AL)));
+    });
+
+    set_service(InterruptType::TerminateProcess, [](const Interrupt& intr) {
+        intr.vm.halt(static_cast<uint8_t>(intr.registers.get(RegisterOpcode::AL)));
+    });
+    // AL = exit code of the last program that terminated, AH = 0 (normal end).
+    set_service(InterruptType::GetReturnCode, [](const Interrupt& intr) {
+        intr.vm.registers().set(RegisterOpcode::AX, intr.vm.exit_code());
+    });
+
+    // EBX paragraphs -> EAX = address; on failure AX = 8 (insufficient
+    // memory) and EBX = the largest block available.
+    set_service(InterruptType::AllocateMemory, [](const Interrupt& intr) {
+        Registers& regs = intr.vm.registers();
+        BuddyAllocator& heap = intr.vm.heap();
+        const uint32_t address = heap.allocate(intr.registers.get(RegisterOpcode::EBX));
+        regs.set_flag(Flag::Carry, address == BuddyAllocator::NO_BLOCK);
+        if (address == BuddyAllocator::NO_BLOCK) {
+            regs.set(RegisterOpcode::AX, 8);
+            regs.set(RegisterOpcode::EBX, heap.largest_free());
+            return;
+        }
+        regs.set(RegisterOpcode::EAX, address);
+    });
+    // Frees the block at EDX; AX = 9 (invalid block) if there is none.
+    set_service(InterruptType::FreeMemory, [](const Interrupt& intr) {
+        Registers& regs = intr.vm.registers();
+        const bool freed = intr.vm.heap().free(intr.registers.get(RegisterOpcode::EDX));
+        regs.set_flag(Flag::Carry, !freed);
+        if (!freed) {
+            regs.set(RegisterOpcode::AX, 9);
+        }
+    });
+}
+
+InterruptManager::~InterruptManager() {
+    delete m_table.load();
 }
 
-void InterruptManager::unregister_handler(IInterruptHandler& handler) {
+size_t InterruptManager::reader_shard() {
+    static std::atomic<size_t> next_shard {};
+    thread_local const size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+    return shard;
+}
+
+void InterruptManager::invalid_function(const Interrupt& intr) {
+    Registers& regs = intr.vm.registers();
+    regs.set_flag(Flag::Carry, true);
+    regs.set(RegisterOpcode::AX, 1);
+}
+
+template<typename F>
+void InterruptManager::update(F&& change) {
     std::lock_guard<std::mutex> lk(m_mtx);
-    m_handlers.erase(
-        std::remove(m_handlers.begin(), m_handlers.end(), &handler),
-        m_handlers.end()
-    );
+    auto next = new VectorTable(*m_table.load());
+    change(*next);
+    publish(next);
+}
+
+void InterruptManager::set_service(InterruptType type, Service service, const void* owner) {
+    update([&](VectorTable& table) {
+        table.entries[static_cast<uint8_t>(type)] = { std::move(service), owner };
+    });
+}
+
+void InterruptManager::set_default_service(Service service) {
+    update([&](VectorTable& table) { table.fallback = std::move(service); });
+}
+
+void InterruptManager::remove_services(const void* owner) {
+    update([&](VectorTable& table) {
+        for (Entry& entry : table.entries) {
+            if (entry.owner == owner) {
+                entry = {};
+            }
+        }
+    });
+}
+
+void InterruptManager::register_handler(IInterruptHandler& handler, std::initializer_list<InterruptType> services) {
+    update([&](VectorTable& table) {
+        for (InterruptType type : services) {
+            table.entries[static_cast<uint8_t>(type)] = {
+                [&handler](const Interrupt& intr) { handler.handle_interrupt(intr); }, &handler };
+        }
+    });
+}
+
+// Swaps in `next`, then waits for a grace period: every reader that may have
+// loaded the old table bumped a counter of one parity or the other before
+// the swap, so both are drained in turn. Flipping the epoch before each wait
+// moves newly arriving readers to the other parity, so a steady stream of
+// interrupts cannot hold the writer off forever.
+void InterruptManager::publish(const VectorTable* next) {
+    const VectorTable* old = m_table.exchange(next);
+
+    for (int round = 0; round < 2; ++round) {
+        const uint32_t parity = m_epoch.fetch_add(1) & 1;
+        for (ReaderShard& shard : m_readers) {
+            while (shard.active[parity].load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    delete old;
 }
 
 void InterruptManager::notify(const Interrupt& intr) {
-    std::lock_guard<std::mutex> lk(m_mtx);
-    for (auto handler : m_handlers) {
-        handler->handle_interrupt(intr);
+    ReaderShard& shard = m_readers[reader_shard()];
+    const uint32_t parity = m_epoch.load() & 1;
+    shard.active[parity].fetch_add(1);
+
+    struct Leave {
+        std::atomic<uint32_t>& active;
+        ~Leave() { active.fetch_sub(1, std::memory_order_release); }
+    } leave { shard.active[parity] };
+
+    const VectorTable& table = *m_table.load();
+    const Entry& entry = table.entries[static_cast<uint8_t>(intr.type)];
+    if (entry.service) [[likely]] {
+        entry.service(intr);
+    } else if (table.fallback) {
+        table.fallback(intr);
     }
-}
\ No newline at end of file
+}
@@ -1,15 +1,81 @@
 #pragma once
 
 #include "IInterruptHandler.h"
-#include <vector>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
 #include <mutex>
 
+// Host side of INT 21h: a 256-entry service table indexed by AH.
+//
+// notify() takes no lock and makes one indexed call. It reads an immutable
+// snapshot of the table through an atomic pointer, so VMs on many threads can
+// raise interrupts without serializing. Changes to the table copy it,
+// publish the new snapshot and then wait out a grace period, RCU style:
+// every notify() that could still be reading the old snapshot has to finish
+// before it is freed. Once remove_services() returns, none of the removed
+// services will be called again. Because of that wait, services must not
+// change the table themselves.
+//
+// Services without an entry go to the default service. Out of the box it
+// reports DOS error 1 (invalid function): CF set and AX = 1. The services
+// that only act on the raising VM are installed from the start: vectors
+// (25h/35h), memory (48h/49h) and termination (4Ch/59h).
 class InterruptManager {
 public:
-    void register_handler(IInterruptHandler& handler);
-    void unregister_handler(IInterruptHandler& handler);
+    using Service = std::function<void(const Interrupt& intr)>;
+
+    InterruptManager();
+    ~InterruptManager();
+
+    InterruptManager(const InterruptManager&) = delete;
+    InterruptManager& operator=(const InterruptManager&) = delete;
+
+    // Installs `service` for AH = `type`; `owner` tags it for remove_services().
+    void set_service(InterruptType type, Service service, const void* owner = nullptr);
+    void set_default_service(Service service);
+    // Removes every service installed with `owner`.
+    void remove_services(const void* owner);
+
+    // Routes the listed services to `handler`.
+    void register_handler(IInterruptHandler& handler, std::initializer_list<InterruptType> services);
+    void unregister_handler(IInterruptHandler& handler) { remove_services(&handler); }
+
     void notify(const Interrupt& intr);
+
+    // The default service: CF = 1, AX = 1.
+    static void invalid_function(const Interrupt& intr);
+
 private:
-    std::vector<IInterruptHandler*> m_handlers;
-    std::mutex m_mtx;
-};
\ No newline at end of file
+    static constexpr size_t VECTOR_COUNT = 256;
+
+    struct Entry {
+        Service service;
+        const void* owner = nullptr;
+    };
+
+    struct VectorTable {
+        std::array<Entry, VECTOR_COUNT> entries;
+        Service fallback;
+    };
+
+    // Readers in flight, split by grace-period parity and spread over
+    // cache-line sized shards so that threads do not share a counter.
+    static constexpr size_t SHARDS = 64;
+    struct alignas(64) ReaderShard {
+        std::atomic<uint32_t> active[2] {};
+    };
+
+    std::atomic<const VectorTable*> m_table;
+    std::atomic<uint32_t> m_epoch {};
+    std::array<ReaderShard, SHARDS> m_readers;
+    std::mutex m_mtx;   // serializes writers only
+
+    template<typename F>
+    void update(F&& change);
+    void publish(const VectorTable* next);
+    static size_t reader_shard();
+};
@@ -0,0 +1,483 @@
+#include "Jit.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+// Host registers used by generated code. rbx holds the Registers pointer for
+// the whole block; eax/ecx/edx/esi are scratch.
+enum HostReg : uint8_t { EAX = 0, ECX = 1, EDX = 2, ESI = 6 };
+
+// x86 condition codes (low nibble of Jcc/CMOVcc).
+enum Cond : uint8_t {
+    CC_O = 0x0, CC_NO = 0x1, CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_S = 0x8, CC_NS = 0x9, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF, CC_NONE = 0xFF
+};
+
+// Opcode bytes of "op r/m32, r32" and the /digit of the matching "op r/m32, imm8" form.
+enum AluOp : uint8_t { ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31,
+                       ALU_CMP = 0x39, ALU_MOV = 0x89, ALU_TEST = 0x85 };
+enum ImmOp : uint8_t { IMM_ADD = 0, IMM_AND = 4, IMM_SUB = 5, IMM_CMP = 7 };
+enum ShiftOp : uint8_t { SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+
+class CodeBuffer {
+public:
+    std::vector<uint8_t> bytes;
+
+    void u8(uint8_t b) { bytes.push_back(b); }
+    void u32(uint32_t v) { for (int i = 0; i < 4; ++i) u8(uint8_t(v >> (8 * i))); }
+    void u64(uint64_t v) { for (int i = 0; i < 8; ++i) u8(uint8_t(v >> (8 * i))); }
+
+    // ModRM + disp32 for [rbx + disp].
+    void mem(uint8_t reg, int32_t disp) { u8(0x80 | (reg << 3) | 3); u32(uint32_t(disp)); }
+
+    void prologue() { u8(0x53); u8(0x48); u8(0x89); u8(0xFB); }    // push rbx; mov rbx, rdi
+    void epilogue() { u8(0x5B); u8(0xC3); }                         // pop rbx; ret
+
+    void load32(uint8_t r, int32_t d) { u8(0x8B); mem(r, d); }
+    void load16(uint8_t r, int32_t d) { u8(0x0F); u8(0xB7); mem(r, d); }   // movzx
+    void load8(uint8_t r, int32_t d) { u8(0x0F); u8(0xB6); mem(r, d); }    // movzx
+    void store32(uint8_t r, int32_t d) { u8(0x89); mem(r, d); }
+    void store16(uint8_t r, int32_t d) { u8(0x66); u8(0x89); mem(r, d); }
+    void store8(uint8_t r, int32_t d) { u8(0x88); mem(r, d); }
+    void store_imm8(int32_t d, uint8_t imm) { u8(0xC6); mem(0, d); u8(imm); }
+
+    void mov_imm(uint8_t r, uint32_t imm) { u8(0xB8 + r); u32(imm); }
+    void alu(AluOp op, uint8_t dst, uint8_t src) { u8(op); u8(0xC0 | (src << 3) | dst); }
+    void alu_imm8(ImmOp op, uint8_t r, uint8_t imm) { u8(0x83); u8(0xC0 | (op << 3) | r); u8(imm); }
+    void shift_cl(ShiftOp op, uint8_t r) { u8(0xD3); u8(0xC0 | (op << 3) | r); }
+    void not32(uint8_t r) { u8(0xF7); u8(0xD0 | r); }
+    void cmov(uint8_t cc, uint8_t dst, uint8_t src) { u8(0x0F); u8(0x40 | cc); u8(0xC0 | (dst << 3) | src); }
+    void movzx_edx_al() { u8(0x0F); u8(0xB6); u8(0xD0); }
+    void mov_rdi_rbx() { u8(0x48); u8(0x89); u8(0xDF); }
+
+    // Absolute call through rax; rsp is 16-byte aligned after the prologue's push.
+    void call(uint64_t fn) { u8(0x48); u8(0xB8); u64(fn); u8(0xFF); u8(0xD0); }
+
+    // Forward Jcc rel32; returns the fixup site for bind().
+    size_t jcc_forward(uint8_t cc) { u8(0x0F); u8(0x80 | cc); u32(0); return bytes.size(); }
+    void bind(size_t site) {
+        int32_t rel = static_cast<int32_t>(bytes.size() - site);
+        std::memcpy(&bytes[site - 4], &rel, sizeof(rel));
+    }
+};
+
+// Host condition for a Jcc that directly follows CMP: the VM's CMP flags match
+// the host's for CF/ZF/SF/OF. PF is not written by CMP, so JP/JNP go through
+// Jit::branch_taken.
+uint8_t native_condition(InstructionOpcode jcc) {
+    switch (jcc) {
+        case InstructionOpcode::JE:   case InstructionOpcode::JZ:   return CC_E;
+        case InstructionOpcode::JNE:  case InstructionOpcode::JNZ:  return CC_NE;
+        case InstructionOpcode::JA:   case InstructionOpcode::JNBE: return CC_A;
+        case InstructionOpcode::JAE:  case InstructionOpcode::JNB:
+        case InstructionOpcode::JNC:                                return CC_AE;
+        case InstructionOpcode::JB:   case InstructionOpcode::JNAE:
+        case InstructionOpcode::JC:                                 return CC_B;
+        case InstructionOpcode::JBE:  case InstructionOpcode::JNA:  return CC_BE;
+        case InstructionOpcode::JG:   case InstructionOpcode::JNLE: return CC_G;
+        case InstructionOpcode::JGE:  case InstructionOpcode::JNL:  return CC_GE;
+        case InstructionOpcode::JL:   case InstructionOpcode::JNGE: return CC_L;
+        case InstructionOpcode::JLE:  case InstructionOpcode::JNG:  return CC_LE;
+        case InstructionOpcode::JO:                                 return CC_O;
+        case InstructionOpcode::JNO:                                return CC_NO;
+        case InstructionOpcode::JS:                                 return CC_S;
+        case InstructionOpcode::JNS:                                return CC_NS;
+        default:                                                    return CC_NONE;
+    }
+}
+
+// Flag op recorded by a supported instruction. `maybe` is set when it depends
+// on a runtime value (shift by a register count of 0 leaves the flags alone).
+FlagOp flag_op(const DecodedInstruction& instr, bool& maybe) {
+    maybe = false;
+    switch (instr.opcode) {
+        case InstructionOpcode::ADD: return FlagOp::Add;
+        case InstructionOpcode::SUB: return FlagOp::Sub;
+        case InstructionOpcode::CMP: return FlagOp::Cmp;
+        case InstructionOpcode::AND: return FlagOp::And;
+        case InstructionOpcode::OR:
+        case InstructionOpcode::XOR: return FlagOp::OrXor;
+        case InstructionOpcode::SAL:
+        case InstructionOpcode::SHL:
+        case InstructionOpcode::SAR:
+        case InstructionOpcode::SHR:
+            if (instr.kinds[1] == OperandKind::Immediate && instr.values[1] == 0) {
+                return FlagOp::None;
+            }
+            maybe = instr.kinds[1] == OperandKind::Register;
+            if (instr.opcode == InstructionOpcode::SAR) return FlagOp::Sar;
+            if (instr.opcode == InstructionOpcode::SHR) return FlagOp::Shr;
+            return FlagOp::Shl;
+        default:
+            return FlagOp::None;
+    }
+}
+
+// Add, Sub and Cmp leave PF alone; every op from And on writes it.
+bool writes_parity(FlagOp op) {
+    return op >= FlagOp::And;
+}
+
+constexpr size_t ARENA_SIZE = 64 * 1024;
+
+}
+
+Jit::Jit(uint32_t threshold) : m_threshold(std::max<uint32_t>(threshold, 1)) {}
+
+Jit::~Jit() {
+    reset();
+}
+
+void Jit::reset() {
+    for (const Arena& arena : m_arenas) {
+        munmap(arena.base, arena.size);
+    }
+    m_arenas.clear();
+    m_entries.clear();
+    m_stats = {};
+}
+
+void Jit::discard_tail(uint32_t size) {
+    // The code itself stays in its arena until the next reset().
+    for (Entry& entry : m_entries) {
+        if (entry.block.fn && entry.end >= size) {
+            entry = {};
+        }
+    }
+}
+
+const Jit::Block* Jit::enter(uint32_t pc, std::span<const DecodedInstruction> code) {
+    if (pc >= m_entries.size()) {
+        m_entries.resize(std::max<size_t>(code.size(), pc + 1));
+    }
+
+    Entry& entry = m_entries[pc];
+    if (entry.block.fn) {
+        return &entry.block;
+    }
+    if (entry.rejected || ++entry.count < m_threshold) {
+        return nullptr;
+    }
+
+    if (!compile(pc, code, entry)) {
+        entry.rejected = true;
+        ++m_stats.rejected;
+        return nullptr;
+    }
+    return &entry.block;
+}
+
+bool Jit::is_supported(const DecodedInstruction& instr) {
+    auto is_reg = [&](size_t i) {
+        return instr.kinds[i] == OperandKind::Register &&
+               instr.values[i] < static_cast<uint32_t>(RegisterOpcode::INVALID_REG);
+    };
+    auto is_source = [&](size_t i) { return is_reg(i) || instr.kinds[i] == OperandKind::Immediate; };
+
+    switch (base_opcode(instr.opcode)) {
+        case InstructionOpcode::NOP:
+            return true;
+        case InstructionOpcode::MOV:
+        case InstructionOpcode::ADD:
+        case InstructionOpcode::SUB:
+        case InstructionOpcode::AND:
+        case InstructionOpcode::OR:
+        case InstructionOpcode::XOR:
+        case InstructionOpcode::CMP:
+        case InstructionOpcode::SAL:
+        case InstructionOpcode::SAR:
+        case InstructionOpcode::SHL:
+        case InstructionOpcode::SHR:
+            return instr.argc == 2 && is_reg(0) && is_source(1);
+        case InstructionOpcode::NOT:
+        case InstructionOpcode::INC:
+        case InstructionOpcode::DEC:
+            return instr.argc == 1 && is_reg(0);
+        default:
+            return is_jump_opcode(instr.opcode) && instr.kinds[0] == OperandKind::Target;
+    }
+}
+
+bool Jit::compile(uint32_t pc, std::span<const DecodedInstruction> code, Entry& entry) {
+#if !defined(__x86_64__)
+    (void)pc; (void)code; (void)entry;
+    return false;
+#else
+    std::vector<DecodedInstruction> block;
+    for (uint32_t i = pc; i < code.size() && block.size() < MAX_BLOCK_LENGTH; ++i) {
+        if (!is_supported(code[i])) {
+            break;
+        }
+        DecodedInstruction instr = code[i];
+        instr.opcode = base_opcode(instr.opcode);
+        block.push_back(instr);
+        if (is_jump_opcode(instr.opcode)) {
+            break;
+        }
+    }
+    if (block.empty()) {
+        return false;
+    }
+
+    const size_t n = block.size();
+
+    // A flag record is dead if a later instruction in the block certainly
+    // overwrites every flag it writes; nothing inside a block reads flags
+    // except the final Jcc.
+    std::vector<FlagOp> ops(n);
+    std::vector<bool> maybe(n), live(n);
+    uint32_t covered = 0;
+    for (size_t j = n; j-- > 0;) {
+        bool m;
+        ops[j] = flag_op(block[j], m);
+        maybe[j] = m;
+        if (ops[j] == FlagOp::None) continue;
+
+        uint32_t written = Registers::written_flags(ops[j]);
+        live[j] = (written & ~covered) != 0;
+        if (!m) covered |= written;
+    }
+
+    const int32_t regs_offset = offsetof(Registers, m_regs);
+    const int32_t lazy_offset = offsetof(Registers, m_lazy);
+    const int32_t lazy_op = lazy_offset + offsetof(Registers::LazyFlags, op);
+
+    CodeBuffer buf;
+
+    auto view_offset = [&](RegisterOpcode reg, uint32_t& mask) {
+        const Registers::RegisterView& view = Registers::s_views[static_cast<size_t>(reg)];
+        mask = view.mask;
+        return regs_offset + view.slot * 4 + view.shift / 8;
+    };
+    auto load_reg = [&](uint8_t host, RegisterOpcode reg) {
+        uint32_t mask;
+        int32_t d = view_offset(reg, mask);
+        if (mask == 0xFFFFFFFF) buf.load32(host, d);
+        else if (mask == 0xFFFF) buf.load16(host, d);
+        else buf.load8(host, d);
+    };
+    auto store_reg = [&](uint8_t host, RegisterOpcode reg) {
+        uint32_t mask;
+        int32_t d = view_offset(reg, mask);
+        if (mask == 0xFFFFFFFF) buf.store32(host, d);
+        else if (mask == 0xFFFF) buf.store16(host, d);
+        else buf.store8(host, d);
+    };
+    auto load_source = [&](uint8_t host, const DecodedInstruction& instr, size_t i) {
+        if (instr.kinds[i] == OperandKind::Register) load_reg(host, instr.reg(i));
+        else buf.mov_imm(host, instr.values[i]);
+    };
+    // Same lazy record Registers::update_flags writes: {op, a=eax, b=ecx, result=edx}.
+    auto record_flags = [&](FlagOp op) {
+        buf.store_imm8(lazy_op, static_cast<uint8_t>(op));
+        buf.store32(EAX, lazy_offset + offsetof(Registers::LazyFlags, a));
+        buf.store32(ECX, lazy_offset + offsetof(Registers::LazyFlags, b));
+        buf.store32(EDX, lazy_offset + offsetof(Registers::LazyFlags, result));
+    };
+
+    // Whether the pending lazy op writes PF, which an Add/Sub/Cmp record would
+    // drop: update_flags folds it into EFLAGS first, and so must we.
+    enum class Pending { No, Yes, Maybe } pending = Pending::Maybe;
+    auto fold_parity = [&]() {
+        if (pending == Pending::No) return;
+
+        size_t skip = 0;
+        if (pending == Pending::Maybe) {
+            buf.load8(EAX, lazy_op);
+            buf.alu_imm8(IMM_CMP, EAX, static_cast<uint8_t>(FlagOp::And));
+            skip = buf.jcc_forward(CC_B);
+        }
+        buf.mov_rdi_rbx();
+        buf.call(reinterpret_cast<uint64_t>(&Jit::materialize));
+        if (skip) buf.bind(skip);
+        pending = Pending::No;
+    };
+
+    auto finish = [&](uint32_t fallthrough, uint32_t target, uint8_t cc) {
+        buf.mov_imm(EAX, fallthrough);
+        buf.mov_imm(ECX, target);
+        buf.cmov(cc, EAX, ECX);
+        buf.epilogue();
+    };
+
+    buf.prologue();
+
+    for (size_t j = 0; j < n; ++j) {
+        const DecodedInstruction& instr = block[j];
+        const uint32_t next_pc = pc + static_cast<uint32_t>(j) + 1;
+
+        switch (instr.opcode) {
+            case InstructionOpcode::NOP:
+                break;
+
+            case InstructionOpcode::MOV:
+                load_source(EAX, instr, 1);
+                store_reg(EAX, instr.reg(0));
+                break;
+
+            case InstructionOpcode::NOT:
+                load_reg(EAX, instr.reg(0));
+                buf.not32(EAX);
+                store_reg(EAX, instr.reg(0));
+                break;
+
+            case InstructionOpcode::INC:
+            case InstructionOpcode::DEC:
+                load_reg(EAX, instr.reg(0));
+                buf.alu_imm8(instr.opcode == InstructionOpcode::INC ? IMM_ADD : IMM_SUB, EAX, 1);
+                store_reg(EAX, instr.reg(0));
+                break;
+
+            case InstructionOpcode::ADD:
+            case InstructionOpcode::SUB:
+            case InstructionOpcode::AND:
+            case InstructionOpcode::OR:
+            case InstructionOpcode::XOR:
+            case InstructionOpcode::CMP: {
+                if (live[j] && !writes_parity(ops[j])) fold_parity();
+
+                AluOp op = ALU_SUB;
+                switch (instr.opcode) {
+                    case InstructionOpcode::ADD: op = ALU_ADD; break;
+                    case InstructionOpcode::AND: op = ALU_AND; break;
+                    case InstructionOpcode::OR:  op = ALU_OR;  break;
+                    case InstructionOpcode::XOR: op = ALU_XOR; break;
+                    default: break;
+                }
+
+                load_reg(EAX, instr.reg(0));
+                load_source(ECX, instr, 1);
+                buf.alu(ALU_MOV, EDX, EAX);
+                buf.alu(op, EDX, ECX);
+                if (instr.opcode != InstructionOpcode::CMP) {
+                    store_reg(EDX, instr.reg(0));
+                }
+                if (live[j]) {
+                    record_flags(ops[j]);
+                    pending = writes_parity(ops[j]) ? Pending::Yes : Pending::No;
+                }
+                break;
+            }
+
+            case InstructionOpcode::SAL:
+            case InstructionOpcode::SHL:
+            case InstructionOpcode::SAR:
+            case InstructionOpcode::SHR: {
+                if (ops[j] == FlagOp::None) break;     // shift by an immediate 0
+
+                ShiftOp op = instr.opcode == InstructionOpcode::SAR ? SHIFT_SAR
+                           : instr.opcode == InstructionOpcode::SHR ? SHIFT_SHR : SHIFT_SHL;
+
+                load_reg(EAX, instr.reg(0));
+                load_source(ECX, instr, 1);
+
+                size_t skip = 0;
+                if (maybe[j]) {
+                    buf.alu(ALU_TEST, ECX, ECX);
+                    skip = buf.jcc_forward(CC_E);
+                }
+                buf.alu_imm8(IMM_AND, ECX, 0x1F);
+                buf.alu(ALU_MOV, EDX, EAX);
+                buf.shift_cl(op, EDX);
+                store_reg(EDX, instr.reg(0));
+                if (live[j]) record_flags(ops[j]);
+                if (skip) buf.bind(skip);
+
+                if (live[j]) {
+                    pending = !maybe[j] || pending == Pending::Yes ? Pending::Yes : Pending::Maybe;
+                }
+                break;
+            }
+
+            case InstructionOpcode::JMP:
+                buf.mov_imm(EAX, instr.values[0]);
+                buf.epilogue();
+                break;
+
+            default: {
+                // Conditional jump: always the last instruction of the block.
+                uint8_t cc = j > 0 && block[j - 1].opcode == InstructionOpcode::CMP
+                           ? native_condition(instr.opcode) : uint8_t(CC_NONE);
+
+                if (cc != CC_NONE) {
+                    // eax/ecx still hold the operands of the CMP just emitted.
+                    buf.alu(ALU_CMP, EAX, ECX);
+                    finish(next_pc, instr.values[0], cc);
+                } else {
+                    buf.mov_rdi_rbx();
+                    buf.mov_imm(ESI, static_cast<uint32_t>(instr.opcode));
+                    buf.call(reinterpret_cast<uint64_t>(&Jit::branch_taken));
+                    buf.movzx_edx_al();
+                    buf.alu(ALU_TEST, EDX, EDX);
+                    finish(next_pc, instr.values[0], CC_NE);
+                }
+                break;
+            }
+        }
+    }
+
+    if (!is_jump_opcode(block.back().opcode)) {
+        buf.mov_imm(EAX, pc + static_cast<uint32_t>(n));
+        buf.epilogue();
+    }
+
+    entry.block = { install(buf.bytes), static_cast<uint32_t>(n) };
+    entry.end = pc + static_cast<uint32_t>(n);
+    ++m_stats.compiled;
+    return true;
+#endif
+}
+
+Jit::BlockFn Jit::install(const std::vector<uint8_t>& bytes) {
+    const size_t size = (bytes.size() + 15) & ~size_t(15);
+
+    if (m_arenas.empty() || m_arenas.back().used + size > m_arenas.back().size) {
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t arena_size = std::max(ARENA_SIZE, (size + page - 1) / page * page);
+
+        void* base = mmap(nullptr, arena_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            throw std::runtime_error("Cannot allocate JIT code memory");
+        }
+        m_arenas.push_back({ static_cast<std::byte*>(base), arena_size, 0 });
+    }
+
+    Arena& arena = m_arenas.back();
+    std::byte* dst = arena.base + arena.used;
+
+    if (mprotect(arena.base, arena.size, PROT_READ | PROT_WRITE) != 0) {
+        throw std::runtime_error("Cannot make JIT code memory writable");
+    }
+    std::memcpy(dst, bytes.data(), bytes.size());
+    if (mprotect(arena.base, arena.size, PROT_READ | PROT_EXEC) != 0) {
+        throw std::runtime_error("Cannot make JIT code memory executable");
+    }
+    __builtin___clear_cache(reinterpret_cast<char*>(dst), reinterpret_cast<char*>(dst + bytes.size()));
+
+    arena.used += size;
+    m_stats.code_bytes += bytes.size();
+    return reinterpret_cast<BlockFn>(dst);
+}
+
+void Jit::materialize(Registers* regs) {
+    regs->materialize_flags();
+}
+
+bool Jit::branch_taken(Registers* regs, uint32_t opcode) {
+    return VM::branch_taken(static_cast<InstructionOpcode>(opcode), regs->get_eflags());
+}
+
+std::string Jit::report() const {
+    std::ostringstream ss;
+    ss << "jit: " << m_stats.compiled << " blocks compiled, " << m_stats.rejected
+       << " entry points left to the interpreter, " << m_stats.code_bytes << " bytes of code";
+    return ss.str();
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+#include "Instruction.h"
+#include "Registers.h"
+
+enum class JitMode : uint8_t {
+    Off,
+    On,
+    Verify  // every compiled block is re-run in the interpreter and compared
+};
+
+// Baseline template JIT for x86-64. A basic block that has been entered often
+// enough is translated instruction by instruction into native code that works
+// on the Registers object in place and returns the next pc.
+//
+// Blocks cover MOV, ADD, SUB, AND, OR, XOR, NOT, INC, DEC, the shifts, CMP,
+// NOP, JMP and Jcc with register/immediate operands. Anything else (INT,
+// PUSH/POP, MUL/DIV, malformed operands) ends the block and is left to the
+// interpreter. Flag-setting instructions store the same lazy flag record the
+// interpreter does, so generated code assumes FlagMode::Lazy.
+//
+// Code lives in mmap'd arenas that are never writable and executable at the
+// same time: an arena is switched to read/write while a block is copied in and
+// back to read/execute before anything runs.
+class Jit {
+public:
+    using BlockFn = uint32_t (*)(Registers* regs);
+
+    struct Block {
+        BlockFn fn = nullptr;
+        uint32_t length = 0;    // instructions covered, starting at the entry pc
+    };
+
+    struct Stats {
+        size_t compiled = 0;
+        size_t rejected = 0;    // entry points whose first instruction is not supported
+        size_t code_bytes = 0;
+    };
+
+    static constexpr uint32_t DEFAULT_THRESHOLD = 32;
+    static constexpr uint32_t MAX_BLOCK_LENGTH = 64;
+
+    explicit Jit(uint32_t threshold = DEFAULT_THRESHOLD);
+    ~Jit();
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // Called each time the VM reaches a block entry at `pc`. Counts the entry
+    // and compiles the block once it is hot; returns it if one is available.
+    const Block* enter(uint32_t pc, std::span<const DecodedInstruction> code);
+
+    // Forgets every block (new program loaded).
+    void reset();
+    // Forgets blocks that reach `size`: the program grew past its old end.
+    void discard_tail(uint32_t size);
+
+    // False if `instr` has to be left to the interpreter; such instructions end a block.
+    static bool is_supported(const DecodedInstruction& instr);
+
+    const Stats& stats() const { return m_stats; }
+    std::string report() const;
+
+private:
+    struct Entry {
+        uint32_t count = 0;
+        bool rejected = false;
+        Block block;
+        uint32_t end = 0;
+    };
+
+    struct Arena {
+        std::byte* base;
+        size_t size;
+        size_t used;
+    };
+
+    uint32_t m_threshold;
+    std::vector<Entry> m_entries;
+    std::vector<Arena> m_arenas;
+    Stats m_stats;
+
+    bool compile(uint32_t pc, std::span<const DecodedInstruction> code, Entry& entry);
+    BlockFn install(const std::vector<uint8_t>& bytes);
+
+    // Called from generated code.
+    static void materialize(Registers* regs);
+    static bool branch_taken(Registers* regs, uint32_t opcode);
+};
@@ -0,0 +1,330 @@
+#include "Memory.h"
+
+#include <algorithm>
+
+Memory::Memory(uint64_t size) : m_size(size) {
+    if (size == 0 || size > MAX_SIZE) {
+        throw std::invalid_argument("Memory size must be between 1 byte and 4 GiB");
+    }
+    m_written_bits.resize(((size + PAGE_SIZE - 1) / PAGE_SIZE + 63) / 64);
+}
+
+namespace {
+const std::array<uint8_t, Memory::PAGE_SIZE> zero_page {};
+}
+
+std::span<uint8_t> Memory::writable_span(uint32_t address, size_t count) {
+    const uint32_t offset = address & (PAGE_SIZE - 1);
+    return { page_for_write(address).data() + offset, std::min<size_t>(count, PAGE_SIZE - offset) };
+}
+
+std::span<const uint8_t> Memory::readable_span(uint32_t address, size_t count) const {
+    const uint32_t offset = address & (PAGE_SIZE - 1);
+    const Page* page = find_page(address);
+    return { (page ? page->data() : zero_page.data()) + offset, std::min<size_t>(count, PAGE_SIZE - offset) };
+}
+
+Memory::Page& Memory::page_for_write(uint32_t address) {
+    const uint32_t number = address >> PAGE_BITS;
+    uint64_t& bits = m_written_bits[number / 64];
+    const uint64_t bit = uint64_t(1) << (number % 64);
+    if (bits & bit) [[likely]] {
+        return *(*m_directory[address >> (PAGE_BITS + TABLE_BITS)])[number & (TABLE_SIZE - 1)];
+    }
+
+    bits |= bit;
+    m_written.push_back(number);
+    std::shared_ptr<Page>& page = map_slot(address);
+    if (page.use_count() > 1) {
+        page = std::make_shared<Page>(*page);   // shared with a snapshot: copy on first write
+    }
+    return *page;
+}
+
+std::shared_ptr<Memory::Page>& Memory::map_slot(uint32_t address) {
+    std::unique_ptr<PageTable>& table = m_directory[address >> (PAGE_BITS + TABLE_BITS)];
+    if (!table) {
+        table = std::make_unique<PageTable>();
+    }
+
+    std::shared_ptr<Page>& page = (*table)[(address >> PAGE_BITS) & (TABLE_SIZE - 1)];
+    if (!page) {
+        page = std::make_shared<Page>();    // value-initialized: zero-filled
+        ++m_mapped_pages;
+    }
+    return page;
+}
+
+void Memory::read(uint32_t address, void* out, size_t count) const {
+    check(address, count);
+
+    auto* dst = static_cast<uint8_t*>(out);
+    while (count > 0) {
+        const uint32_t offset = address & (PAGE_SIZE - 1);
+        const size_t chunk = std::min<size_t>(count, PAGE_SIZE - offset);
+
+        if (const Page* page = find_page(address)) {
+            std::memcpy(dst, page->data() + offset, chunk);
+        } else {
+            std::memset(dst, 0, chunk);
+        }
+
+        dst += chunk;
+        address += static_cast<uint32_t>(chunk);
+        count -= chunk;
+    }
+}
+
+void Memory::write(uint32_t address, const void* data, size_t count) {
+    check(address, count);
+
+    const auto* src = static_cast<const uint8_t*>(data);
+    while (count > 0) {
+        const uint32_t offset = address & (PAGE_SIZE - 1);
+        const size_t chunk = std::min<size_t>(count, PAGE_SIZE - offset);
+
+        std::memcpy(page_for_write(address).data() + offset, src, chunk);
+
+        src += chunk;
+        address += static_cast<uint32_t>(chunk);
+        count -= chunk;
+    }
+}
+
+void Memory::copy(uint32_t dst, uint32_t src, size_t count) {
+    check(src, count);
+    check(dst, count);
+    if (count == 0 || dst == src) {
+        return;
+    }
+
+    // Each step moves the largest span that stays inside one source and one
+    // destination page. When the destination overlaps the source from above,
+    // the spans are taken back to front, as memmove would.
+    const bool backward = dst > src && dst - src < count;
+    uint64_t done = 0;
+    while (done < count) {
+        size_t chunk;
+        uint64_t s, d;
+        if (!backward) {
+            s = uint64_t(src) + done;
+            d = uint64_t(dst) + done;
+            chunk = std::min<uint64_t>({ count - done, page_room(s), page_room(d) });
+        } else {
+            const uint64_t s_end = uint64_t(src) + count - done;
+            const uint64_t d_end = uint64_t(dst) + count - done;
+            auto room_before = [](uint64_t end) { return ((end - 1) & (PAGE_SIZE - 1)) + 1; };
+            chunk = std::min<uint64_t>({ count - done, room_before(s_end), room_before(d_end) });
+            s = s_end - chunk;
+            d = d_end - chunk;
+        }
+
+        const Page* from = find_page(static_cast<uint32_t>(s));
+        if (from || find_page(static_cast<uint32_t>(d))) {
+            uint8_t* to = page_for_write(static_cast<uint32_t>(d)).data() + (d & (PAGE_SIZE - 1));
+            if (from) {
+                std::memmove(to, from->data() + (s & (PAGE_SIZE - 1)), chunk);
+            } else {
+                std::memset(to, 0, chunk);
+            }
+        }
+        done += chunk;
+    }
+}
+
+void Memory::fill(uint32_t address, uint32_t value, uint32_t width, size_t count) {
+    const uint64_t bytes = uint64_t(count) * width;
+    check(address, bytes);
+
+    uint8_t pattern[4];
+    std::memcpy(pattern, &value, sizeof(pattern));
+    const bool uniform = std::all_of(pattern + 1, pattern + width, [&](uint8_t b) { return b == pattern[0]; });
+
+    uint64_t done = 0;
+    while (done < bytes) {
+        const uint64_t at = uint64_t(address) + done;
+        const size_t chunk = std::min<uint64_t>(bytes - done, page_room(at));
+        uint8_t* out = page_for_write(static_cast<uint32_t>(at)).data() + (at & (PAGE_SIZE - 1));
+
+        if (uniform) {
+            std::memset(out, pattern[0], chunk);
+        } else {
+            // One element at the right phase, then double it up with memcpy.
+            const size_t head = std::min<size_t>(chunk, width);
+            for (size_t i = 0; i < head; ++i) {
+                out[i] = pattern[(done + i) % width];
+            }
+            for (size_t filled = head; filled < chunk; filled *= 2) {
+                std::memcpy(out + filled, out, std::min(filled, chunk - filled));
+            }
+        }
+        done += chunk;
+    }
+}
+
+size_t Memory::find_byte(uint32_t address, size_t count, uint8_t value, bool equal) const {
+    check(address, count);
+
+    uint64_t done = 0;
+    while (done < count) {
+        const uint64_t at = uint64_t(address) + done;
+        const size_t chunk = std::min<uint64_t>(count - done, page_room(at));
+
+        if (const Page* page = find_page(static_cast<uint32_t>(at))) {
+            const uint8_t* data = page->data() + (at & (PAGE_SIZE - 1));
+            if (equal) {
+                if (const void* hit = std::memchr(data, value, chunk)) {
+                    return done + (static_cast<const uint8_t*>(hit) - data);
+                }
+            } else {
+                const uint8_t* hit = std::find_if(data, data + chunk, [value](uint8_t b) { return b != value; });
+                if (hit != data + chunk) {
+                    return done + (hit - data);
+                }
+            }
+        } else if ((value == 0) == equal) {
+            return done;
+        }
+        done += chunk;
+    }
+    return count;
+}
+
+std::string Memory::read_string(uint32_t address, uint8_t terminator) const {
+    check(address, 1);
+
+    const size_t room = m_size - address;
+    const size_t length = find_byte(address, room, terminator);
+    if (length == room) {
+        throw std::out_of_range("String at address " + std::to_string(address) + " is not terminated");
+    }
+    std::string text(length, '\0');
+    read(address, text.data(), length);
+    return text;
+}
+
+size_t Memory::mismatch(uint32_t a, uint32_t b, size_t count) const {
+    check(a, count);
+    check(b, count);
+
+    static const Page zeros {};
+    uint64_t done = 0;
+    while (done < count) {
+        const uint64_t at_a = uint64_t(a) + done;
+        const uint64_t at_b = uint64_t(b) + done;
+        const size_t chunk = std::min<uint64_t>({ count - done, page_room(at_a), page_room(at_b) });
+
+        const Page* page_a = find_page(static_cast<uint32_t>(at_a));
+        const Page* page_b = find_page(static_cast<uint32_t>(at_b));
+        if (page_a || page_b) {
+            const uint8_t* x = (page_a ? page_a : &zeros)->data() + (at_a & (PAGE_SIZE - 1));
+            const uint8_t* y = (page_b ? page_b : &zeros)->data() + (at_b & (PAGE_SIZE - 1));
+            if (std::memcmp(x, y, chunk) != 0) {
+                return done + (std::mismatch(x, x + chunk, y).first - x);
+            }
+        }
+        done += chunk;
+    }
+    return count;
+}
+
+void Memory::reserve(uint32_t address, size_t count) {
+    check(address, count);
+
+    const uint64_t end = uint64_t(address) + count;
+    for (uint64_t page = address & ~uint64_t(PAGE_SIZE - 1); page < end; page += PAGE_SIZE) {
+        map_slot(static_cast<uint32_t>(page));
+    }
+}
+
+void Memory::zero() {
+    for (uint32_t number : m_written) {
+        map_slot(number << PAGE_BITS)->fill(0);
+    }
+    forget_written();
+    if (!m_baseline) {
+        return;
+    }
+
+    // Pages not written since still hold the snapshot's contents and belong
+    // to it as well: unmap them, keeping the page tables.
+    const Snapshot::Directory& baseline = *m_baseline;
+    for (size_t i = 0; i < TABLE_SIZE; ++i) {
+        if (!baseline[i] || !m_directory[i]) {
+            continue;
+        }
+        PageTable& table = *m_directory[i];
+        for (size_t j = 0; j < TABLE_SIZE; ++j) {
+            if (table[j] && table[j] == (*baseline[i])[j]) {
+                table[j].reset();
+                --m_mapped_pages;
+            }
+        }
+    }
+    m_baseline.reset();
+}
+
+void Memory::clear() {
+    for (auto& table : m_directory) {
+        table.reset();
+    }
+    m_mapped_pages = 0;
+    m_baseline.reset();
+    std::fill(m_written_bits.begin(), m_written_bits.end(), 0);
+    m_written.clear();
+}
+
+void Memory::forget_written() {
+    for (uint32_t number : m_written) {
+        m_written_bits[number / 64] = 0;
+    }
+    m_written.clear();
+}
+
+Memory::Snapshot Memory::snapshot() {
+    auto directory = std::make_shared<Snapshot::Directory>();
+    for (size_t i = 0; i < TABLE_SIZE; ++i) {
+        if (m_directory[i]) {
+            (*directory)[i] = std::make_unique<PageTable>(*m_directory[i]);
+        }
+    }
+
+    // From here on every page is shared, so the next store to each one copies it.
+    forget_written();
+    m_baseline = directory;
+
+    Snapshot snapshot;
+    snapshot.m_size = m_size;
+    snapshot.m_mapped_pages = m_mapped_pages;
+    snapshot.m_directory = std::move(directory);
+    return snapshot;
+}
+
+void Memory::restore(const Snapshot& snapshot) {
+    if (snapshot.m_size != m_size || !snapshot.m_directory) {
+        throw std::invalid_argument("Snapshot does not match a memory of " + std::to_string(m_size) + " bytes");
+    }
+    const Snapshot::Directory& source = *snapshot.m_directory;
+
+    if (m_baseline == snapshot.m_directory) {
+        // Only the pages written since differ from the snapshot.
+        for (uint32_t number : m_written) {
+            const PageTable* from = source[number >> TABLE_BITS].get();
+            std::shared_ptr<Page>& page = (*m_directory[number >> TABLE_BITS])[number & (TABLE_SIZE - 1)];
+            m_mapped_pages -= page != nullptr;
+            page = from ? (*from)[number & (TABLE_SIZE - 1)] : nullptr;
+            m_mapped_pages += page != nullptr;
+        }
+    } else {
+        for (size_t i = 0; i < TABLE_SIZE; ++i) {
+            if (source[i]) {
+                m_directory[i] = std::make_unique<PageTable>(*source[i]);
+            } else {
+                m_directory[i].reset();
+            }
+        }
+        m_mapped_pages = snapshot.m_mapped_pages;
+        m_baseline = snapshot.m_directory;
+    }
+    forget_written();
+}
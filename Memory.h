@@ -0,0 +1,185 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Flat, byte-addressed guest memory of up to 4 GiB.
+//
+// Storage is a two-level page table of 4 KiB pages. Tables and pages are
+// allocated on the first store that touches them; loads from untouched memory
+// read zeros without allocating, so a large sparse address space costs only
+// the 8 KiB directory. Every access is bounds-checked against size().
+// Multi-byte values are little-endian and may be unaligned.
+//
+// Pages are reference counted so that snapshots can share them: a page is
+// copied the first time it is stored to after a snapshot() or restore(), and
+// restoring only has to put back the pages written since.
+class Memory {
+private:
+    static constexpr uint32_t TABLE_BITS = 10;
+    static constexpr uint32_t TABLE_SIZE = 1u << TABLE_BITS;
+
+public:
+    static constexpr uint32_t PAGE_BITS = 12;
+    static constexpr uint32_t PAGE_SIZE = 1u << PAGE_BITS;
+    static constexpr uint64_t MAX_SIZE = uint64_t(1) << 32;
+    static constexpr uint64_t DEFAULT_SIZE = uint64_t(16) << 20;
+
+    using Page = std::array<uint8_t, PAGE_SIZE>;
+
+    // Contents of a Memory at one point in time. It shares its pages with
+    // the memories it was taken from or restored into, never writes them,
+    // and may be restored on any number of threads at once.
+    class Snapshot {
+    public:
+        uint64_t size() const { return m_size; }
+        size_t mapped_pages() const { return m_mapped_pages; }
+
+    private:
+        friend class Memory;
+        using PageTable = std::array<std::shared_ptr<Page>, TABLE_SIZE>;
+        using Directory = std::array<std::unique_ptr<PageTable>, TABLE_SIZE>;
+
+        uint64_t m_size {};
+        size_t m_mapped_pages {};
+        std::shared_ptr<const Directory> m_directory;
+    };
+
+    explicit Memory(uint64_t size = DEFAULT_SIZE);
+
+    uint64_t size() const { return m_size; }
+    size_t mapped_pages() const { return m_mapped_pages; }
+
+    uint8_t  load8(uint32_t address) const  { return static_cast<uint8_t>(load(address, 1)); }
+    uint16_t load16(uint32_t address) const { return static_cast<uint16_t>(load(address, 2)); }
+    uint32_t load32(uint32_t address) const { return load(address, 4); }
+
+    void store8(uint32_t address, uint8_t value)   { store(address, value, 1); }
+    void store16(uint32_t address, uint16_t value) { store(address, value, 2); }
+    void store32(uint32_t address, uint32_t value) { store(address, value, 4); }
+
+    // Loads/stores `width` (1, 2 or 4) bytes; the value is zero-extended / truncated.
+    uint32_t load(uint32_t address, uint32_t width) const;
+    void store(uint32_t address, uint32_t value, uint32_t width);
+
+    // Bulk copies between guest memory and host buffers.
+    void read(uint32_t address, void* out, size_t count) const;
+    void write(uint32_t address, const void* data, size_t count);
+
+    // Bulk kernels for the string instructions, built on the C library's
+    // vectorized mem* routines with one call per page span. Pages that were
+    // never written are treated as zeros without being mapped.
+    //
+    // Copies `count` bytes with memmove semantics.
+    void copy(uint32_t dst, uint32_t src, size_t count);
+    // Stores `count` elements of `width` bytes holding `value`.
+    void fill(uint32_t address, uint32_t value, uint32_t width, size_t count);
+    // Offset of the first byte that is (or, with equal = false, is not) `value`; count if none.
+    size_t find_byte(uint32_t address, size_t count, uint8_t value, bool equal = true) const;
+    // Offset of the first byte where the two ranges differ; count if none.
+    size_t mismatch(uint32_t a, uint32_t b, size_t count) const;
+    // The bytes from `address` up to, not including, the first `terminator`.
+    std::string read_string(uint32_t address, uint8_t terminator) const;
+
+    // Host views of guest memory for I/O: the part of [address, address + count)
+    // that lies in one page. writable_span() maps the page; readable_span() shows
+    // a page that was never written as zeros. The range must have been check()ed.
+    std::span<uint8_t> writable_span(uint32_t address, size_t count);
+    std::span<const uint8_t> readable_span(uint32_t address, size_t count) const;
+
+    // Throws std::out_of_range unless [address, address + count) is inside memory.
+    void check(uint32_t address, uint64_t count) const;
+
+    // Maps every page of [address, address + count) now instead of on first store.
+    void reserve(uint32_t address, size_t count);
+
+    // Drops every page; memory reads as zeros again.
+    void clear();
+    // Zeroes the pages written since the last zero() or clear() in place, so
+    // memory reads as zeros again without giving any pages back. Costs time
+    // in proportion to the pages written, not to the pages mapped. After a
+    // snapshot() or restore(), the snapshot's pages that were not written
+    // since are unmapped rather than zeroed, since the snapshot owns them too.
+    void zero();
+    size_t written_pages() const { return m_written.size(); }
+
+    // Captures the current contents. Costs a pointer copy per mapped page;
+    // no page data is copied.
+    Snapshot snapshot();
+    // Makes memory read exactly as `snapshot` again. Back on the snapshot this
+    // memory was last taken from or restored to, only the pages written since
+    // are touched; otherwise every page pointer is copied, still without
+    // copying page data. Throws std::invalid_argument if the sizes differ.
+    void restore(const Snapshot& snapshot);
+
+private:
+    using PageTable = Snapshot::PageTable;
+
+    uint64_t m_size;
+    size_t m_mapped_pages = 0;
+    Snapshot::Directory m_directory;
+    // Pages stored to since the last zero(), snapshot() or restore(): a bit
+    // per page, and their numbers. Any other page still holds the baseline:
+    // zeros, or the pages of m_baseline.
+    std::vector<uint64_t> m_written_bits;
+    std::vector<uint32_t> m_written;
+    std::shared_ptr<const Snapshot::Directory> m_baseline;
+
+    void forget_written();
+
+    const Page* find_page(uint32_t address) const;
+    // The page's entry, allocating the page if it is not mapped yet.
+    std::shared_ptr<Page>& map_slot(uint32_t address);
+    // map_slot(), recording the page as written and unsharing it.
+    Page& page_for_write(uint32_t address);
+    // Bytes from `address` to the end of its page.
+    static uint32_t page_room(uint64_t address) { return PAGE_SIZE - (address & (PAGE_SIZE - 1)); }
+};
+
+inline void Memory::check(uint32_t address, uint64_t count) const {
+    if (address + count > m_size) [[unlikely]] {
+        throw std::out_of_range("Memory access out of bounds at address " + std::to_string(address));
+    }
+}
+
+inline const Memory::Page* Memory::find_page(uint32_t address) const {
+    const PageTable* table = m_directory[address >> (PAGE_BITS + TABLE_BITS)].get();
+    return table ? (*table)[(address >> PAGE_BITS) & (TABLE_SIZE - 1)].get() : nullptr;
+}
+
+inline uint32_t Memory::load(uint32_t address, uint32_t width) const {
+    check(address, width);
+
+    const uint32_t offset = address & (PAGE_SIZE - 1);
+    if (offset + width <= PAGE_SIZE) [[likely]] {
+        const Page* page = find_page(address);
+        uint32_t value = 0;
+        if (page) {
+            std::memcpy(&value, page->data() + offset, width);
+        }
+        return value;
+    }
+
+    uint32_t value = 0;
+    read(address, &value, width);
+    return value;
+}
+
+inline void Memory::store(uint32_t address, uint32_t value, uint32_t width) {
+    check(address, width);
+
+    const uint32_t offset = address & (PAGE_SIZE - 1);
+    if (offset + width <= PAGE_SIZE) [[likely]] {
+        std::memcpy(page_for_write(address).data() + offset, &value, width);
+        return;
+    }
+
+    write(address, &value, width);
+}
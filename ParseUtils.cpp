@@ -3,6 +3,7 @@
 #include <string>
 #include <algorithm>
 #include <cctype>
+#include <array>
 
 bool ParseUtils::is_int(const std::string& str) {
     if (str.empty()) 
@@ -145,6 +146,22 @@ char ParseUtils::string_to_char(const std::string& str) {
 }
 
 
+std::string_view ParseUtils::opcode_name(InstructionOpcode opcode) {
+    static const auto names = [] {
+        std::array<std::string_view, OPCODE_COUNT> table {};
+        for (const auto& [name, op] : instr_map) {
+            table[static_cast<size_t>(op)] = name;
+        }
+        table[static_cast<size_t>(InstructionOpcode::CMP_JCC)] = "CMP+Jcc";
+        table[static_cast<size_t>(InstructionOpcode::DEC_JNZ)] = "DEC+JNZ";
+        table[static_cast<size_t>(InstructionOpcode::MOV_ADD)] = "MOV+ADD";
+        return table;
+    }();
+
+    const auto index = static_cast<size_t>(opcode);
+    return index < names.size() ? names[index] : std::string_view{};
+}
+
 int32_t ParseUtils::uint32_to_int32(uint32_t val) {
     return static_cast<int32_t>(val);
 }
@@ -200,7 +217,30 @@ const std::unordered_map<std::string, InstructionOpcode> ParseUtils::instr_map =
     { "SAR", InstructionOpcode::SAR },
     { "SHL", InstructionOpcode::SHL },
     { "SHR", InstructionOpcode::SHR },
-    { "INT", InstructionOpcode::INT}
+    { "INT", InstructionOpcode::INT},
+    { "CALL", InstructionOpcode::CALL },
+    { "RET", InstructionOpcode::RET },
+    { "ENTER", InstructionOpcode::ENTER },
+    { "LEAVE", InstructionOpcode::LEAVE },
+    { "MOVSB", InstructionOpcode::MOVSB },
+    { "MOVSW", InstructionOpcode::MOVSW },
+    { "MOVSD", InstructionOpcode::MOVSD },
+    { "STOSB", InstructionOpcode::STOSB },
+    { "STOSW", InstructionOpcode::STOSW },
+    { "STOSD", InstructionOpcode::STOSD },
+    { "LODSB", InstructionOpcode::LODSB },
+    { "LODSW", InstructionOpcode::LODSW },
+    { "LODSD", InstructionOpcode::LODSD },
+    { "SCASB", InstructionOpcode::SCASB },
+    { "SCASW", InstructionOpcode::SCASW },
+    { "SCASD", InstructionOpcode::SCASD },
+    { "CMPSB", InstructionOpcode::CMPSB },
+    { "CMPSW", InstructionOpcode::CMPSW },
+    { "CMPSD", InstructionOpcode::CMPSD },
+    { "CLD", InstructionOpcode::CLD },
+    { "STD", InstructionOpcode::STD },
+    { "IRET", InstructionOpcode::IRET },
+    { "HLT", InstructionOpcode::HLT }
 };
 
 const std::unordered_map<std::string, RegisterOpcode> ParseUtils::reg_map = {
@@ -217,36 +257,3 @@ const std::unordered_map<std::string, RegisterOpcode> ParseUtils::reg_map = {
     { "ESP", RegisterOpcode::ESP }, { "SP",  RegisterOpcode::SP },
     { "EBP", RegisterOpcode::EBP }, { "BP",  RegisterOpcode::BP }
 };
-
-const std::unordered_set<InstructionOpcode> ParseUtils::jump_opcodes = {
-	InstructionOpcode::JMP,
-	InstructionOpcode::JE,
-	InstructionOpcode::JNE,
-	InstructionOpcode::JZ,
-	InstructionOpcode::JNZ,
-	InstructionOpcode::JA,
-	InstructionOpcode::JNBE,
-	InstructionOpcode::JAE,
-	InstructionOpcode::JNB,
-	InstructionOpcode::JB,
-	InstructionOpcode::JNAE,
-	InstructionOpcode::JBE,
-	InstructionOpcode::JNA,
-	InstructionOpcode::JG,
-	InstructionOpcode::JNLE,
-	InstructionOpcode::JGE,
-	InstructionOpcode::JNL,
-	InstructionOpcode::JL,
-	InstructionOpcode::JNGE,
-	InstructionOpcode::JLE,
-	InstructionOpcode::JC,
-	InstructionOpcode::JNC,
-	InstructionOpcode::JO,
-	InstructionOpcode::JNO,
-	InstructionOpcode::JS,
-	InstructionOpcode::JNS,
-	InstructionOpcode::JP,
-	InstructionOpcode::JPE,
-	InstructionOpcode::JNP,
-	InstructionOpcode::JPO
-};
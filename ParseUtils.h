@@ -1,19 +1,18 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <sstream>
 #include <cstdint>
 #include <algorithm>
 #include <unordered_map>
-#include <unordered_set>
 #include "Instruction.h"
 
 class ParseUtils {
 public:
     static const std::unordered_map<std::string, InstructionOpcode> instr_map;
     static const std::unordered_map<std::string, RegisterOpcode>      reg_map;
-    static const std::unordered_set<InstructionOpcode>           jump_opcodes;
 
     static bool is_int(const std::string& str);
     static bool is_double(const std::string& str);
@@ -22,5 +21,6 @@ public:
     static double string_to_double(const std::string& str);
     static char string_to_char(const std::string& str);
     static std::string to_upper(const std::string& str);
+    static std::string_view opcode_name(InstructionOpcode opcode);
     static int32_t uint32_to_int32(uint32_t val);
 };
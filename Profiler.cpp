@@ -0,0 +1,137 @@
+#include "Profiler.h"
+#include "ParseUtils.h"
+#include "ProgramImage.h"
+
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+
+namespace {
+
+bool is_conditional_branch(InstructionOpcode op) {
+    return is_jump_opcode(op) && op != InstructionOpcode::JMP;
+}
+
+double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+uint64_t executed(const std::vector<Profiler::Entry>& entries) {
+    return std::accumulate(entries.begin(), entries.end(), uint64_t(0),
+                           [](uint64_t sum, const Profiler::Entry& e) { return sum + e.count; });
+}
+
+}
+
+void Profiler::clear() {
+    std::fill(m_counts.begin(), m_counts.end(), 0);
+    std::fill(m_taken.begin(), m_taken.end(), 0);
+}
+
+std::vector<Profiler::Entry> Profiler::entries(std::span<const DecodedInstruction> code) const {
+    std::vector<Entry> result(code.size());
+    for (uint32_t pc = 0; pc < code.size(); ++pc) {
+        const bool counted = pc < m_counts.size();
+        result[pc] = { pc, code[pc].opcode, counted ? m_counts[pc] : 0, false, counted ? m_taken[pc] : 0 };
+    }
+
+    // A fused record ran both halves; a fused jump was taken at its second half.
+    for (uint32_t pc = 0; pc < code.size(); ++pc) {
+        Entry& entry = result[pc];
+        if (is_fused_opcode(entry.opcode)) {
+            entry.opcode = base_opcode(entry.opcode);
+            if (pc + 1 < code.size()) {
+                result[pc + 1].count += entry.count;
+                result[pc + 1].taken += entry.taken;
+            }
+        }
+        entry.branch = is_conditional_branch(entry.opcode);
+        if (!entry.branch) {
+            entry.taken = 0;
+        }
+    }
+    return result;
+}
+
+std::string Profiler::report(const ProgramImage& image, size_t top) const {
+    const std::vector<Entry> all = entries(image.code());
+    const uint64_t total = executed(all);
+
+    std::vector<Entry> hot;
+    std::copy_if(all.begin(), all.end(), std::back_inserter(hot), [](const Entry& e) { return e.count > 0; });
+    std::stable_sort(hot.begin(), hot.end(), [](const Entry& a, const Entry& b) { return a.count > b.count; });
+    hot.resize(std::min(hot.size(), top));
+
+    std::array<uint64_t, OPCODE_COUNT> by_opcode {};
+    for (const Entry& e : all) {
+        by_opcode[static_cast<size_t>(e.opcode)] += e.count;
+    }
+    std::vector<size_t> opcodes;
+    for (size_t op = 0; op < OPCODE_COUNT; ++op) {
+        if (by_opcode[op]) {
+            opcodes.push_back(op);
+        }
+    }
+    std::stable_sort(opcodes.begin(), opcodes.end(), [&](size_t a, size_t b) { return by_opcode[a] > by_opcode[b]; });
+
+    std::ostringstream ss;
+    ss << "profile: " << total << " instructions executed\n";
+    ss << "hot spots:\n";
+    ss << std::setw(8) << "pc" << std::setw(8) << "line" << std::setw(14) << "count" << std::setw(8) << "%"
+       << "  instruction\n";
+    ss << std::fixed << std::setprecision(2);
+    for (const Entry& e : hot) {
+        ss << std::setw(8) << e.pc << std::setw(8) << image.source_line(e.pc) << std::setw(14) << e.count
+           << std::setw(8) << percent(e.count, total) << "  " << ParseUtils::opcode_name(e.opcode);
+        if (e.branch) {
+            ss << " (taken " << e.taken << ", not taken " << e.count - e.taken << ")";
+        }
+        ss << '\n';
+    }
+    ss << "opcodes:\n";
+    for (size_t op : opcodes) {
+        ss << std::setw(8) << ParseUtils::opcode_name(static_cast<InstructionOpcode>(op)) << std::setw(22)
+           << by_opcode[op] << std::setw(8) << percent(by_opcode[op], total) << '\n';
+    }
+    std::string text = ss.str();
+    text.pop_back();
+    return text;
+}
+
+void Profiler::write_csv(std::ostream& out, const ProgramImage& image) const {
+    out << "pc,line,opcode,count,taken,not_taken\n";
+    for (const Entry& e : entries(image.code())) {
+        if (e.count == 0) {
+            continue;
+        }
+        out << e.pc << ',' << image.source_line(e.pc) << ',' << ParseUtils::opcode_name(e.opcode) << ','
+            << e.count << ',';
+        if (e.branch) {
+            out << e.taken << ',' << e.count - e.taken;
+        } else {
+            out << ',';
+        }
+        out << '\n';
+    }
+}
+
+void Profiler::write_json(std::ostream& out, const ProgramImage& image) const {
+    const std::vector<Entry> all = entries(image.code());
+    out << "{\"executed\":" << executed(all) << ",\"instructions\":[";
+    bool first = true;
+    for (const Entry& e : all) {
+        if (e.count == 0) {
+            continue;
+        }
+        out << (first ? "" : ",") << "\n{\"pc\":" << e.pc << ",\"line\":" << image.source_line(e.pc)
+            << ",\"opcode\":\"" << ParseUtils::opcode_name(e.opcode) << "\",\"count\":" << e.count;
+        if (e.branch) {
+            out << ",\"taken\":" << e.taken << ",\"not_taken\":" << e.count - e.taken;
+        }
+        out << '}';
+        first = false;
+    }
+    out << "\n]}\n";
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Instruction.h"
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+class ProgramImage;
+
+// Execution profile of one program: how often each instruction ran, and how
+// often each conditional jump was taken.
+//
+// Attach one with VM::set_profiler(). The VM counts every record it
+// dispatches, by program index, and every taken jump; run loops without a
+// profiler are compiled without the counting. A fused pair is dispatched as
+// one record, so the reports split it back into its two instructions and
+// read as if the program had not been fused.
+class Profiler {
+public:
+    struct Entry {
+        uint32_t pc;
+        InstructionOpcode opcode;   // as written: the halves of a fused pair are reported apart
+        uint64_t count;
+        bool branch;                // conditional jump
+        uint64_t taken;
+    };
+
+    // Called by the VM before each run: covers program indices [0, size).
+    void prepare(size_t size) {
+        if (m_counts.size() < size) {
+            m_counts.resize(size);
+            m_taken.resize(size);
+        }
+    }
+    void count(uint32_t pc) { ++m_counts[pc]; }
+    void taken(uint32_t pc) { ++m_taken[pc]; }
+    void clear();
+
+    // One entry per instruction of `code`, the program the profile was taken on.
+    std::vector<Entry> entries(std::span<const DecodedInstruction> code) const;
+
+    // The hottest `top` instructions and every opcode, most executed first,
+    // with source lines taken from `image`.
+    std::string report(const ProgramImage& image, size_t top = 20) const;
+    // Every instruction that ran, in program order.
+    void write_csv(std::ostream& out, const ProgramImage& image) const;
+    void write_json(std::ostream& out, const ProgramImage& image) const;
+
+private:
+    std::vector<uint64_t> m_counts;     // records dispatched at each index
+    std::vector<uint64_t> m_taken;      // of those, jumps that left the fall-through path
+};
@@ -0,0 +1,184 @@
+#include "ProgramImage.h"
+#include "ParseUtils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+ProgramImage::~ProgramImage() {
+    if (m_mapping) {
+        munmap(m_mapping, m_mapping_size);
+    }
+}
+
+std::vector<std::byte> ProgramImage::serialize(const Assembler::Program& program) {
+    ImageHeader header {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.record_size = sizeof(DecodedInstruction);
+    header.opcode_count = OPCODE_COUNT;
+    header.instruction_count = static_cast<uint32_t>(program.code.size());
+    header.label_count = static_cast<uint32_t>(program.labels.size());
+
+    std::vector<LabelEntry> labels;
+    std::string strings;
+    for (const auto& [name, index] : program.labels) {
+        labels.push_back({ index, static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(name.size()) });
+        strings += name;
+    }
+    std::sort(labels.begin(), labels.end(), [](const LabelEntry& a, const LabelEntry& b) { return a.index < b.index; });
+    header.strings_size = static_cast<uint32_t>(strings.size());
+
+    size_t offset = sizeof(ImageHeader);
+    header.opcode_table_offset = offset;
+    offset += OPCODE_COUNT * OPCODE_NAME_SIZE;
+    header.code_offset = offset = align_up(offset, 16);
+    offset += program.code.size() * sizeof(DecodedInstruction);
+    header.label_offset = offset = align_up(offset, alignof(LabelEntry));
+    offset += labels.size() * sizeof(LabelEntry);
+    header.strings_offset = offset;
+    offset += strings.size();
+    header.debug_offset = offset = align_up(offset, alignof(uint32_t));
+    offset += program.code.size() * sizeof(uint32_t);
+
+    std::vector<std::byte> out(offset);
+    std::memcpy(out.data(), &header, sizeof(header));
+
+    for (size_t i = 0; i < OPCODE_COUNT; ++i) {
+        std::string_view name = ParseUtils::opcode_name(static_cast<InstructionOpcode>(i));
+        std::memcpy(out.data() + header.opcode_table_offset + i * OPCODE_NAME_SIZE,
+                    name.data(), std::min(name.size(), OPCODE_NAME_SIZE));
+    }
+
+    std::memcpy(out.data() + header.code_offset, program.code.data(), program.code.size() * sizeof(DecodedInstruction));
+    std::memcpy(out.data() + header.label_offset, labels.data(), labels.size() * sizeof(LabelEntry));
+    std::memcpy(out.data() + header.strings_offset, strings.data(), strings.size());
+
+    std::vector<uint32_t> lines = program.source_lines;
+    lines.resize(program.code.size());
+    std::memcpy(out.data() + header.debug_offset, lines.data(), lines.size() * sizeof(uint32_t));
+
+    return out;
+}
+
+void ProgramImage::parse(const std::byte* data, size_t size) {
+    if (size < sizeof(ImageHeader)) {
+        throw std::runtime_error("Image is truncated");
+    }
+
+    ImageHeader header;
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error("Not a SLAVE16 image");
+    }
+    if (header.version != VERSION) {
+        throw std::runtime_error("Unsupported image version " + std::to_string(header.version));
+    }
+    if (header.record_size != sizeof(DecodedInstruction)) {
+        throw std::runtime_error("Image instruction record size does not match this build");
+    }
+
+    auto check_section = [&](uint64_t offset, uint64_t bytes, size_t alignment) {
+        if (offset > size || bytes > size - offset || offset % alignment != 0) {
+            throw std::runtime_error("Image section out of bounds");
+        }
+    };
+
+    check_section(header.opcode_table_offset, uint64_t(header.opcode_count) * OPCODE_NAME_SIZE, 1);
+    check_section(header.code_offset, uint64_t(header.instruction_count) * sizeof(DecodedInstruction), alignof(DecodedInstruction));
+    check_section(header.label_offset, uint64_t(header.label_count) * sizeof(LabelEntry), alignof(LabelEntry));
+    check_section(header.strings_offset, header.strings_size, 1);
+    check_section(header.debug_offset, uint64_t(header.instruction_count) * sizeof(uint32_t), alignof(uint32_t));
+
+    // The code section stores raw opcode values, so they must mean the same thing here.
+    if (header.opcode_count != OPCODE_COUNT) {
+        throw std::runtime_error("Image was built for a different instruction set");
+    }
+    for (size_t i = 0; i < OPCODE_COUNT; ++i) {
+        const char* stored = reinterpret_cast<const char*>(data + header.opcode_table_offset + i * OPCODE_NAME_SIZE);
+        std::string_view name = ParseUtils::opcode_name(static_cast<InstructionOpcode>(i));
+        if (std::string_view(stored, strnlen(stored, OPCODE_NAME_SIZE)) != name.substr(0, OPCODE_NAME_SIZE)) {
+            throw std::runtime_error("Image was built for a different instruction set");
+        }
+    }
+
+    m_code = { reinterpret_cast<const DecodedInstruction*>(data + header.code_offset), header.instruction_count };
+    m_labels = { reinterpret_cast<const LabelEntry*>(data + header.label_offset), header.label_count };
+    m_strings = { reinterpret_cast<const char*>(data + header.strings_offset), header.strings_size };
+    m_source_lines = { reinterpret_cast<const uint32_t*>(data + header.debug_offset), header.instruction_count };
+}
+
+std::shared_ptr<const ProgramImage> ProgramImage::from_program(const Assembler::Program& program) {
+    std::shared_ptr<ProgramImage> image(new ProgramImage());
+    image->m_buffer = serialize(program);
+    image->parse(image->m_buffer.data(), image->m_buffer.size());
+    return image;
+}
+
+std::shared_ptr<const ProgramImage> ProgramImage::map_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Cannot read " + path);
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Cannot map " + path);
+    }
+    madvise(mapping, st.st_size, MADV_WILLNEED);
+
+    std::shared_ptr<ProgramImage> image(new ProgramImage());
+    image->m_mapping = mapping;
+    image->m_mapping_size = st.st_size;
+    image->parse(static_cast<const std::byte*>(mapping), st.st_size);
+    return image;
+}
+
+void ProgramImage::write_file(const std::string& path, const Assembler::Program& program) {
+    std::vector<std::byte> data = serialize(program);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    if (!out) {
+        throw std::runtime_error("Cannot write " + path);
+    }
+}
+
+bool ProgramImage::is_image_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(MAGIC)] {};
+    in.read(magic, sizeof(magic));
+    return in && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+uint32_t ProgramImage::source_line(uint32_t index) const {
+    return index < m_source_lines.size() ? m_source_lines[index] : 0;
+}
+
+std::vector<std::pair<std::string_view, uint32_t>> ProgramImage::labels() const {
+    std::vector<std::pair<std::string_view, uint32_t>> out;
+    out.reserve(m_labels.size());
+    for (const LabelEntry& entry : m_labels) {
+        if (uint64_t(entry.name_offset) + entry.name_size <= m_strings.size()) {
+            out.emplace_back(m_strings.substr(entry.name_offset, entry.name_size), entry.index);
+        }
+    }
+    return out;
+}
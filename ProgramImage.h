@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "Assembler.h"
+#include "Instruction.h"
+
+// Assembled program in the on-disk image layout. All fields are stored in host
+// byte order; the layout is:
+//
+//   ImageHeader
+//   opcode table   opcode_count x char[8], mnemonic of each opcode value
+//   code           instruction_count x DecodedInstruction (opcode + inline operands)
+//   labels         label_count x LabelEntry
+//   strings        label names, not NUL-terminated
+//   debug          instruction_count x uint32_t source line
+//
+// A mapped image is executed in place: code() points straight into the mapping.
+class ProgramImage {
+public:
+    static constexpr char MAGIC[4] = { 'S', '1', '6', 'I' };
+    static constexpr uint16_t VERSION = 3;
+
+    struct ImageHeader {
+        char     magic[4];
+        uint16_t version;
+        uint16_t record_size;
+        uint32_t opcode_count;
+        uint32_t instruction_count;
+        uint32_t label_count;
+        uint32_t strings_size;
+        uint64_t opcode_table_offset;
+        uint64_t code_offset;
+        uint64_t label_offset;
+        uint64_t strings_offset;
+        uint64_t debug_offset;
+    };
+
+    struct LabelEntry {
+        uint32_t index;
+        uint32_t name_offset;
+        uint32_t name_size;
+    };
+
+    static constexpr size_t OPCODE_NAME_SIZE = 8;
+
+    ProgramImage(const ProgramImage&) = delete;
+    ProgramImage& operator=(const ProgramImage&) = delete;
+    ~ProgramImage();
+
+    // Serializes an assembled program into an in-memory image.
+    static std::shared_ptr<const ProgramImage> from_program(const Assembler::Program& program);
+    // Maps an image file read-only; nothing is copied or parsed beyond the header.
+    static std::shared_ptr<const ProgramImage> map_file(const std::string& path);
+    static void write_file(const std::string& path, const Assembler::Program& program);
+    static bool is_image_file(const std::string& path);
+
+    std::span<const DecodedInstruction> code() const { return m_code; }
+    uint32_t source_line(uint32_t index) const;
+    std::vector<std::pair<std::string_view, uint32_t>> labels() const;
+
+private:
+    ProgramImage() = default;
+
+    static std::vector<std::byte> serialize(const Assembler::Program& program);
+    void parse(const std::byte* data, size_t size);
+
+    std::vector<std::byte> m_buffer;   // backing store when not mapped
+    void* m_mapping = nullptr;
+    size_t m_mapping_size = 0;
+
+    std::span<const DecodedInstruction> m_code;
+    std::span<const LabelEntry> m_labels;
+    std::string_view m_strings;
+    std::span<const uint32_t> m_source_lines;
+};
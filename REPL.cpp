@@ -1,50 +1,35 @@
 #include "REPL.h"
+#include <fstream>
 #include <iostream>
+#include <unistd.h>
 #include "TimeUtils.h"
 
-REPL::REPL() {
-    m_interrupt_manager.register_handler(*this);
+REPL::REPL() : m_console(STDOUT_FILENO) {
+    auto service = [this](void (REPL::*handler)(const Registers&)) {
+        return [this, handler](const Interrupt& intr) { (this->*handler)(intr.registers); };
+    };
+
+    m_interrupt_manager.set_service(InterruptType::ReadCharWithEcho, service(&REPL::intr_read_char_with_echo), this);
+    m_interrupt_manager.set_service(InterruptType::WriteChar, service(&REPL::intr_write_char), this);
+    m_interrupt_manager.set_service(InterruptType::WriteString, service(&REPL::intr_write_string), this);
+    m_interrupt_manager.set_service(InterruptType::ReadCharNoEcho, service(&REPL::intr_read_char_no_echo), this);
+    m_interrupt_manager.set_service(InterruptType::GetSystemDate, service(&REPL::intr_get_system_date), this);
+    use_root(RunOptions{}.root);
+}
 
-    m_dispatch[InterruptType::ReadCharWithEcho] = [this](const Registers& reg){ intr_read_char_with_echo(reg); };
-    m_dispatch[InterruptType::WriteChar] = [this](const Registers& reg){ intr_write_char(reg); };
-    m_dispatch[InterruptType::ReadCharNoEcho] = [this](const Registers& reg){ intr_read_char_no_echo(reg); };
-    m_dispatch[InterruptType::GetSystemDate] = [this](const Registers& reg){ intr_get_system_date(reg); };
+// Serves the file interrupts from `root`; the services of the previous root
+// are replaced before it goes away.
+void REPL::use_root(const std::string& root) {
+    auto files = std::make_unique<FileServices>(root);
+    files->install(m_interrupt_manager);
+    files->set_console(&m_console);
+    m_files = std::move(files);
 }
 
 REPL::~REPL() {
-    m_interrupt_manager.unregister_handler(*this);
+    m_interrupt_manager.remove_services(this);
 }
 
-Instruction REPL::fetch_decode(const std::string& line) {
-	std::istringstream iss(line);
-	std::string op;
-	iss >> op;
-	
-	Instruction instr;
-	instr.opcode = str_to_opcode(op);
-
-	std::string token;
-    while (iss >> token) {
-        if (token.back() == ',')
-            token.pop_back();
-
-        RegisterOpcode reg_op = str_to_register_opcode(token);
-        if (reg_op != RegisterOpcode::INVALID_REG) {
-            instr.operands.push_back(reg_op);
-        } else if (ParseUtils::is_int(token)) {
-            instr.operands.push_back(ParseUtils::string_to_int(token));
-        } else if (ParseUtils::is_double(token)) {
-            instr.operands.push_back(ParseUtils::string_to_double(token));
-        } else if (ParseUtils::is_char(token)) {
-            instr.operands.push_back((int)ParseUtils::string_to_char(token));
-        } else {
-            throw std::invalid_argument("Unknown type of operand: " + token);
-        }
-    }
-
-	return instr;
-};
-
 void REPL::run() {
     m_vm.set_interrupt_manager(&m_interrupt_manager);
     std::string line;
@@ -53,59 +38,180 @@ void REPL::run() {
     while (!m_is_halted) {
         std::cerr << line_number << ": ";
         if (!std::getline(std::cin, line)) break;
-        
-        if (line.empty()) continue;
 
-        auto instr = fetch_decode(line);
+        DecodedInstruction instr;
+        if (!Assembler::assemble_line(line, instr, m_labels, line_number)) continue;
+
         m_vm.execute(instr);
+        m_is_halted = m_vm.halted();
         ++line_number;
     }
 }
 
-void REPL::handle_interrupt(const Interrupt& intr) {
-    auto it = m_dispatch.find(intr.type);
-    if (it == m_dispatch.end()) {
-        throw std::invalid_argument("Unknown interruption type!");
+std::shared_ptr<const ProgramImage> REPL::load_program(const std::string& path, const RunOptions& options) {
+    if (ProgramImage::is_image_file(path)) {
+        // Images are executed as written: fused or not is decided by `-o`.
+        return ProgramImage::map_file(path);
     }
 
-    it->second(intr.registers);
+    Assembler::Program program = Assembler::assemble_file(path);
+    if (options.fuse) {
+        Fusion::run(program.code);
+    }
+    return ProgramImage::from_program(program);
 }
 
-InstructionOpcode REPL::str_to_opcode(const std::string& instr) {
-    auto up = ParseUtils::to_upper(instr);
-    auto it = ParseUtils::instr_map.find(up);
-    return it != ParseUtils::instr_map.end() ? it->second : InstructionOpcode::INVALID;
+// Runs `options.instances` copies of the program and prints each one's
+// output in instance order once all of them are done. Returns the highest
+// exit code of any copy.
+int REPL::run_engine(std::shared_ptr<const ProgramImage> image, const RunOptions& options) {
+    Engine::Options engine_options;
+    engine_options.instances = options.instances;
+    engine_options.threads = options.threads;
+    engine_options.slice = options.slice;
+    engine_options.jit = options.jit;
+    engine_options.input = STDIN_FILENO;
+    engine_options.root = options.root;
+    engine_options.raw = options.raw_output;
+
+    Engine engine(std::move(image), engine_options);
+    Engine::Report report = engine.run();
+
+    int exit_code = 0;
+    for (size_t i = 0; i < engine.size(); ++i) {
+        const Engine::Instance& instance = engine.instance(i);
+        if (instance.vm.halted()) {
+            exit_code = std::max<int>(exit_code, instance.vm.exit_code());
+        }
+        std::cout << instance.output;
+        if (instance.status == Engine::Status::Failed) {
+            std::cerr << "instance " << i << ": " << instance.error << std::endl;
+        }
+    }
+    std::cout.flush();
+
+    if (options.stats) {
+        std::cerr << report.to_string() << std::endl;
+    }
+    if (report.failed) {
+        throw std::runtime_error(std::to_string(report.failed) + " of " + std::to_string(report.instances) +
+                                 " instances failed");
+    }
+    return exit_code;
 }
 
-RegisterOpcode REPL::str_to_register_opcode(const std::string& reg) {
-    auto up = ParseUtils::to_upper(reg);
-    auto it = ParseUtils::reg_map.find(up);
-    return it != ParseUtils::reg_map.end() ? it->second : RegisterOpcode::INVALID_REG;
+int REPL::run_file(const std::string& path, const RunOptions& options) {
+    std::shared_ptr<const ProgramImage> image = load_program(path, options);
+    if (options.instances > 0) {
+        if (options.profile) {
+            throw std::invalid_argument("Profiling runs a single VM and cannot be combined with --instances");
+        }
+        return run_engine(std::move(image), options);
+    }
+
+    m_vm.set_interrupt_manager(&m_interrupt_manager);
+    m_vm.set_jit_mode(options.jit);
+    m_vm.set_profiler(options.profile ? &m_profiler : nullptr);
+    m_vm.load(image);
+    m_async_io = options.async_io;
+    m_console.set_raw(options.raw_output);
+    use_root(options.root);
+
+    try {
+        while (m_vm.run(UINT64_MAX) == RunStatus::Parked) {
+            while (m_vm.parked()) {
+                m_events.poll(-1);
+            }
+        }
+    } catch (const std::exception& e) {
+        m_console.flush();
+        uint32_t line = image->source_line(m_vm.pc());
+        if (line == 0) {
+            throw;
+        }
+        throw std::runtime_error("line " + std::to_string(line) + ": " + e.what());
+    }
+    m_console.flush();
+
+    if (options.stats) {
+        std::cerr << Fusion::report(Fusion::analyze(image->code()), m_vm.fused_executed()) << std::endl;
+        if (m_vm.jit()) {
+            std::cerr << m_vm.jit()->report() << std::endl;
+        }
+        if (uint64_t returns = m_vm.returns_predicted() + m_vm.returns_mispredicted()) {
+            std::cerr << "returns: " << returns << " executed, " << m_vm.returns_predicted()
+                      << " predicted by the shadow return stack" << std::endl;
+        }
+    }
+    if (options.profile) {
+        write_profile(*image, options);
+    }
+    return m_vm.halted() ? m_vm.exit_code() : 0;
 }
 
-void REPL::intr_read_char_with_echo(const Registers&) {
-    std::cout << ">> ";
+void REPL::write_profile(const ProgramImage& image, const RunOptions& options) const {
+    std::cerr << m_profiler.report(image) << std::endl;
+    if (options.profile_out.empty()) {
+        return;
+    }
 
-    char ch;
-    std::cin.get(ch);       
-    std::cin.get();
-    std::cout << ch << std::endl;
+    std::ofstream out(options.profile_out, std::ios::trunc);
+    if (options.profile_out.ends_with(".json")) {
+        m_profiler.write_json(out, image);
+    } else {
+        m_profiler.write_csv(out, image);
+    }
+    if (!out) {
+        throw std::runtime_error("Cannot write " + options.profile_out);
+    }
+}
 
-    m_vm.on_read_char(ch);
+void REPL::intr_read_char_with_echo(const Registers&) {
+    read_char(true);
 }
 
 void REPL::intr_write_char(const Registers& reg) {
     char ch = reg.get(RegisterOpcode::DL);
 
-    std::cout << ch << std::endl;
+    m_console.write(ch);
+}
+
+// DS:DX is the flat address in EDX; the string is copied out in one piece.
+void REPL::intr_write_string(const Registers& reg) {
+    m_console.write(m_vm.memory().read_string(reg.get(RegisterOpcode::EDX), '$'));
 }
 
 void REPL::intr_read_char_no_echo(const Registers&) {
-    std::cout << ">> ";
+    read_char(false);
+}
+
+// Reads a character and the line break typed after it. In async mode the VM
+// parks and the read completes from the event loop in run_file().
+void REPL::read_char(bool echo) {
+    if (!m_console.raw()) {
+        m_console.prompt(">> ");
+    }
+    m_console.input_requested();
+
+    if (m_async_io) {
+        m_vm.park();
+        m_events.submit_read(STDIN_FILENO, 2, [this, echo](std::string_view data, int) {
+            const char ch = data.empty() ? Interrupt::END_OF_INPUT : data[0];
+            if (echo) {
+                m_console.write(ch);
+            }
+            m_vm.on_read_char(ch);
+            m_vm.resume();
+        });
+        return;
+    }
 
     char ch;
     std::cin.get(ch);       
     std::cin.get();
+    if (echo) {
+        m_console.write(ch);
+    }
 
     m_vm.on_read_char(ch);
 }
@@ -4,29 +4,60 @@
 #include "IInterruptHandler.h"
 #include "InterruptManager.h"
 #include "Interrupt.h"
+#include "Assembler.h"
+#include "Fusion.h"
+#include "Engine.h"
+#include "EventLoop.h"
+#include "ConsoleDevice.h"
+#include "FileServices.h"
+#include "Profiler.h"
 #include <iostream>
 
-class REPL : public IInterruptHandler {
+// Options for running a whole program from the command line.
+struct RunOptions {
+    bool fuse = true;       // run the superinstruction fusion pass on source files
+    bool stats = false;     // print fusion and JIT statistics to stderr after the run
+    JitMode jit = JitMode::Off;
+    size_t instances = 0;   // > 0: run that many copies on the multi-VM Engine
+    size_t threads = 0;     // Engine worker threads; 0 for one per core
+    uint64_t slice = Engine::Options{}.slice;
+    bool async_io = false;  // console reads park the VM instead of blocking in the service
+    bool raw_output = false;    // console writes are passed through without line breaks
+    std::string root = ".";     // sandbox directory of the DOS file services
+    bool profile = false;       // print a hot-spot profile to stderr after the run
+    std::string profile_out;    // also write the whole profile here: JSON for *.json, else CSV
+};
+
+class REPL {
 private:
     VM m_vm;
     bool m_is_halted = false;    
     InterruptManager m_interrupt_manager;
-    std::unordered_map<InterruptType, std::function<void(const Registers& reg)>> m_dispatch;
+    EventLoop m_events;
+    ConsoleDevice m_console;
+    std::unique_ptr<FileServices> m_files;
+    bool m_async_io = false;
+    Profiler m_profiler;
+    Assembler::Labels m_labels;
 
 public:
     REPL();
     ~REPL();
     void run();
-    void handle_interrupt(const Interrupt& intr);
+    // Returns the program's exit code: AL of INT 21h AH=4Ch, else 0.
+    int run_file(const std::string& path, const RunOptions& options = {});
     
 private:
-    Instruction fetch_decode(const std::string& line);
-    InstructionOpcode str_to_opcode(const std::string& instr);
-    RegisterOpcode str_to_register_opcode(const std::string& reg);
+    static std::shared_ptr<const ProgramImage> load_program(const std::string& path, const RunOptions& options);
+    void use_root(const std::string& root);
+    void write_profile(const ProgramImage& image, const RunOptions& options) const;
+    static int run_engine(std::shared_ptr<const ProgramImage> image, const RunOptions& options);
 
     void intr_read_char_with_echo(const Registers&);
     void intr_write_char(const Registers& reg);
+    void intr_write_string(const Registers& reg);
     void intr_read_char_no_echo(const Registers&);
+    void read_char(bool echo);
 
     void intr_get_system_date(const Registers&);
 };
\ No newline at end of file
@@ -1,28 +1,86 @@
 #pragma once
 
 #include <cstdint>
-#include <unordered_map>
-#include <functional>
+#include <array>
 #include <stdexcept>
 #include <string>
+#include <bit>
 #include "Instruction.h"
 
+// Arithmetic/logic operation whose condition flags can be derived later from
+// its operands and result.
+enum class FlagOp : uint8_t {
+    None,
+    Add,
+    Sub,
+    Cmp,
+    And,
+    OrXor,
+    Shl,    // SHL and SAL
+    Sar,
+    Shr
+};
+
+enum class FlagMode : uint8_t {
+    Eager,  // flags are written into EFLAGS by every instruction
+    Lazy    // only the last FlagOp is recorded; flags are derived on read
+};
+
 class Registers {
+    friend class Jit;   // generated code addresses m_regs and m_lazy directly
+
 private:
-    uint32_t m_eax {}, m_ebx {}, m_ecx {}, m_edx {};
-    uint32_t m_esi {}, m_edi {}, m_esp {}, m_ebp {};
+    enum Slot : uint8_t {
+        SLOT_EAX, SLOT_EBX, SLOT_ECX, SLOT_EDX,
+        SLOT_ESI, SLOT_EDI, SLOT_ESP, SLOT_EBP,
+        SLOT_COUNT
+    };
+
+    // Where a RegisterOpcode lives inside m_regs: AH is (m_regs[SLOT_EAX] >> 8) & 0xFF.
+    struct RegisterView {
+        uint8_t  slot;
+        uint8_t  shift;
+        uint32_t mask;
+    };
+
+    static constexpr size_t VIEW_COUNT = static_cast<size_t>(RegisterOpcode::INVALID_REG);
+    static constexpr std::array<RegisterView, VIEW_COUNT> s_views = {{
+        { SLOT_EAX, 0, 0xFFFFFFFF }, { SLOT_EAX, 0, 0xFFFF }, { SLOT_EAX, 8, 0xFF }, { SLOT_EAX, 0, 0xFF },
+        { SLOT_EBX, 0, 0xFFFFFFFF }, { SLOT_EBX, 0, 0xFFFF }, { SLOT_EBX, 8, 0xFF }, { SLOT_EBX, 0, 0xFF },
+        { SLOT_ECX, 0, 0xFFFFFFFF }, { SLOT_ECX, 0, 0xFFFF }, { SLOT_ECX, 8, 0xFF }, { SLOT_ECX, 0, 0xFF },
+        { SLOT_EDX, 0, 0xFFFFFFFF }, { SLOT_EDX, 0, 0xFFFF }, { SLOT_EDX, 8, 0xFF }, { SLOT_EDX, 0, 0xFF },
+        { SLOT_ESI, 0, 0xFFFFFFFF }, { SLOT_ESI, 0, 0xFFFF },
+        { SLOT_EDI, 0, 0xFFFFFFFF }, { SLOT_EDI, 0, 0xFFFF },
+        { SLOT_ESP, 0, 0xFFFFFFFF }, { SLOT_ESP, 0, 0xFFFF },
+        { SLOT_EBP, 0, 0xFFFFFFFF }, { SLOT_EBP, 0, 0xFFFF },
+    }};
+
+    // Last flag-setting operation that has not been folded into m_eflags yet.
+    struct LazyFlags {
+        FlagOp   op = FlagOp::None;
+        uint32_t a {};
+        uint32_t b {};
+        uint32_t result {};
+    };
+
+    uint32_t m_regs[SLOT_COUNT] {};
     uint32_t m_eflags {};
-
-    std::unordered_map<RegisterOpcode, std::function<uint32_t()>> m_reg_getters;
-    std::unordered_map<RegisterOpcode, std::function<void(uint32_t)>> m_reg_setters;   
+    LazyFlags m_lazy;
+    FlagMode m_flag_mode = FlagMode::Lazy;
 
     static constexpr uint32_t flag_mask(Flag f) { return 1u << (uint8_t)f; }
 
-public:
-    Registers();
-    
-    void init_register_maps();
+    static constexpr uint32_t ARITH_FLAGS = (1u << (uint8_t)Flag::Carry) | (1u << (uint8_t)Flag::Zero) |
+                                            (1u << (uint8_t)Flag::Sign) | (1u << (uint8_t)Flag::Overflow);
+    static constexpr uint32_t LOGIC_FLAGS = ARITH_FLAGS | (1u << (uint8_t)Flag::Parity);
 
+    static constexpr uint32_t written_flags(FlagOp op);
+    static uint32_t compute_flags(FlagOp op, uint32_t a, uint32_t b, uint32_t result);
+    // FlagMode::Eager: the handlers' original one-set_flag-per-flag rules,
+    // kept apart from compute_flags() so that eager runs check lazy ones.
+    void set_flags_eagerly(FlagOp op, uint32_t a, uint32_t b, uint32_t result);
+
+public:
     std::string info() const;
 
     uint32_t get(RegisterOpcode opcode) const;
@@ -31,83 +89,208 @@ public:
     bool get_flag(Flag f) const;
     void set_flag(Flag f, bool value);
 
+    // Record the flag effects of `op` on operands a, b producing `result`.
+    // For shifts, a is the original value and b the masked shift count.
+    void update_flags(FlagOp op, uint32_t a, uint32_t b, uint32_t result);
+    uint32_t get_eflags() const;
+    void set_eflags(uint32_t value);
+    void materialize_flags();
+
+    FlagMode get_flag_mode() const { return m_flag_mode; }
+    void set_flag_mode(FlagMode mode);
+    // Zeroes every register and flag; the flag mode stays.
+    void reset();
+
+    bool operator==(const Registers& other) const;
+
     // ====== EAX ======
-    uint32_t get_EAX() const { return m_eax; }
-    void     set_EAX(uint32_t v) { m_eax = v; }
+    uint32_t get_EAX() const { return m_regs[SLOT_EAX]; }
+    void     set_EAX(uint32_t v) { m_regs[SLOT_EAX] = v; }
 
-    uint16_t get_AX() const { return m_eax & 0xFFFF; }
-    void     set_AX(uint16_t v) { m_eax = (m_eax & 0xFFFF0000) | v; }
+    uint16_t get_AX() const { return m_regs[SLOT_EAX] & 0xFFFF; }
+    void     set_AX(uint16_t v) { m_regs[SLOT_EAX] = (m_regs[SLOT_EAX] & 0xFFFF0000) | v; }
 
-    uint8_t  get_AH() const { return uint8_t((m_eax >> 8) & 0xFF); }
-    void     set_AH(uint8_t v) { m_eax = (m_eax & 0xFFFF00FF) | (uint32_t(v) << 8); }
+    uint8_t  get_AH() const { return uint8_t((m_regs[SLOT_EAX] >> 8) & 0xFF); }
+    void     set_AH(uint8_t v) { m_regs[SLOT_EAX] = (m_regs[SLOT_EAX] & 0xFFFF00FF) | (uint32_t(v) << 8); }
 
-    uint8_t  get_AL() const { return uint8_t(m_eax & 0xFF); }
-    void     set_AL(uint8_t v) { m_eax = (m_eax & 0xFFFFFF00) | v; }
+    uint8_t  get_AL() const { return uint8_t(m_regs[SLOT_EAX] & 0xFF); }
+    void     set_AL(uint8_t v) { m_regs[SLOT_EAX] = (m_regs[SLOT_EAX] & 0xFFFFFF00) | v; }
 
     // ====== EBX ======
-    uint32_t get_EBX() const { return m_ebx; }
-    void     set_EBX(uint32_t v) { m_ebx = v; }
+    uint32_t get_EBX() const { return m_regs[SLOT_EBX]; }
+    void     set_EBX(uint32_t v) { m_regs[SLOT_EBX] = v; }
 
-    uint16_t get_BX() const { return m_ebx & 0xFFFF; }
-    void     set_BX(uint16_t v) { m_ebx = (m_ebx & 0xFFFF0000) | v; }
+    uint16_t get_BX() const { return m_regs[SLOT_EBX] & 0xFFFF; }
+    void     set_BX(uint16_t v) { m_regs[SLOT_EBX] = (m_regs[SLOT_EBX] & 0xFFFF0000) | v; }
 
-    uint8_t  get_BH() const { return uint8_t((m_ebx >> 8) & 0xFF); }
-    void     set_BH(uint8_t v) { m_ebx = (m_ebx & 0xFFFF00FF) | (uint32_t(v) << 8); }
+    uint8_t  get_BH() const { return uint8_t((m_regs[SLOT_EBX] >> 8) & 0xFF); }
+    void     set_BH(uint8_t v) { m_regs[SLOT_EBX] = (m_regs[SLOT_EBX] & 0xFFFF00FF) | (uint32_t(v) << 8); }
 
-    uint8_t  get_BL() const { return uint8_t(m_ebx & 0xFF); }
-    void     set_BL(uint8_t v) { m_ebx = (m_ebx & 0xFFFFFF00) | v; }
+    uint8_t  get_BL() const { return uint8_t(m_regs[SLOT_EBX] & 0xFF); }
+    void     set_BL(uint8_t v) { m_regs[SLOT_EBX] = (m_regs[SLOT_EBX] & 0xFFFFFF00) | v; }
 
     // ====== ECX ======
-    uint32_t get_ECX() const { return m_ecx; }
-    void     set_ECX(uint32_t v) { m_ecx = v; }
+    uint32_t get_ECX() const { return m_regs[SLOT_ECX]; }
+    void     set_ECX(uint32_t v) { m_regs[SLOT_ECX] = v; }
 
-    uint16_t get_CX() const { return m_ecx & 0xFFFF; }
-    void     set_CX(uint16_t v) { m_ecx = (m_ecx & 0xFFFF0000) | v; }
+    uint16_t get_CX() const { return m_regs[SLOT_ECX] & 0xFFFF; }
+    void     set_CX(uint16_t v) { m_regs[SLOT_ECX] = (m_regs[SLOT_ECX] & 0xFFFF0000) | v; }
 
-    uint8_t  get_CH() const { return uint8_t((m_ecx >> 8) & 0xFF); }
-    void     set_CH(uint8_t v) { m_ecx = (m_ecx & 0xFFFF00FF) | (uint32_t(v) << 8); }
+    uint8_t  get_CH() const { return uint8_t((m_regs[SLOT_ECX] >> 8) & 0xFF); }
+    void     set_CH(uint8_t v) { m_regs[SLOT_ECX] = (m_regs[SLOT_ECX] & 0xFFFF00FF) | (uint32_t(v) << 8); }
 
-    uint8_t  get_CL() const { return uint8_t(m_ecx & 0xFF); }
-    void     set_CL(uint8_t v) { m_ecx = (m_ecx & 0xFFFFFF00) | v; }
+    uint8_t  get_CL() const { return uint8_t(m_regs[SLOT_ECX] & 0xFF); }
+    void     set_CL(uint8_t v) { m_regs[SLOT_ECX] = (m_regs[SLOT_ECX] & 0xFFFFFF00) | v; }
 
     // ====== EDX ======
-    uint32_t get_EDX() const { return m_edx; }
-    void     set_EDX(uint32_t v) { m_edx = v; }
+    uint32_t get_EDX() const { return m_regs[SLOT_EDX]; }
+    void     set_EDX(uint32_t v) { m_regs[SLOT_EDX] = v; }
 
-    uint16_t get_DX() const { return m_edx & 0xFFFF; }
-    void     set_DX(uint16_t v) { m_edx = (m_edx & 0xFFFF0000) | v; }
+    uint16_t get_DX() const { return m_regs[SLOT_EDX] & 0xFFFF; }
+    void     set_DX(uint16_t v) { m_regs[SLOT_EDX] = (m_regs[SLOT_EDX] & 0xFFFF0000) | v; }
 
-    uint8_t  get_DH() const { return uint8_t((m_edx >> 8) & 0xFF); }
-    void     set_DH(uint8_t v) { m_edx = (m_edx & 0xFFFF00FF) | (uint32_t(v) << 8); }
+    uint8_t  get_DH() const { return uint8_t((m_regs[SLOT_EDX] >> 8) & 0xFF); }
+    void     set_DH(uint8_t v) { m_regs[SLOT_EDX] = (m_regs[SLOT_EDX] & 0xFFFF00FF) | (uint32_t(v) << 8); }
 
-    uint8_t  get_DL() const { return uint8_t(m_edx & 0xFF); }
-    void     set_DL(uint8_t v) { m_edx = (m_edx & 0xFFFFFF00) | v; }
+    uint8_t  get_DL() const { return uint8_t(m_regs[SLOT_EDX] & 0xFF); }
+    void     set_DL(uint8_t v) { m_regs[SLOT_EDX] = (m_regs[SLOT_EDX] & 0xFFFFFF00) | v; }
 
     // ====== ESI ======
-    uint32_t get_ESI() const { return m_esi; }
-    void     set_ESI(uint32_t v) { m_esi = v; }
+    uint32_t get_ESI() const { return m_regs[SLOT_ESI]; }
+    void     set_ESI(uint32_t v) { m_regs[SLOT_ESI] = v; }
 
-    uint16_t get_SI() const { return m_esi & 0xFFFF; }
-    void     set_SI(uint16_t v) { m_esi = (m_esi & 0xFFFF0000) | v; }
+    uint16_t get_SI() const { return m_regs[SLOT_ESI] & 0xFFFF; }
+    void     set_SI(uint16_t v) { m_regs[SLOT_ESI] = (m_regs[SLOT_ESI] & 0xFFFF0000) | v; }
 
     // ====== EDI ======
-    uint32_t get_EDI() const { return m_edi; }
-    void     set_EDI(uint32_t v) { m_edi = v; }
+    uint32_t get_EDI() const { return m_regs[SLOT_EDI]; }
+    void     set_EDI(uint32_t v) { m_regs[SLOT_EDI] = v; }
 
-    uint16_t get_DI() const { return m_edi & 0xFFFF; }
-    void     set_DI(uint16_t v) { m_edi = (m_edi & 0xFFFF0000) | v; }
+    uint16_t get_DI() const { return m_regs[SLOT_EDI] & 0xFFFF; }
+    void     set_DI(uint16_t v) { m_regs[SLOT_EDI] = (m_regs[SLOT_EDI] & 0xFFFF0000) | v; }
 
     // ====== ESP ======
-    uint32_t get_ESP() const { return m_esp; }
-    void     set_ESP(uint32_t v) { m_esp = v; }
+    uint32_t get_ESP() const { return m_regs[SLOT_ESP]; }
+    void     set_ESP(uint32_t v) { m_regs[SLOT_ESP] = v; }
 
-    uint16_t get_SP() const { return m_esp & 0xFFFF; }
-    void     set_SP(uint16_t v) { m_esp = (m_esp & 0xFFFF0000) | v; }
+    uint16_t get_SP() const { return m_regs[SLOT_ESP] & 0xFFFF; }
+    void     set_SP(uint16_t v) { m_regs[SLOT_ESP] = (m_regs[SLOT_ESP] & 0xFFFF0000) | v; }
 
     // ====== EBP ======
-    uint32_t get_EBP() const { return m_ebp; }
-    void     set_EBP(uint32_t v) { m_ebp = v; }
+    uint32_t get_EBP() const { return m_regs[SLOT_EBP]; }
+    void     set_EBP(uint32_t v) { m_regs[SLOT_EBP] = v; }
 
-    uint16_t get_BP() const { return m_ebp & 0xFFFF; }
-    void     set_BP(uint16_t v) { m_ebp = (m_ebp & 0xFFFF0000) | v; }
+    uint16_t get_BP() const { return m_regs[SLOT_EBP] & 0xFFFF; }
+    void     set_BP(uint16_t v) { m_regs[SLOT_EBP] = (m_regs[SLOT_EBP] & 0xFFFF0000) | v; }
 };
+
+inline uint32_t Registers::get(RegisterOpcode opcode) const {
+    const auto index = static_cast<size_t>(opcode);
+    if (index >= VIEW_COUNT) {
+        throw std::out_of_range("Invalid register opcode for get");
+    }
+
+    const RegisterView& view = s_views[index];
+    return (m_regs[view.slot] >> view.shift) & view.mask;
+}
+
+inline void Registers::set(RegisterOpcode opcode, uint32_t value) {
+    const auto index = static_cast<size_t>(opcode);
+    if (index >= VIEW_COUNT) {
+        throw std::out_of_range("Invalid register opcode for set");
+    }
+
+    const RegisterView& view = s_views[index];
+    uint32_t& reg = m_regs[view.slot];
+    reg = (reg & ~(view.mask << view.shift)) | ((value & view.mask) << view.shift);
+}
+
+constexpr uint32_t Registers::written_flags(FlagOp op) {
+    switch (op) {
+        case FlagOp::None:  return 0;
+        case FlagOp::Add:
+        case FlagOp::Sub:
+        case FlagOp::Cmp:   return ARITH_FLAGS;
+        default:            return LOGIC_FLAGS;
+    }
+}
+
+inline uint32_t Registers::compute_flags(FlagOp op, uint32_t a, uint32_t b, uint32_t result) {
+    bool cf = false, pf = false, of = false;
+    const bool zf = result == 0;
+    const bool sf = (result & 0x80000000) != 0;
+    const bool a_sign = (a & 0x80000000) != 0;
+    const bool b_sign = (b & 0x80000000) != 0;
+    const uint8_t low_bits = std::popcount(static_cast<uint8_t>(result & 0xFF));
+
+    switch (op) {
+        case FlagOp::None:
+            return 0;
+        case FlagOp::Add: {
+            uint32_t result64 = static_cast<uint64_t>(a) + static_cast<uint64_t>(b);
+            cf = result64 > 0xFFFFFFFF;
+            of = (a_sign == b_sign) && (sf != a_sign);
+            break;
+        }
+        case FlagOp::Sub:
+            cf = a >= b;
+            of = (a_sign != b_sign) && (sf != a_sign);
+            break;
+        case FlagOp::Cmp:
+            cf = a < b;
+            of = (a_sign != b_sign) && (sf != a_sign);
+            break;
+        case FlagOp::And:
+            pf = (low_bits % 2) == 0;
+            break;
+        case FlagOp::OrXor:
+            pf = (low_bits & 2) == 0;
+            break;
+        case FlagOp::Shl:
+            cf = (static_cast<uint64_t>(a) >> (32 - b)) & 0x1;
+            of = ((result >> 31) ^ (result >> 30)) & 0x1;
+            pf = (low_bits % 2) == 0;
+            break;
+        case FlagOp::Sar:
+            cf = (static_cast<int32_t>(a) >> ((b - 1) & 0x1F)) & 0x1;
+            pf = (low_bits % 2) == 0;
+            break;
+        case FlagOp::Shr:
+            cf = (a >> ((b - 1) & 0x1F)) & 0x1;
+            of = a_sign;
+            pf = (low_bits % 2) == 0;
+            break;
+    }
+
+    uint32_t flags = (cf ? flag_mask(Flag::Carry) : 0) | (pf ? flag_mask(Flag::Parity) : 0) |
+                     (zf ? flag_mask(Flag::Zero) : 0) | (sf ? flag_mask(Flag::Sign) : 0) |
+                     (of ? flag_mask(Flag::Overflow) : 0);
+    return flags & written_flags(op);
+}
+
+inline uint32_t Registers::get_eflags() const {
+    if (m_lazy.op == FlagOp::None) {
+        return m_eflags;
+    }
+
+    return (m_eflags & ~written_flags(m_lazy.op)) |
+           compute_flags(m_lazy.op, m_lazy.a, m_lazy.b, m_lazy.result);
+}
+
+inline bool Registers::get_flag(Flag f) const {
+    return (get_eflags() & flag_mask(f)) != 0;
+}
+
+inline void Registers::update_flags(FlagOp op, uint32_t a, uint32_t b, uint32_t result) {
+    if (m_flag_mode == FlagMode::Eager) {
+        set_flags_eagerly(op, a, b, result);
+        return;
+    }
+
+    // The pending op must be folded in if `op` leaves some of its flags untouched.
+    if (written_flags(m_lazy.op) & ~written_flags(op)) {
+        materialize_flags();
+    }
+
+    m_lazy = { op, a, b, result };
+}
@@ -2,87 +2,452 @@
 #include "Interrupt.h"
 #include <iostream>
 
-VM::VM() {
-    m_dispatch[InstructionOpcode::MOV] = [this](const std::vector<InstructionArg>& operands){ exec_MOV(operands); };
-    m_dispatch[InstructionOpcode::ADD] = [this](const std::vector<InstructionArg>& operands){ exec_ADD(operands); };
-    m_dispatch[InstructionOpcode::SUB] = [this](const std::vector<InstructionArg>& operands){ exec_SUB(operands); };
-    m_dispatch[InstructionOpcode::MUL] = [this](const std::vector<InstructionArg>& operands){ exec_MUL(operands); };
-    m_dispatch[InstructionOpcode::DIV] = [this](const std::vector<InstructionArg>& operands){ exec_DIV(operands); };
-    m_dispatch[InstructionOpcode::AND] = [this](const std::vector<InstructionArg>& operands){ exec_AND(operands); };
-    m_dispatch[InstructionOpcode::OR] = [this](const std::vector<InstructionArg>& operands){ exec_OR(operands); };
-    m_dispatch[InstructionOpcode::XOR] = [this](const std::vector<InstructionArg>& operands){ exec_XOR(operands); };
-    m_dispatch[InstructionOpcode::NOT] = [this](const std::vector<InstructionArg>& operands){ exec_NOT(operands); };
-    m_dispatch[InstructionOpcode::PUSH] = [this](const std::vector<InstructionArg>& operands){ exec_PUSH(operands); };
-    m_dispatch[InstructionOpcode::POP] = [this](const std::vector<InstructionArg>& operands){ exec_POP(operands); };
-    m_dispatch[InstructionOpcode::JMP] = [this](const std::vector<InstructionArg>& operands){ exec_JMP(operands); };
-    m_dispatch[InstructionOpcode::CMP] = [this](const std::vector<InstructionArg>& operands){ exec_CMP(operands); };
-    m_dispatch[InstructionOpcode::JE] = [this](const std::vector<InstructionArg>& operands){ exec_JE(operands); };
-    m_dispatch[InstructionOpcode::JNE] = [this](const std::vector<InstructionArg>& operands){ exec_JNE(operands); };
-    m_dispatch[InstructionOpcode::JZ] = [this](const std::vector<InstructionArg>& operands){ exec_JZ(operands); };
-    m_dispatch[InstructionOpcode::JNZ] = [this](const std::vector<InstructionArg>& operands){ exec_JNZ(operands); };
-    m_dispatch[InstructionOpcode::JA] = [this](const std::vector<InstructionArg>& operands){ exec_JA(operands); };
-    m_dispatch[InstructionOpcode::JNBE] = [this](const std::vector<InstructionArg>& operands){ exec_JNBE(operands); };
-    m_dispatch[InstructionOpcode::JAE] = [this](const std::vector<InstructionArg>& operands){ exec_JAE(operands); };
-    m_dispatch[InstructionOpcode::JNB] = [this](const std::vector<InstructionArg>& operands){ exec_JNB(operands); };
-    m_dispatch[InstructionOpcode::JB] = [this](const std::vector<InstructionArg>& operands){ exec_JB(operands); };
-    m_dispatch[InstructionOpcode::JNAE] = [this](const std::vector<InstructionArg>& operands){ exec_JNAE(operands); };
-    m_dispatch[InstructionOpcode::JBE] = [this](const std::vector<InstructionArg>& operands){ exec_JBE(operands); };
-    m_dispatch[InstructionOpcode::JNA] = [this](const std::vector<InstructionArg>& operands){ exec_JNA(operands); };
-    m_dispatch[InstructionOpcode::JG] = [this](const std::vector<InstructionArg>& operands){ exec_JG(operands); };
-    m_dispatch[InstructionOpcode::JNLE] = [this](const std::vector<InstructionArg>& operands){ exec_JNLE(operands); };
-    m_dispatch[InstructionOpcode::JGE] = [this](const std::vector<InstructionArg>& operands){ exec_JGE(operands); };
-    m_dispatch[InstructionOpcode::JNL] = [this](const std::vector<InstructionArg>& operands){ exec_JNL(operands); };
-    m_dispatch[InstructionOpcode::JL] = [this](const std::vector<InstructionArg>& operands){ exec_JL(operands); };
-    m_dispatch[InstructionOpcode::JNGE] = [this](const std::vector<InstructionArg>& operands){ exec_JNGE(operands); };
-    m_dispatch[InstructionOpcode::JLE] = [this](const std::vector<InstructionArg>& operands){ exec_JLE(operands); };
-    m_dispatch[InstructionOpcode::JC] = [this](const std::vector<InstructionArg>& operands){ exec_JC(operands); };
-    m_dispatch[InstructionOpcode::JNC] = [this](const std::vector<InstructionArg>& operands){ exec_JNC(operands); };
-    m_dispatch[InstructionOpcode::JO] = [this](const std::vector<InstructionArg>& operands){ exec_JO(operands); };
-    m_dispatch[InstructionOpcode::JNO] = [this](const std::vector<InstructionArg>& operands){ exec_JNO(operands); };
-    m_dispatch[InstructionOpcode::JS] = [this](const std::vector<InstructionArg>& operands){ exec_JS(operands); };
-    m_dispatch[InstructionOpcode::JNS] = [this](const std::vector<InstructionArg>& operands){ exec_JNS(operands); };
-    m_dispatch[InstructionOpcode::JP] = [this](const std::vector<InstructionArg>& operands){ exec_JP(operands); };
-    m_dispatch[InstructionOpcode::JPE] = [this](const std::vector<InstructionArg>& operands){ exec_JPE(operands); };
-    m_dispatch[InstructionOpcode::JNP] = [this](const std::vector<InstructionArg>& operands){ exec_JNP(operands); };
-    m_dispatch[InstructionOpcode::JPO] = [this](const std::vector<InstructionArg>& operands){ exec_JPO(operands); };
-    m_dispatch[InstructionOpcode::INC] = [this](const std::vector<InstructionArg>& operands){ exec_INC(operands); };
-    m_dispatch[InstructionOpcode::DEC] = [this](const std::vector<InstructionArg>& operands){ exec_DEC(operands); };
-    m_dispatch[InstructionOpcode::SAL] = [this](const std::vector<InstructionArg>& operands){ exec_SAL(operands); };
-    m_dispatch[InstructionOpcode::SAR] = [this](const std::vector<InstructionArg>& operands){ exec_SAR(operands); };
-    m_dispatch[InstructionOpcode::SHL] = [this](const std::vector<InstructionArg>& operands){ exec_SHL(operands); };
-    m_dispatch[InstructionOpcode::SHR] = [this](const std::vector<InstructionArg>& operands){ exec_SHR(operands); };
-    m_dispatch[InstructionOpcode::INT] = [this](const std::vector<InstructionArg>& operands){ exec_INT(operands); };
-    m_dispatch[InstructionOpcode::NOP] = [this](const std::vector<InstructionArg>&){ exec_NOP(); };
-};  
+constexpr std::array<VM::OpcodeEntry, VM::DISPATCH_SIZE> VM::make_dispatch_table() {
+    std::array<OpcodeEntry, DISPATCH_SIZE> table {};
+    for (auto& entry : table) {
+        entry = { &VM::exec_INVALID, false };
+    }
+
+    auto set = [&](InstructionOpcode op, Handler handler) {
+        table[static_cast<size_t>(op)] = { handler, transfers_control(op) };
+    };
+
+    set(InstructionOpcode::MOV, &VM::exec_MOV);
+    set(InstructionOpcode::ADD, &VM::exec_ADD);
+    set(InstructionOpcode::SUB, &VM::exec_SUB);
+    set(InstructionOpcode::MUL, &VM::exec_MUL);
+    set(InstructionOpcode::DIV, &VM::exec_DIV);
+    set(InstructionOpcode::AND, &VM::exec_AND);
+    set(InstructionOpcode::OR, &VM::exec_OR);
+    set(InstructionOpcode::XOR, &VM::exec_XOR);
+    set(InstructionOpcode::NOT, &VM::exec_NOT);
+    set(InstructionOpcode::PUSH, &VM::exec_PUSH);
+    set(InstructionOpcode::POP, &VM::exec_POP);
+    set(InstructionOpcode::JMP, &VM::exec_JMP);
+    set(InstructionOpcode::CMP, &VM::exec_CMP);
+    set(InstructionOpcode::JE, &VM::exec_JE);
+    set(InstructionOpcode::JNE, &VM::exec_JNE);
+    set(InstructionOpcode::JZ, &VM::exec_JZ);
+    set(InstructionOpcode::JNZ, &VM::exec_JNZ);
+    set(InstructionOpcode::JA, &VM::exec_JA);
+    set(InstructionOpcode::JNBE, &VM::exec_JNBE);
+    set(InstructionOpcode::JAE, &VM::exec_JAE);
+    set(InstructionOpcode::JNB, &VM::exec_JNB);
+    set(InstructionOpcode::JB, &VM::exec_JB);
+    set(InstructionOpcode::JNAE, &VM::exec_JNAE);
+    set(InstructionOpcode::JBE, &VM::exec_JBE);
+    set(InstructionOpcode::JNA, &VM::exec_JNA);
+    set(InstructionOpcode::JG, &VM::exec_JG);
+    set(InstructionOpcode::JNLE, &VM::exec_JNLE);
+    set(InstructionOpcode::JGE, &VM::exec_JGE);
+    set(InstructionOpcode::JNL, &VM::exec_JNL);
+    set(InstructionOpcode::JL, &VM::exec_JL);
+    set(InstructionOpcode::JNGE, &VM::exec_JNGE);
+    set(InstructionOpcode::JLE, &VM::exec_JLE);
+    set(InstructionOpcode::JNG, &VM::exec_JNG);
+    set(InstructionOpcode::JC, &VM::exec_JC);
+    set(InstructionOpcode::JNC, &VM::exec_JNC);
+    set(InstructionOpcode::JO, &VM::exec_JO);
+    set(InstructionOpcode::JNO, &VM::exec_JNO);
+    set(InstructionOpcode::JS, &VM::exec_JS);
+    set(InstructionOpcode::JNS, &VM::exec_JNS);
+    set(InstructionOpcode::JP, &VM::exec_JP);
+    set(InstructionOpcode::JPE, &VM::exec_JPE);
+    set(InstructionOpcode::JNP, &VM::exec_JNP);
+    set(InstructionOpcode::JPO, &VM::exec_JPO);
+    set(InstructionOpcode::INC, &VM::exec_INC);
+    set(InstructionOpcode::DEC, &VM::exec_DEC);
+    set(InstructionOpcode::SAL, &VM::exec_SAL);
+    set(InstructionOpcode::SAR, &VM::exec_SAR);
+    set(InstructionOpcode::SHL, &VM::exec_SHL);
+    set(InstructionOpcode::SHR, &VM::exec_SHR);
+    set(InstructionOpcode::INT, &VM::exec_INT);
+    set(InstructionOpcode::CALL, &VM::exec_CALL);
+    set(InstructionOpcode::RET, &VM::exec_RET);
+    set(InstructionOpcode::ENTER, &VM::exec_ENTER);
+    set(InstructionOpcode::LEAVE, &VM::exec_LEAVE);
+    set(InstructionOpcode::MOVSB, &VM::exec_MOVS);
+    set(InstructionOpcode::MOVSW, &VM::exec_MOVS);
+    set(InstructionOpcode::MOVSD, &VM::exec_MOVS);
+    set(InstructionOpcode::STOSB, &VM::exec_STOS);
+    set(InstructionOpcode::STOSW, &VM::exec_STOS);
+    set(InstructionOpcode::STOSD, &VM::exec_STOS);
+    set(InstructionOpcode::LODSB, &VM::exec_LODS);
+    set(InstructionOpcode::LODSW, &VM::exec_LODS);
+    set(InstructionOpcode::LODSD, &VM::exec_LODS);
+    set(InstructionOpcode::SCASB, &VM::exec_SCAS);
+    set(InstructionOpcode::SCASW, &VM::exec_SCAS);
+    set(InstructionOpcode::SCASD, &VM::exec_SCAS);
+    set(InstructionOpcode::CMPSB, &VM::exec_CMPS);
+    set(InstructionOpcode::CMPSW, &VM::exec_CMPS);
+    set(InstructionOpcode::CMPSD, &VM::exec_CMPS);
+    set(InstructionOpcode::CLD, &VM::exec_CLD);
+    set(InstructionOpcode::STD, &VM::exec_STD);
+    set(InstructionOpcode::IRET, &VM::exec_IRET);
+    set(InstructionOpcode::HLT, &VM::exec_HLT);
+    set(InstructionOpcode::NOP, &VM::exec_NOP);
+    set(InstructionOpcode::CMP_JCC, &VM::exec_CMP_JCC);
+    set(InstructionOpcode::DEC_JNZ, &VM::exec_DEC_JNZ);
+    set(InstructionOpcode::MOV_ADD, &VM::exec_MOV_ADD);
+
+    return table;
+}
+
+constexpr std::array<VM::OpcodeEntry, VM::DISPATCH_SIZE> VM::s_dispatch = VM::make_dispatch_table();
+
+static bool sign_bit(uint32_t value) {
+    return (value & 0x80000000) != 0;
+}
+
+// OF of CMP a, b.
+static bool compare_overflows(uint32_t a, uint32_t b) {
+    return sign_bit(a) != sign_bit(b) && sign_bit(a - b) != sign_bit(a);
+}
+
+// The Jcc conditions on CMP's flags, stated on the operands: CF is a < b, ZF
+// is a == b, and SF != OF is a < b as signed values.
+const std::array<VM::Compare, VM::DISPATCH_SIZE> VM::s_compare = [] {
+    using C = CompareCondition;
+
+    std::array<Compare, DISPATCH_SIZE> table {};
+    table.fill([](uint32_t, uint32_t, const Registers&) -> bool {
+        throw std::invalid_argument("Not a conditional jump");
+    });
+    auto set = [&](C condition, Compare compare) { table[static_cast<size_t>(condition)] = compare; };
+
+    set(C::Equal,          [](uint32_t a, uint32_t b, const Registers&) { return a == b; });
+    set(C::NotEqual,       [](uint32_t a, uint32_t b, const Registers&) { return a != b; });
+    set(C::Above,          [](uint32_t a, uint32_t b, const Registers&) { return a > b; });
+    set(C::AboveOrEqual,   [](uint32_t a, uint32_t b, const Registers&) { return a >= b; });
+    set(C::Below,          [](uint32_t a, uint32_t b, const Registers&) { return a < b; });
+    set(C::BelowOrEqual,   [](uint32_t a, uint32_t b, const Registers&) { return a <= b; });
+    set(C::Greater,        [](uint32_t a, uint32_t b, const Registers&) {
+        return static_cast<int32_t>(a) > static_cast<int32_t>(b);
+    });
+    set(C::GreaterOrEqual, [](uint32_t a, uint32_t b, const Registers&) {
+        return static_cast<int32_t>(a) >= static_cast<int32_t>(b);
+    });
+    set(C::Less,           [](uint32_t a, uint32_t b, const Registers&) {
+        return static_cast<int32_t>(a) < static_cast<int32_t>(b);
+    });
+    set(C::LessOrEqual,    [](uint32_t a, uint32_t b, const Registers&) {
+        return static_cast<int32_t>(a) <= static_cast<int32_t>(b);
+    });
+    set(C::Overflow,       [](uint32_t a, uint32_t b, const Registers&) { return compare_overflows(a, b); });
+    set(C::NoOverflow,     [](uint32_t a, uint32_t b, const Registers&) { return !compare_overflows(a, b); });
+    set(C::Sign,           [](uint32_t a, uint32_t b, const Registers&) { return sign_bit(a - b); });
+    set(C::NoSign,         [](uint32_t a, uint32_t b, const Registers&) { return !sign_bit(a - b); });
+    set(C::Parity,         [](uint32_t, uint32_t, const Registers& regs) { return regs.get_flag(Flag::Parity); });
+    set(C::NoParity,       [](uint32_t, uint32_t, const Registers& regs) { return !regs.get_flag(Flag::Parity); });
+    return table;
+}();
+
+VM::VM()
+    : m_stack_top(static_cast<uint32_t>(std::min<uint64_t>(m_memory.size(), UINT32_MAX & ~3u))),
+      m_stack_limit(m_stack_top - STACK_SIZE),
+      m_heap(m_stack_limit - (BuddyAllocator::PARAGRAPH << HEAP_ORDER), HEAP_ORDER) {
+    m_memory.reserve(m_stack_limit, STACK_SIZE);
+    m_vectors.fill(NO_VECTOR);
+    m_registers.set(RegisterOpcode::ESP, m_stack_top);
+}
+
+DecodedInstruction VM::decode(const Instruction& instr) {
+    DecodedInstruction decoded {};
+    decoded.opcode = instr.opcode;
+    decoded.argc = static_cast<uint8_t>(instr.operands.size());
+
+    size_t count = std::min(instr.operands.size(), DecodedInstruction::MAX_OPERANDS);
+    for (size_t i = 0; i < count; ++i) {
+        std::visit([&](auto&& v) {
+            using T = std::decay_t<decltype(v)>;
+            if constexpr (std::is_same_v<T, RegisterOpcode>) {
+                decoded.kinds[i] = OperandKind::Register;
+                decoded.values[i] = static_cast<uint32_t>(v);
+            } else if constexpr (std::is_same_v<T, int>) {
+                decoded.kinds[i] = OperandKind::Immediate;
+                decoded.values[i] = static_cast<uint32_t>(v);
+            } else {
+                decoded.kinds[i] = OperandKind::Float;
+            }
+        }, instr.operands[i]);
+    }
+
+    bind_branch_target(decoded);
+    return decoded;
+}
 
 void VM::execute(const Instruction& instr) {
+    execute(decode(instr));
+}
+
+void VM::execute(const DecodedInstruction& instr) {
+    if (m_image) {
+        // Appending to a mapped image: fall back to an owned copy.
+        m_program.assign(m_code.begin(), m_code.end());
+        m_image.reset();
+    }
+    if (m_jit) {
+        m_jit->discard_tail(static_cast<uint32_t>(m_program.size()));
+    }
     m_program.push_back(instr);
+    m_code = m_program;
+    m_blocks.extend(m_code);
+
+    process_instructions();
+}
+
+void VM::load(std::vector<DecodedInstruction> program) {
+    m_program = std::move(program);
+    m_code = m_program;
+    m_image.reset();
+    m_blocks.reset();
+    if (m_jit) {
+        m_jit->reset();
+    }
+    rewind();
+}
 
+// Loading the image that is already loaded keeps its blocks and JIT code.
+void VM::load(std::shared_ptr<const ProgramImage> image) {
+    if (image != m_image) {
+        m_program.clear();
+        m_code = image->code();
+        m_image = std::move(image);
+        m_blocks.reset();
+        if (m_jit) {
+            m_jit->reset();
+        }
+    }
+    rewind();
+}
+
+void VM::rewind() {
+    m_pc = 0;
+    m_return_depth = 0;
+    m_current_block = BlockCache::NO_BLOCK;
+    m_return_block = BlockCache::NO_BLOCK;
+    m_parked = false;
+    m_halted = false;
+    m_heap.reset();
+}
+
+void VM::reset() {
+    rewind();
+    m_registers.reset();
+    m_registers.set(RegisterOpcode::ESP, m_stack_top);
+    m_memory.zero();
+    m_vectors.fill(NO_VECTOR);
+    m_exit_code = 0;
+    m_executed = 0;
+    m_fused_executed = 0;
+    m_returns_predicted = 0;
+    m_returns_mispredicted = 0;
+}
+
+VM::Snapshot VM::snapshot() {
+    if (m_parked) {
+        throw std::runtime_error("Cannot snapshot a VM while an interrupt service has it parked");
+    }
+    if (!m_image) {
+        Assembler::Program program;
+        program.code = std::move(m_program);
+        m_program.clear();
+        m_image = ProgramImage::from_program(program);
+        m_code = m_image->code();
+        m_blocks.reset();
+        if (m_jit) {
+            m_jit->reset();
+        }
+        m_return_depth = 0;
+        m_current_block = BlockCache::NO_BLOCK;
+        m_return_block = BlockCache::NO_BLOCK;
+    }
+
+    Snapshot snap(m_registers, m_pc, m_memory.snapshot(), m_heap);
+    snap.m_vectors = m_vectors;
+    snap.m_image = m_image;
+    snap.m_halted = m_halted;
+    snap.m_exit_code = m_exit_code;
+    return snap;
+}
+
+void VM::restore(const Snapshot& snapshot) {
+    m_memory.restore(snapshot.m_memory);
+    load(snapshot.m_image);
+    m_registers = snapshot.m_registers;
+    m_pc = snapshot.m_pc;
+    m_heap = snapshot.m_heap;
+    m_vectors = snapshot.m_vectors;
+    m_halted = snapshot.m_halted;
+    m_exit_code = snapshot.m_exit_code;
+}
+
+void VM::run() {
     process_instructions();
 }
 
+RunStatus VM::run(uint64_t budget) {
+    return process_instructions(budget);
+}
+
 void VM::set_interrupt_manager(InterruptManager* intr) {
     m_interrupt_manager = intr;
 }
 
-void VM::process_instructions() {
-    while (m_pc < m_program.size()) {
-        const Instruction& instr = m_program[m_pc];
+void VM::set_jit_mode(JitMode mode) {
+    m_jit_mode = mode;
+    if (mode == JitMode::Off) {
+        m_jit.reset();
+    } else {
+        // Verification compiles every block it enters so all of them get checked.
+        m_jit = std::make_unique<Jit>(mode == JitMode::Verify ? 1 : Jit::DEFAULT_THRESHOLD);
+    }
+}
 
-        auto it = m_dispatch.find(instr.opcode);
-        if (it == m_dispatch.end()) {
-            throw std::invalid_argument("Unknown opcode!");
+RunStatus VM::process_instructions(uint64_t budget) {
+    if (m_halted || m_parked) {
+        return stop_status();
+    }
+    m_stop = budget > UINT64_MAX - m_executed ? UINT64_MAX : m_executed + budget;
+    if (m_profiler) {
+        m_profiler->prepare(m_code.size());
+        return interpret<true>();
+    }
+    if (m_jit && m_registers.get_flag_mode() == FlagMode::Lazy) {
+        return process_instructions_jit();
+    }
+    return interpret<false>();
+}
+
+template<bool Profile>
+RunStatus VM::interpret() {
+    // Block at a time: only the last instruction of a block can move the pc
+    // anywhere but forward, so the body needs no bounds or control-flow checks.
+    uint32_t id = m_blocks.lookup(m_pc, m_code);
+    while (id != BlockCache::NO_BLOCK) {
+        if (m_executed >= m_stop) [[unlikely]] {
+            m_current_block = BlockCache::NO_BLOCK;
+            return stop_status();
+        }
+        m_current_block = id;
+        const BlockCache::Block& block = m_blocks[id];
+        const uint32_t last = block.end - 1;
+
+        for (m_pc = block.start; m_pc < last; ++m_pc) {
+            const DecodedInstruction& instr = m_code[m_pc];
+            if constexpr (Profile) {
+                m_profiler->count(m_pc);
+            }
+            (this->*s_dispatch[static_cast<size_t>(instr.opcode)].handler)(instr);
+#if DEBUG
+            std::cerr << Debugger::info_about_registers(m_registers) << std::endl;
+            std::cerr << Debugger::info_about_flags(m_registers) << std::endl;
+#endif
         }
 
-        it->second(instr.operands);
+        const DecodedInstruction& instr = m_code[last];
+        const OpcodeEntry& entry = s_dispatch[static_cast<size_t>(instr.opcode)];
+        if constexpr (Profile) {
+            m_profiler->count(last);
+        }
 
-        if (!ParseUtils::jump_opcodes.contains(instr.opcode)) {
+        (this->*entry.handler)(instr);
+
+        if (!entry.is_jump) {
             step(1);
-#if DEBUG           
+#if DEBUG
             std::cerr << Debugger::info_about_registers(m_registers) << std::endl;
-	    std::cerr << Debugger::info_about_flags(m_registers) << std::endl;
+            std::cerr << Debugger::info_about_flags(m_registers) << std::endl;
 #endif
+        } else if constexpr (Profile) {
+            if (m_pc != block.next_pc) {
+                m_profiler->taken(last);
+            }
+        }
+
+        // A fused terminator also covers the record after the block.
+        m_executed += block.next_pc - block.start;
+
+        if (m_return_block != BlockCache::NO_BLOCK) [[unlikely]] {
+            // Predicted RET: m_pc is the fall-through of the calling block.
+            id = m_return_block;
+            m_return_block = BlockCache::NO_BLOCK;
         }
+        id = m_blocks.next(id, m_pc, m_code);
+    }
+    m_current_block = BlockCache::NO_BLOCK;
+    return m_halted || m_parked ? stop_status() : RunStatus::Finished;
+}
+
+// Interprets until a block entry is reached (a jump target, or the instruction
+// after one the JIT leaves to the interpreter), then runs compiled code for
+// that block if it is hot.
+RunStatus VM::process_instructions_jit() {
+    bool at_entry = true;
+
+    while (m_pc < m_code.size()) {
+        if (m_executed >= m_stop) [[unlikely]] {
+            return stop_status();
+        }
+        if (at_entry) {
+            if (const Jit::Block* block = m_jit->enter(m_pc, m_code)) {
+                run_block(*block);
+                m_executed += block->length;
+                continue;
+            }
+        }
+
+        const DecodedInstruction& instr = m_code[m_pc];
+        const OpcodeEntry& entry = s_dispatch[static_cast<size_t>(instr.opcode)];
+
+        (this->*entry.handler)(instr);
+
+        if (!entry.is_jump) {
+            step(1);
+        }
+        m_executed += is_fused_opcode(instr.opcode) ? 2 : 1;
+        at_entry = entry.is_jump || !Jit::is_supported(instr);
+    }
+    return m_halted || m_parked ? stop_status() : RunStatus::Finished;
+}
+
+void VM::run_block(const Jit::Block& block) {
+    if (m_jit_mode == JitMode::Verify) {
+        verify_block(block);
+    } else {
+        m_pc = block.fn(&m_registers);
+    }
+}
+
+// Runs the block natively, then again in the interpreter from the same state,
+// and fails on any difference in the next pc, registers or flags.
+void VM::verify_block(const Jit::Block& block) {
+    const uint32_t start = m_pc;
+    const Registers before = m_registers;
+
+    const uint32_t jit_pc = block.fn(&m_registers);
+    const Registers jit_state = m_registers;
+
+    m_registers = before;
+    for (uint32_t i = 0; i < block.length; ++i) {
+        // One record at a time: fused pairs may straddle the block boundary.
+        DecodedInstruction instr = m_code[m_pc];
+        instr.opcode = base_opcode(instr.opcode);
+        const OpcodeEntry& entry = s_dispatch[static_cast<size_t>(instr.opcode)];
+
+        (this->*entry.handler)(instr);
+        if (!entry.is_jump) {
+            step(1);
+        }
+    }
+
+    if (m_pc != jit_pc || !(m_registers == jit_state)) {
+        throw std::runtime_error("JIT mismatch in block at " + std::to_string(start) +
+            ": interpreter pc " + std::to_string(m_pc) + ", JIT pc " + std::to_string(jit_pc) + "\n" +
+            "interpreter: " + Debugger::info_about_registers(m_registers) + " " +
+            Debugger::info_about_flags(m_registers) + "\n" +
+            "JIT:         " + Debugger::info_about_registers(jit_state) + " " +
+            Debugger::info_about_flags(jit_state));
     }
 }
 
@@ -91,100 +456,178 @@ void VM::step(int step) {
 }
 
 template<typename F>
-uint32_t VM::get_value(const InstructionArg& arg, F&& err) {
-    return std::visit([&](auto&& v) -> uint32_t {
-           using T = std::decay_t<decltype(v)>;
-           if constexpr (std::is_same_v<T, RegisterOpcode>) return m_registers.get(v);
-           else if constexpr (std::is_same_v<T, int>) return static_cast<uint32_t>(v);
-           else { err("Unsupported operand type"); __builtin_unreachable(); }
-    }, arg);
+uint32_t VM::get_value(const DecodedInstruction& instr, size_t index, F&& err) {
+    switch (instr.kinds[index]) {
+        case OperandKind::Register:  return m_registers.get(instr.reg(index));
+        case OperandKind::Immediate:
+        case OperandKind::Target:    return instr.values[index];
+        case OperandKind::Mem8:
+        case OperandKind::Mem16:
+        case OperandKind::Mem32:
+            return m_memory.load(effective_address(instr, index), memory_operand_width(instr.kinds[index]));
+        default: err("Unsupported operand type"); __builtin_unreachable();
+    }
 }
 
-void VM::exec_MOV(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
-        throw std::invalid_argument("MOV requires 2 operands");
+uint32_t VM::effective_address(const DecodedInstruction& instr, size_t index) const {
+    uint32_t address = instr.values[index];
+    if (instr.mem_base != DecodedInstruction::NO_BASE) {
+        address += m_registers.get(static_cast<RegisterOpcode>(instr.mem_base));
+    }
+    return address;
+}
+
+// The stack holds dwords in [m_stack_limit, m_stack_top), addressed by ESP.
+void VM::push(uint32_t value) {
+    const uint32_t esp = m_registers.get(RegisterOpcode::ESP);
+    if (esp > m_stack_top || esp < m_stack_limit + 4) [[unlikely]] {
+        throw std::runtime_error(esp > m_stack_top || esp < m_stack_limit ? "ESP is outside the stack" : "Stack overflow");
+    }
+
+    m_memory.store32(esp - 4, value);
+    m_registers.set(RegisterOpcode::ESP, esp - 4);
+}
+
+void VM::check_pop(uint32_t esp) const {
+    if (esp < m_stack_limit || esp > m_stack_top - 4) [[unlikely]] {
+        throw std::runtime_error(esp < m_stack_limit ? "ESP is outside the stack" : "Stack underflow");
+    }
+}
+
+uint32_t VM::pop() {
+    const uint32_t esp = m_registers.get(RegisterOpcode::ESP);
+    check_pop(esp);
+
+    m_registers.set(RegisterOpcode::ESP, esp + 4);
+    return m_memory.load32(esp);
+}
+
+uint32_t VM::branch_target(const DecodedInstruction& instr, const char* name) {
+    if (instr.kinds[0] == OperandKind::Target) [[likely]] {
+        return instr.values[0];
+    }
+
+    if (instr.argc != 1) {
+        throw std::invalid_argument(std::string{name} + " requires 1 operand");
+    }
+
+    return get_value(instr, 0,
+        [&](auto why){ Debugger::throw_arg_error(std::string{name} + ": " + why); });
+}
+
+uint32_t VM::source_value(const DecodedInstruction& instr, size_t index) const {
+    return instr.kinds[index] == OperandKind::Register ? m_registers.get(instr.reg(index)) : instr.values[index];
+}
+
+const DecodedInstruction& VM::fused_second() const {
+    if (m_pc + 1 >= m_code.size()) [[unlikely]] {
+        throw std::runtime_error("Fused instruction is missing its second half");
     }
+    return m_code[m_pc + 1];
+}
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
-        throw std::invalid_argument("MOV first operand must be a register");
+// Same conditions as the exec_Jcc handlers, evaluated on a flags word.
+bool VM::branch_taken(InstructionOpcode jcc, uint32_t eflags) {
+    auto flag = [eflags](Flag f) { return (eflags >> static_cast<uint8_t>(f)) & 1u; };
+
+    switch (jcc) {
+        case InstructionOpcode::JE:   case InstructionOpcode::JZ:   return flag(Flag::Zero);
+        case InstructionOpcode::JNE:  case InstructionOpcode::JNZ:  return !flag(Flag::Zero);
+        case InstructionOpcode::JA:   case InstructionOpcode::JNBE: return !flag(Flag::Carry) && !flag(Flag::Zero);
+        case InstructionOpcode::JAE:  case InstructionOpcode::JNB:
+        case InstructionOpcode::JNC:                                return !flag(Flag::Carry);
+        case InstructionOpcode::JB:   case InstructionOpcode::JNAE:
+        case InstructionOpcode::JC:                                 return flag(Flag::Carry);
+        case InstructionOpcode::JBE:  case InstructionOpcode::JNA:  return flag(Flag::Carry) || flag(Flag::Zero);
+        case InstructionOpcode::JG:   case InstructionOpcode::JNLE:
+            return !flag(Flag::Zero) && flag(Flag::Sign) == flag(Flag::Overflow);
+        case InstructionOpcode::JGE:  case InstructionOpcode::JNL:  return flag(Flag::Sign) == flag(Flag::Overflow);
+        case InstructionOpcode::JL:   case InstructionOpcode::JNGE: return flag(Flag::Sign) != flag(Flag::Overflow);
+        case InstructionOpcode::JLE:  case InstructionOpcode::JNG:
+            return flag(Flag::Zero) || flag(Flag::Sign) != flag(Flag::Overflow);
+        case InstructionOpcode::JO:                                 return flag(Flag::Overflow);
+        case InstructionOpcode::JNO:                                return !flag(Flag::Overflow);
+        case InstructionOpcode::JS:                                 return flag(Flag::Sign);
+        case InstructionOpcode::JNS:                                return !flag(Flag::Sign);
+        case InstructionOpcode::JP:   case InstructionOpcode::JPE:  return flag(Flag::Parity);
+        case InstructionOpcode::JNP:  case InstructionOpcode::JPO:  return !flag(Flag::Parity);
+        default:
+            throw std::invalid_argument("Not a conditional jump");
     }
+}
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+void VM::exec_MOV(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
+        throw std::invalid_argument("MOV requires 2 operands");
+    }
 
-    uint32_t src = get_value(operands[1], 
+    uint32_t src = get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"MOV: "} + why); });
 
-    m_registers.set(dst, src);
+    if (is_memory_operand(instr.kinds[0])) {
+        m_memory.store(effective_address(instr, 0), src, memory_operand_width(instr.kinds[0]));
+        return;
+    }
+
+    if (instr.kinds[0] != OperandKind::Register) {
+        throw std::invalid_argument("MOV first operand must be a register or memory");
+    }
+
+    m_registers.set(instr.reg(0), src);
 }
 
-void VM::exec_ADD(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_ADD(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("ADD requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("ADD first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     auto dst_value = m_registers.get(dst);
 
-    uint32_t src = get_value(operands[1], 
+    uint32_t src = get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"ADD: "} + why); });
 
     uint32_t result64 = static_cast<uint64_t>(dst_value) + static_cast<uint64_t>(src);
     uint32_t result = static_cast<uint32_t>(result64);
     m_registers.set(dst, result);
 
-    m_registers.set_flag(Flag::Zero, result == 0);
-    m_registers.set_flag(Flag::Sign, (result & 0x80000000) != 0);
-    m_registers.set_flag(Flag::Carry, result64 > 0xFFFFFFFF);
-
-    bool src_sign = (src & 0x80000000) != 0;
-    bool dst_sign = (dst_value & 0x80000000) != 0;
-    bool res_sign = (result & 0x80000000) != 0;
-    bool overflow = (dst_sign == src_sign) && (res_sign != dst_sign);
-    m_registers.set_flag(Flag::Overflow, overflow);
-} 
+    m_registers.update_flags(FlagOp::Add, dst_value, src, result);
+}
 
-void VM::exec_SUB(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_SUB(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("SUB requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("SUB first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     auto dst_value = m_registers.get(dst);
 
-    uint32_t src = get_value(operands[1], 
+    uint32_t src = get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"SUB: "} + why); });
 
     uint32_t result = dst_value - src;
     m_registers.set(dst, result);
 
-    m_registers.set_flag(Flag::Zero, result == 0);
-    m_registers.set_flag(Flag::Sign, (result & 0x80000000) != 0);
-    m_registers.set_flag(Flag::Carry, dst_value >= src);
-
-    bool src_sign = (src & 0x80000000) != 0;
-    bool dst_sign = (dst_value & 0x80000000) != 0;
-    bool res_sign = (result & 0x80000000) != 0;
-    bool overflow = (dst_sign != src_sign) && (res_sign != dst_sign);
-    m_registers.set_flag(Flag::Overflow, overflow);
+    m_registers.update_flags(FlagOp::Sub, dst_value, src, result);
 }
 
-void VM::exec_MUL(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
+void VM::exec_MUL(const DecodedInstruction& instr) {
+    if (instr.argc != 1) {
         throw std::invalid_argument("MUL requires 1 operand");
     }
 
     RegisterOpcode dst = RegisterOpcode::EAX;
     auto dst_value = m_registers.get(dst);
 
-    uint32_t src = get_value(operands[0], 
+    uint32_t src = get_value(instr, 0, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"MUL: "} + why); });
 
     uint64_t result64 = static_cast<uint64_t>(dst_value) * static_cast<uint64_t>(src);
@@ -196,15 +639,15 @@ void VM::exec_MUL(const std::vector<InstructionArg>& operands) {
     m_registers.set_flag(Flag::Overflow, upper_nonzero);
 }
 
-void VM::exec_DIV(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
+void VM::exec_DIV(const DecodedInstruction& instr) {
+    if (instr.argc != 1) {
         throw std::invalid_argument("DIV requires 1 operand");
     }
 
     RegisterOpcode dst = RegisterOpcode::EAX;
     auto dividend = m_registers.get(dst);
 
-    uint32_t divisor = get_value(operands[0], 
+    uint32_t divisor = get_value(instr, 0, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"DIV: "} + why); });
 
     if (divisor == 0) {
@@ -218,696 +661,896 @@ void VM::exec_DIV(const std::vector<InstructionArg>& operands) {
     m_registers.set(RegisterOpcode::EDX, remainder);
 }
 
-void VM::exec_AND(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_AND(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("AND requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("AND first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     auto dst_value = m_registers.get(dst);
 
-    uint32_t src = get_value(operands[1], 
+    uint32_t src = get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"AND: "} + why); });
 
     uint32_t result = dst_value & src;
     m_registers.set(dst, result);
 
-    m_registers.set_flag(Flag::Zero, result == 0);
-    m_registers.set_flag(Flag::Sign, (result & 0x80000000) != 0);
-
-    uint8_t low_byte = result & 0xFF;
-    uint8_t bit_count = std::popcount(low_byte);
-    m_registers.set_flag(Flag::Parity, (bit_count % 2) == 0);
-
-    m_registers.set_flag(Flag::Carry, false);
-    m_registers.set_flag(Flag::Overflow, false);
+    m_registers.update_flags(FlagOp::And, dst_value, src, result);
 }
 
-void VM::exec_OR(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_OR(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("OR requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("OR first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     auto dst_value = m_registers.get(dst);
 
-    uint32_t src = get_value(operands[1], 
+    uint32_t src = get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"OR: "} + why); });
 
     uint32_t result = dst_value | src;
     m_registers.set(dst, result);
 
-    m_registers.set_flag(Flag::Zero, result == 0);
-    m_registers.set_flag(Flag::Sign, (result & 0x80000000) != 0);
-    
-    uint8_t low_byte = result & 0xFF;
-    uint8_t bit_count = std::popcount(low_byte);
-    m_registers.set_flag(Flag::Parity, (bit_count & 2) == 0);
-
-    m_registers.set_flag(Flag::Carry, false);
-    m_registers.set_flag(Flag::Overflow, false);
+    m_registers.update_flags(FlagOp::OrXor, dst_value, src, result);
 }
 
-void VM::exec_XOR(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_XOR(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("XOR requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("XOR first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     auto dst_value = m_registers.get(dst);
 
-    uint32_t src = get_value(operands[1], 
+    uint32_t src = get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"XOR: "} + why); });
 
     uint32_t result = dst_value ^ src;
     m_registers.set(dst, result);
 
-    m_registers.set_flag(Flag::Zero, result == 0);
-    m_registers.set_flag(Flag::Sign, (result & 0x80000000) != 0);
-    
-    uint8_t low_byte = result & 0xFF;
-    uint8_t bit_count = std::popcount(low_byte);
-    m_registers.set_flag(Flag::Parity, (bit_count & 2) == 0);
-
-    m_registers.set_flag(Flag::Carry, false);
-    m_registers.set_flag(Flag::Overflow, false);
+    m_registers.update_flags(FlagOp::OrXor, dst_value, src, result);
 }
 
-void VM::exec_NOT(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
+void VM::exec_NOT(const DecodedInstruction& instr) {
+    if (instr.argc != 1) {
         throw std::invalid_argument("NOT requires 1 operand");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("NOT first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     auto dst_value = m_registers.get(dst);
 
     m_registers.set(dst, ~dst_value);
 }
 
-void VM::exec_PUSH(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
+void VM::exec_PUSH(const DecodedInstruction& instr) {
+    if (instr.argc != 1) {
         throw std::invalid_argument("PUSH requires 1 operand");
     }
 
-    uint32_t src = get_value(operands[0], 
+    uint32_t src = get_value(instr, 0, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"PUSH: "} + why); });
 
-    m_program_stack.push(src);
+    push(src);
 }
 
-void VM::exec_POP(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("PUSH requires 1 operand");
+void VM::exec_POP(const DecodedInstruction& instr) {
+    if (instr.argc != 1) {
+        throw std::invalid_argument("POP requires 1 operand");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("POP first operand must be a register");
     }    
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
-    m_registers.set(dst, m_program_stack.top());
-    m_program_stack.pop();
+    RegisterOpcode dst = instr.reg(0);
+    m_registers.set(dst, pop());
 }
 
-void VM::exec_JMP(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JMP requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JMP: "} + why); });  
+void VM::exec_JMP(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JMP");
 
     m_pc = dst;
 }
 
-void VM::exec_CMP(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_CMP(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("CMP requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("CMP first operand must be a register");
     }  
     
-    RegisterOpcode a = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode a = instr.reg(0);
     auto a_value = m_registers.get(a);
 
-    uint32_t b_value = get_value(operands[1], 
+    uint32_t b_value = get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"CMP: "} + why); });   
 
     uint32_t result = a_value - b_value;
 
-    m_registers.set_flag(Flag::Zero, result == 0);
-    m_registers.set_flag(Flag::Carry, a_value < b_value);
-    m_registers.set_flag(Flag::Sign, (result & 0x80000000) != 0);
-    bool sign_a = (a_value & 0x80000000) != 0;
-    bool sign_b = (b_value & 0x80000000) != 0;
-    bool sign_r = (result & 0x80000000) != 0;
-    m_registers.set_flag(Flag::Overflow, (sign_a != sign_b) && (sign_r != sign_a));
+    m_registers.update_flags(FlagOp::Cmp, a_value, b_value, result);
 }
 
-void VM::exec_JE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JE: "} + why); });
+void VM::exec_JE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JE");
 
     if (m_registers.get_flag(Flag::Zero)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNE: "} + why); });   
+void VM::exec_JNE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNE");
 
     if (!m_registers.get_flag(Flag::Zero)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JZ(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JZ requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JZ: "} + why); }); 
+void VM::exec_JZ(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JZ");
 
     if (m_registers.get_flag(Flag::Zero)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNZ(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNZ requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNZ: "} + why); });    
+void VM::exec_JNZ(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNZ");
 
     if (!m_registers.get_flag(Flag::Zero)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JA(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JA requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JA: "} + why); });    
+void VM::exec_JA(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JA");
 
     if (!m_registers.get_flag(Flag::Carry) && !m_registers.get_flag(Flag::Zero)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNBE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNBE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNBE: "} + why); });    
+void VM::exec_JNBE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNBE");
 
     if (!m_registers.get_flag(Flag::Carry) && !m_registers.get_flag(Flag::Zero)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JAE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JAE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JAE: "} + why); });    
+void VM::exec_JAE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JAE");
 
     if (!m_registers.get_flag(Flag::Carry)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNB(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNB requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNB: "} + why); });    
+void VM::exec_JNB(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNB");
 
     if (!m_registers.get_flag(Flag::Carry)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JB(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JB requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JB: "} + why); });    
+void VM::exec_JB(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JB");
 
     if (m_registers.get_flag(Flag::Carry)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNAE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNAE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNAE: "} + why); });    
+void VM::exec_JNAE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNAE");
 
     if (m_registers.get_flag(Flag::Carry)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JBE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JBE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JBE: "} + why); });    
+void VM::exec_JBE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JBE");
 
     if (m_registers.get_flag(Flag::Carry) || m_registers.get_flag(Flag::Zero)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNA(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNA requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNA: "} + why); });    
+void VM::exec_JNA(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNA");
 
     if (m_registers.get_flag(Flag::Carry) || m_registers.get_flag(Flag::Zero)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JG(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JG requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JG: "} + why); });    
+void VM::exec_JG(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JG");
 
     if (!m_registers.get_flag(Flag::Zero) && 
 	m_registers.get_flag(Flag::Sign) == m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNLE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNLE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNLE: "} + why); });    
+void VM::exec_JNLE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNLE");
 
     if (!m_registers.get_flag(Flag::Zero) && 
 	m_registers.get_flag(Flag::Sign) == m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JGE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JGE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JGE: "} + why); });    
+void VM::exec_JGE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JGE");
 
     if (m_registers.get_flag(Flag::Sign) == m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNL(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNL requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNL: "} + why); });    
+void VM::exec_JNL(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNL");
 
     if (m_registers.get_flag(Flag::Sign) == m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JL(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JL requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JL: "} + why); });    
+void VM::exec_JL(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JL");
 
     if (m_registers.get_flag(Flag::Sign) != m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNGE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNGE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNGE: "} + why); });    
+void VM::exec_JNGE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNGE");
 
     if (m_registers.get_flag(Flag::Sign) != m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JLE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JLE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JLE: "} + why); });    
+void VM::exec_JLE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JLE");
 
-    if (m_registers.get_flag(Flag::Zero) && 
+    if (m_registers.get_flag(Flag::Zero) || 
 	m_registers.get_flag(Flag::Sign) != m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNG(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNG requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNG: "} + why); });    
+void VM::exec_JNG(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNG");
 
-    if (m_registers.get_flag(Flag::Zero) && 
+    if (m_registers.get_flag(Flag::Zero) || 
 	m_registers.get_flag(Flag::Sign) != m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JC(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JC requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JC: "} + why); });    
+void VM::exec_JC(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JC");
 
     if (m_registers.get_flag(Flag::Carry)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNC(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNC requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNC: "} + why); });    
+void VM::exec_JNC(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNC");
 
     if (!m_registers.get_flag(Flag::Carry)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JO(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JO requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JO: "} + why); });    
+void VM::exec_JO(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JO");
 
     if (m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNO(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNO requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNO: "} + why); });    
+void VM::exec_JNO(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNO");
 
     if (!m_registers.get_flag(Flag::Overflow)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JS(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JS requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JS: "} + why); });    
+void VM::exec_JS(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JS");
 
     if (m_registers.get_flag(Flag::Sign)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNS(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNS requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNS: "} + why); });    
+void VM::exec_JNS(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNS");
 
     if (!m_registers.get_flag(Flag::Sign)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JP(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JP requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JP: "} + why); });    
+void VM::exec_JP(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JP");
 
     if (m_registers.get_flag(Flag::Parity)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JPE(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JPE requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JPE: "} + why); });    
+void VM::exec_JPE(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JPE");
 
     if (m_registers.get_flag(Flag::Parity)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JNP(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JNP requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JNP: "} + why); });    
+void VM::exec_JNP(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JNP");
 
     if (!m_registers.get_flag(Flag::Parity)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_JPO(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
-        throw std::invalid_argument("JPO requires 1 operand");
-    }
-
-    uint32_t dst = get_value(operands[0], 
-        [&](auto why){ Debugger::throw_arg_error(std::string{"JPO: "} + why); });    
+void VM::exec_JPO(const DecodedInstruction& instr) {
+    uint32_t dst = branch_target(instr, "JPO");
 
     if (!m_registers.get_flag(Flag::Parity)) m_pc = dst;
+    else step(1);
 }
 
-void VM::exec_INC(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
+void VM::exec_INC(const DecodedInstruction& instr) {
+    if (instr.argc != 1) {
         throw std::invalid_argument("INC requires 1 operand");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("INC first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     auto dst_value = m_registers.get(dst);
 
     m_registers.set(dst, ++dst_value);
 }
 
-void VM::exec_DEC(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
+void VM::exec_DEC(const DecodedInstruction& instr) {
+    if (instr.argc != 1) {
         throw std::invalid_argument("DEC requires 1 operand");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("DEC first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     auto dst_value = m_registers.get(dst);
 
     m_registers.set(dst, --dst_value);
 }
 
-void VM::exec_SAL(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_SAL(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("SAL requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("SAL first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     int32_t dst_value = static_cast<int32_t>(m_registers.get(dst));
 
-    int32_t shift = static_cast<int32_t>(get_value(operands[1], 
+    int32_t shift = static_cast<int32_t>(get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"SAL: "} + why); }));
  
     if (shift == 0) return;
 
     shift = shift & 0x1F;
 
-    bool carry = (dst_value >> (32 - shift)) & 0x1;
-
     uint32_t result = static_cast<uint32_t>(dst_value << shift);
     m_registers.set(dst, result);
 
-    m_registers.set_flag(Flag::Carry, carry);
-
-    bool bit31 = (result >> 31) & 0x1;
-    bool bit30 = (result >> 30) & 0x1;
-    m_registers.set_flag(Flag::Overflow, bit31 ^ bit30);
-
-    m_registers.set_flag(Flag::Sign, bit31);
-    m_registers.set_flag(Flag::Zero, result == 0);
-
-    uint8_t low_byte = result & 0xFF;
-    uint8_t bit_count = std::popcount(low_byte);
-    m_registers.set_flag(Flag::Parity, (bit_count % 2) == 0);
+    m_registers.update_flags(FlagOp::Shl, static_cast<uint32_t>(dst_value), shift, result);
 }
 
-void VM::exec_SAR(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_SAR(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("SAL requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("SAL first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     int32_t dst_value = static_cast<int32_t>(m_registers.get(dst));
 
-    int32_t shift = static_cast<int32_t>(get_value(operands[1], 
+    int32_t shift = static_cast<int32_t>(get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"SAL: "} + why); }));
 
     if (shift == 0) return;
 
     shift = shift & 0x1F;
 
-    bool carry = (dst_value >> (shift - 1)) & 0x1;
-
     uint32_t result = static_cast<uint32_t>(dst_value >> shift);
     m_registers.set(dst, result);
 
-    m_registers.set_flag(Flag::Carry, carry);
-    m_registers.set_flag(Flag::Overflow, false);
-
-    m_registers.set_flag(Flag::Sign, (result >> 31) & 0x1);
-    m_registers.set_flag(Flag::Zero, result == 0);
-
-    uint8_t low_byte = result & 0xFF;
-    uint8_t bit_count = std::popcount(low_byte);
-    m_registers.set_flag(Flag::Parity, (bit_count % 2) == 0);
+    m_registers.update_flags(FlagOp::Sar, static_cast<uint32_t>(dst_value), shift, result);
 }
 
-void VM::exec_SHL(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_SHL(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("SHL requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("SHL first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     uint32_t dst_value = m_registers.get(dst);
 
-    uint32_t shift = get_value(operands[1], 
+    uint32_t shift = get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"SHL: "} + why); });
 
     if (shift == 0) return;
 
     shift = shift & 0x1F;
 
-    bool carry = (dst_value >> (32 - shift)) & 0x1;
-
     uint32_t result = dst_value << shift;
     m_registers.set(dst, result);
 
-    m_registers.set_flag(Flag::Carry, carry);
-
-    bool bit31 = (result >> 31) & 0x1;
-    bool bit30 = (result >> 30) & 0x1;
-    m_registers.set_flag(Flag::Overflow, bit31 ^ bit30);
-
-    m_registers.set_flag(Flag::Sign, bit31);
-    m_registers.set_flag(Flag::Zero, result == 0);
-
-    uint8_t low_byte = result & 0xFF;
-    uint8_t bit_count = std::popcount(low_byte);
-    m_registers.set_flag(Flag::Parity, (bit_count % 2) == 0);
+    m_registers.update_flags(FlagOp::Shl, dst_value, shift, result);
 }
 
-void VM::exec_SHR(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 2) {
+void VM::exec_SHR(const DecodedInstruction& instr) {
+    if (instr.argc != 2) {
         throw std::invalid_argument("SHR requires 2 operands");
     }
 
-    if (!std::holds_alternative<RegisterOpcode>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Register) {
         throw std::invalid_argument("SHR first operand must be a register");
     }
 
-    RegisterOpcode dst = std::get<RegisterOpcode>(operands[0]);
+    RegisterOpcode dst = instr.reg(0);
     uint32_t dst_value = m_registers.get(dst);
 
-    uint32_t shift = get_value(operands[1], 
+    uint32_t shift = get_value(instr, 1, 
         [&](auto why){ Debugger::throw_arg_error(std::string{"SHR: "} + why); });
 
     if (shift == 0) return;
 
     shift = shift & 0x1F;
 
-    bool carry = (dst_value >> (shift - 1)) & 0x1;
-    bool overflow = (dst_value >> 31) & 0x1;
-
     uint32_t result = dst_value >> shift;
     m_registers.set(dst, result);
 
-    m_registers.set_flag(Flag::Carry, carry);
-    m_registers.set_flag(Flag::Overflow, overflow);
-
-    m_registers.set_flag(Flag::Sign, (result >> 31) & 0x1);
-    m_registers.set_flag(Flag::Zero, result == 0);
-
-    uint8_t low_byte = result & 0xFF;
-    uint8_t bit_count = std::popcount(low_byte);
-    m_registers.set_flag(Flag::Parity, (bit_count % 2) == 0);
+    m_registers.update_flags(FlagOp::Shr, dst_value, shift, result);
 }
 
-void VM::exec_INT(const std::vector<InstructionArg>& operands) {
-    if (operands.size() != 1) {
+// INT n enters the guest handler installed for n, if any, pushing EFLAGS and
+// the return pc for IRET. Otherwise INT 21h goes to the host services.
+void VM::exec_INT(const DecodedInstruction& instr) {
+    if (instr.argc != 1) {
         throw std::invalid_argument("INT requires 1 operand");
     }
 
-    if (!std::holds_alternative<int>(operands[0])) {
+    if (instr.kinds[0] != OperandKind::Immediate) {
         throw std::invalid_argument("INT first operand must be an integer");
     }    
 
-    int intr = std::get<int>(operands[0]); 
+    if (instr.values[0] >= VECTOR_COUNT) {
+        throw std::invalid_argument("INT vector must be between 0 and 255");
+    }
+
+    const uint32_t vector = m_vectors[instr.values[0]];
+    if (vector != NO_VECTOR) {
+        push(m_registers.get_eflags());
+        push(m_pc + 1);
+        m_pc = vector;
+        return;
+    }
+
+    int intr = static_cast<int>(instr.values[0]); 
 
     if (intr == Interrupt::API) {
+        if (!m_interrupt_manager) {
+            throw std::runtime_error("INT 21h raised with no interrupt manager attached");
+        }
         InterruptType t = static_cast<InterruptType>(m_registers.get_AH());
-        m_interrupt_manager->notify(Interrupt(t, m_registers));
+        m_interrupt_manager->notify(Interrupt(t, m_registers, *this));
+    }
+    step(1);
+}
+
+void VM::exec_IRET(const DecodedInstruction& instr) {
+    if (instr.argc != 0) {
+        throw std::invalid_argument("IRET takes no operands");
+    }
+
+    const uint32_t target = pop();
+    m_registers.set_eflags(pop());
+    m_pc = target;
+}
+
+void VM::exec_HLT(const DecodedInstruction& instr) {
+    if (instr.argc != 0) {
+        throw std::invalid_argument("HLT takes no operands");
+    }
+
+    halt(0);
+    step(1);
+}
+
+void VM::exec_CALL(const DecodedInstruction& instr) {
+    uint32_t target = branch_target(instr, "CALL");
+    uint32_t return_pc = m_pc + 1;
+
+    push(return_pc);
+    m_return_stack[m_return_depth++ % RETURN_STACK_SIZE] = { return_pc, m_current_block };
+    m_pc = target;
+}
+
+void VM::exec_RET(const DecodedInstruction& instr) {
+    if (instr.argc > 1) {
+        throw std::invalid_argument("RET takes at most 1 operand");
+    }
+
+    uint32_t release = 0;
+    if (instr.argc == 1) {
+        if (instr.kinds[0] != OperandKind::Immediate) {
+            throw std::invalid_argument("RET operand must be an integer");
+        }
+        release = instr.values[0];
+    }
+
+    uint32_t target = pop();
+    m_registers.set(RegisterOpcode::ESP, m_registers.get(RegisterOpcode::ESP) + release);
+    m_pc = target;
+
+    if (m_return_depth > 0) {
+        const ReturnEntry& entry = m_return_stack[--m_return_depth % RETURN_STACK_SIZE];
+        if (entry.return_pc == target) [[likely]] {
+            ++m_returns_predicted;
+            m_return_block = entry.call_block;
+            return;
+        }
+    }
+
+    // The guest rewrote its return address or unwound several frames at once.
+    ++m_returns_mispredicted;
+    m_return_depth = 0;
+}
+
+// ENTER size, level: pushes EBP, copies `level - 1` outer frame pointers,
+// points EBP at the new frame and reserves `size` bytes below it.
+void VM::exec_ENTER(const DecodedInstruction& instr) {
+    if (instr.argc != 1 && instr.argc != 2) {
+        throw std::invalid_argument("ENTER requires 1 or 2 operands");
+    }
+
+    for (size_t i = 0; i < instr.argc; ++i) {
+        if (instr.kinds[i] != OperandKind::Immediate) {
+            throw std::invalid_argument("ENTER operands must be integers");
+        }
+    }
+
+    uint32_t size = instr.values[0] & 0xFFFF;
+    uint32_t level = instr.argc == 2 ? instr.values[1] % 32 : 0;
+
+    push(m_registers.get(RegisterOpcode::EBP));
+    uint32_t frame = m_registers.get(RegisterOpcode::ESP);
+
+    if (level > 0) {
+        uint32_t ebp = m_registers.get(RegisterOpcode::EBP);
+        for (uint32_t i = 1; i < level; ++i) {
+            ebp -= 4;
+            push(m_memory.load32(ebp));
+        }
+        push(frame);
+    }
+
+    m_registers.set(RegisterOpcode::EBP, frame);
+
+    uint32_t esp = m_registers.get(RegisterOpcode::ESP);
+    if (esp < m_stack_limit + size) {
+        throw std::runtime_error("Stack overflow");
+    }
+    m_registers.set(RegisterOpcode::ESP, esp - size);
+}
+
+void VM::exec_LEAVE(const DecodedInstruction& instr) {
+    if (instr.argc != 0) {
+        throw std::invalid_argument("LEAVE takes no operands");
     }
+
+    // Pops from EBP, so a frame pointer outside the stack faults with ESP intact.
+    const uint32_t frame = m_registers.get(RegisterOpcode::EBP);
+    check_pop(frame);
+    m_registers.set(RegisterOpcode::EBP, m_memory.load32(frame));
+    m_registers.set(RegisterOpcode::ESP, frame + 4);
+}
+
+static RegisterOpcode accumulator(uint32_t width) {
+    return width == 1 ? RegisterOpcode::AL : width == 2 ? RegisterOpcode::AX : RegisterOpcode::EAX;
+}
+
+VM::StringRun VM::string_run(const DecodedInstruction& instr) const {
+    if (instr.argc != 0) {
+        throw std::invalid_argument(std::string(ParseUtils::opcode_name(instr.opcode)) + " takes no operands");
+    }
+
+    StringRun run;
+    run.count = instr.prefix == RepPrefix::None ? 1 : m_registers.get(RegisterOpcode::ECX);
+    run.width = string_operand_width(instr.opcode);
+    run.step = m_registers.get_flag(Flag::Direction) ? -static_cast<int32_t>(run.width)
+                                                     : static_cast<int32_t>(run.width);
+    return run;
+}
+
+uint32_t VM::string_range(uint32_t address, const StringRun& run) const {
+    const uint64_t span = uint64_t(run.count - 1) * run.width;
+    if (run.step < 0 && span > address) {
+        throw std::out_of_range("String operation below address 0");
+    }
+
+    const uint32_t low = run.step < 0 ? static_cast<uint32_t>(address - span) : address;
+    m_memory.check(low, span + run.width);
+    return low;
+}
+
+// Elements of a forward run from `address` that lie inside memory. Scans
+// stop early, so they only fault if they actually reach the end of memory.
+uint32_t VM::elements_in_memory(uint32_t address, const StringRun& run) const {
+    const uint64_t room = address < m_memory.size() ? m_memory.size() - address : 0;
+    return static_cast<uint32_t>(std::min<uint64_t>(room / run.width, run.count));
+}
+
+void VM::advance(RegisterOpcode reg, const StringRun& run, uint32_t elements) {
+    m_registers.set(reg, m_registers.get(reg) + static_cast<uint32_t>(run.step) * elements);
+}
+
+// SCAS/CMPS ran `elements` comparisons; the flags are those of the last one.
+void VM::finish_compare(const DecodedInstruction& instr, const StringRun& run, uint32_t elements,
+                        uint32_t a_value, uint32_t b_value) {
+    m_registers.update_flags(FlagOp::Cmp, a_value, b_value, a_value - b_value);
+    if (instr.prefix != RepPrefix::None) {
+        m_registers.set(RegisterOpcode::ECX, run.count - elements);
+    }
+}
+
+// A whole REP MOVS is one copy. x86 copies element by element, so when the
+// destination overlaps the source ahead of the direction of travel the
+// already copied bytes repeat; that case is copied in spans of the overlap
+// distance, each of which no longer overlaps its own source.
+void VM::exec_MOVS(const DecodedInstruction& instr) {
+    const StringRun run = string_run(instr);
+    if (run.count == 0) {
+        return;
+    }
+
+    const uint32_t src = string_range(m_registers.get(RegisterOpcode::ESI), run);
+    const uint32_t dst = string_range(m_registers.get(RegisterOpcode::EDI), run);
+    const uint64_t bytes = uint64_t(run.count) * run.width;
+
+    const bool forward = run.step > 0;
+    const uint64_t distance = forward ? uint64_t(dst) - src : uint64_t(src) - dst;
+    const bool repeats = forward ? dst > src && distance < bytes : dst < src && distance < bytes;
+
+    if (!repeats) {
+        m_memory.copy(dst, src, bytes);
+    } else if (distance < run.width) {
+        // Elements overlap themselves: follow x86 one element at a time.
+        for (uint32_t i = 0; i < run.count; ++i) {
+            const uint64_t offset = forward ? uint64_t(i) * run.width : bytes - uint64_t(i + 1) * run.width;
+            m_memory.store(dst + offset, m_memory.load(src + offset, run.width), run.width);
+        }
+    } else if (forward) {
+        for (uint64_t offset = 0; offset < bytes; offset += distance) {
+            m_memory.copy(dst + offset, src + offset, std::min(distance, bytes - offset));
+        }
+    } else {
+        for (uint64_t end = bytes; end > 0;) {
+            const uint64_t chunk = std::min(distance, end);
+            end -= chunk;
+            m_memory.copy(dst + end, src + end, chunk);
+        }
+    }
+
+    advance(RegisterOpcode::ESI, run, run.count);
+    advance(RegisterOpcode::EDI, run, run.count);
+    if (instr.prefix != RepPrefix::None) {
+        m_registers.set(RegisterOpcode::ECX, 0);
+    }
+}
+
+void VM::exec_STOS(const DecodedInstruction& instr) {
+    const StringRun run = string_run(instr);
+    if (run.count == 0) {
+        return;
+    }
+
+    const uint32_t dst = string_range(m_registers.get(RegisterOpcode::EDI), run);
+    m_memory.fill(dst, m_registers.get(accumulator(run.width)), run.width, run.count);
+
+    advance(RegisterOpcode::EDI, run, run.count);
+    if (instr.prefix != RepPrefix::None) {
+        m_registers.set(RegisterOpcode::ECX, 0);
+    }
+}
+
+// REP LODS only leaves the last element in the accumulator.
+void VM::exec_LODS(const DecodedInstruction& instr) {
+    const StringRun run = string_run(instr);
+    if (run.count == 0) {
+        return;
+    }
+
+    const uint32_t esi = m_registers.get(RegisterOpcode::ESI);
+    string_range(esi, run);
+    const uint32_t last = esi + static_cast<uint32_t>(run.step) * (run.count - 1);
+    m_registers.set(accumulator(run.width), m_memory.load(last, run.width));
+
+    advance(RegisterOpcode::ESI, run, run.count);
+    if (instr.prefix != RepPrefix::None) {
+        m_registers.set(RegisterOpcode::ECX, 0);
+    }
+}
+
+// REP is REPE here, as on x86: the scan stops at the first element that
+// differs from (REPE) or matches (REPNE) the accumulator. Elements are only
+// bounds-checked as far as the scan gets.
+void VM::exec_SCAS(const DecodedInstruction& instr) {
+    const StringRun run = string_run(instr);
+    if (run.count == 0) {
+        return;
+    }
+
+    const uint32_t edi = m_registers.get(RegisterOpcode::EDI);
+    const uint32_t value = m_registers.get(accumulator(run.width));
+    const bool stop_on_equal = instr.prefix == RepPrefix::RepNE;
+
+    uint32_t elements = run.count;
+    if (run.width == 1 && run.step > 0) {
+        const uint32_t scanned = elements_in_memory(edi, run);
+        const size_t hit = m_memory.find_byte(edi, scanned, static_cast<uint8_t>(value), stop_on_equal);
+        if (hit < scanned) {
+            elements = static_cast<uint32_t>(hit) + 1;
+        } else if (scanned < run.count) {
+            m_memory.check(edi, run.count);
+        }
+    } else {
+        for (uint32_t i = 0; i < run.count; ++i) {
+            const uint32_t element = m_memory.load(edi + static_cast<uint32_t>(run.step) * i, run.width);
+            if ((element == value) == stop_on_equal) {
+                elements = i + 1;
+                break;
+            }
+        }
+    }
+
+    const uint32_t last = m_memory.load(edi + static_cast<uint32_t>(run.step) * (elements - 1), run.width);
+    advance(RegisterOpcode::EDI, run, elements);
+    finish_compare(instr, run, elements, value, last);
+}
+
+void VM::exec_CMPS(const DecodedInstruction& instr) {
+    const StringRun run = string_run(instr);
+    if (run.count == 0) {
+        return;
+    }
+
+    const uint32_t esi = m_registers.get(RegisterOpcode::ESI);
+    const uint32_t edi = m_registers.get(RegisterOpcode::EDI);
+    const bool stop_on_equal = instr.prefix == RepPrefix::RepNE;
+
+    uint32_t elements = run.count;
+    if (!stop_on_equal && run.step > 0) {
+        const uint32_t compared = std::min(elements_in_memory(esi, run), elements_in_memory(edi, run));
+        const uint64_t bytes = uint64_t(compared) * run.width;
+        const size_t offset = m_memory.mismatch(esi, edi, bytes);
+        if (offset < bytes) {
+            elements = static_cast<uint32_t>(offset / run.width) + 1;
+        } else if (compared < run.count) {
+            string_range(esi, run);
+            string_range(edi, run);
+        }
+    } else {
+        for (uint32_t i = 0; i < run.count; ++i) {
+            const uint32_t delta = static_cast<uint32_t>(run.step) * i;
+            if ((m_memory.load(esi + delta, run.width) == m_memory.load(edi + delta, run.width)) == stop_on_equal) {
+                elements = i + 1;
+                break;
+            }
+        }
+    }
+
+    const uint32_t delta = static_cast<uint32_t>(run.step) * (elements - 1);
+    const uint32_t a_value = m_memory.load(esi + delta, run.width);
+    const uint32_t b_value = m_memory.load(edi + delta, run.width);
+    advance(RegisterOpcode::ESI, run, elements);
+    advance(RegisterOpcode::EDI, run, elements);
+    finish_compare(instr, run, elements, a_value, b_value);
+}
+
+void VM::exec_CLD(const DecodedInstruction& instr) {
+    if (instr.argc != 0) {
+        throw std::invalid_argument("CLD takes no operands");
+    }
+
+    m_registers.set_flag(Flag::Direction, false);
+}
+
+void VM::exec_STD(const DecodedInstruction& instr) {
+    if (instr.argc != 0) {
+        throw std::invalid_argument("STD takes no operands");
+    }
+
+    m_registers.set_flag(Flag::Direction, true);
+}
+
+// CMP + Jcc: the comparison is recorded as the pending flag op for whoever
+// reads the flags later, and the condition is tested on the operands, so no
+// flags are computed here.
+void VM::exec_CMP_JCC(const DecodedInstruction& instr) {
+    const DecodedInstruction& jcc = fused_second();
+
+    uint32_t a_value = m_registers.get(instr.reg(0));
+    uint32_t b_value = source_value(instr, 1);
+    m_registers.update_flags(FlagOp::Cmp, a_value, b_value, a_value - b_value);
+
+    ++m_fused_executed;
+    m_pc = s_compare[instr.condition](a_value, b_value, m_registers) ? jcc.values[0] : m_pc + 2;
+}
+
+// DEC leaves the flags alone, so JNZ tests whatever set ZF before it.
+void VM::exec_DEC_JNZ(const DecodedInstruction& instr) {
+    const DecodedInstruction& jnz = fused_second();
+
+    RegisterOpcode dst = instr.reg(0);
+    m_registers.set(dst, m_registers.get(dst) - 1);
+
+    ++m_fused_executed;
+    m_pc = !m_registers.get_flag(Flag::Zero) ? jnz.values[0] : m_pc + 2;
+}
+
+void VM::exec_MOV_ADD(const DecodedInstruction& instr) {
+    const DecodedInstruction& add = fused_second();
+
+    m_registers.set(instr.reg(0), source_value(instr, 1));
+
+    RegisterOpcode dst = add.reg(0);
+    uint32_t dst_value = m_registers.get(dst);
+    uint32_t src = source_value(add, 1);
+    uint32_t result = dst_value + src;
+    m_registers.set(dst, result);
+    m_registers.update_flags(FlagOp::Add, dst_value, src, result);
+
+    ++m_fused_executed;
+    m_pc += 2;
+}
+
+void VM::exec_INVALID(const DecodedInstruction&) {
+    throw std::invalid_argument("Unknown opcode!");
+}
+
+// Ends the running slice at the next budget check, which comes right after
+// the INT that parked the VM, since INT ends its block.
+void VM::park() {
+    m_parked = true;
+    m_stop = 0;
+}
+
+// Like park(): the loop stops at the budget check after the instruction.
+void VM::halt(uint8_t exit_code) {
+    m_halted = true;
+    m_exit_code = exit_code;
+    m_stop = 0;
 }
 
 void VM::on_read_char(char c) {
@@ -4,86 +4,320 @@
 #include "ParseUtils.h"
 #include "Registers.h"
 #include "Debugger.h"
+#include "ProgramImage.h"
+#include "Jit.h"
+#include "BlockCache.h"
+#include "Memory.h"
+#include "BuddyAllocator.h"
+#include "Profiler.h"
 #include <stdexcept>
-#include <stack>
 #include <vector>
+#include <array>
 #include <bit>
+#include <memory>
+#include <span>
+
+// Why VM::run(budget) returned.
+enum class RunStatus : uint8_t {
+    Finished,   // the pc ran off the end of the program
+    Yielded,    // the instruction budget ran out; run() again to continue
+    Parked,     // an interrupt service is still in progress; resume(), then run() again
+    Halted      // the program stopped itself with HLT or INT 21h AH=4Ch; see exit_code()
+};
 
 class VM {
+public:
+    class Snapshot;
+
 private:
     Registers m_registers;
     uint32_t m_pc {};
-    std::unordered_map<InstructionOpcode, std::function<void(const std::vector<InstructionArg>& operands)>> m_dispatch;
-    std::stack<uint32_t> m_program_stack;
-    std::vector<Instruction> m_program;
-    InterruptManager* m_interrupt_manager;
+    Memory m_memory;
+    uint32_t m_stack_top;       // initial ESP; the stack grows down from here
+    uint32_t m_stack_limit;     // lowest address a push may write
+    BuddyAllocator m_heap;      // INT 21h AH=48h/49h, right below the stack
+    std::vector<DecodedInstruction> m_program;
+    std::span<const DecodedInstruction> m_code;     // what actually runs: m_program or a mapped image
+    std::shared_ptr<const ProgramImage> m_image;
+    InterruptManager* m_interrupt_manager = nullptr;
+    uint64_t m_fused_executed {};
+    uint64_t m_executed {};
+    uint64_t m_stop {};         // the run loop returns once m_executed reaches this
+    bool m_parked = false;
+    bool m_halted = false;
+    uint8_t m_exit_code {};
+    BlockCache m_blocks;
+    std::unique_ptr<Jit> m_jit;
+    JitMode m_jit_mode = JitMode::Off;
+    Profiler* m_profiler = nullptr;
+    void* m_host = nullptr;
+
+    // Shadow return stack: CALL records the return pc and the block it was
+    // called from. A RET that returns to the recorded pc continues through
+    // that block's cached fall-through link instead of looking the pc up.
+    struct ReturnEntry {
+        uint32_t return_pc;
+        uint32_t call_block;
+    };
+    static constexpr uint32_t RETURN_STACK_SIZE = 32;
+    std::array<ReturnEntry, RETURN_STACK_SIZE> m_return_stack {};
+    uint32_t m_return_depth {};     // grows without bound; indexed modulo the size
+    uint32_t m_current_block = BlockCache::NO_BLOCK;
+    uint32_t m_return_block = BlockCache::NO_BLOCK;   // set by a predicted RET
+    // Guest interrupt vector table: INT n enters m_vectors[n] when it is set.
+    static constexpr size_t VECTOR_COUNT = 256;
+    std::array<uint32_t, VECTOR_COUNT> m_vectors;
+
+    uint64_t m_returns_predicted {};
+    uint64_t m_returns_mispredicted {};
+
+    using Handler = void (VM::*)(const DecodedInstruction& instr);
+
+    struct OpcodeEntry {
+        Handler handler;
+        bool is_jump;   // handler sets m_pc itself
+    };
+
+    // Dense dispatch table indexed by the opcode byte. It covers every byte
+    // value, so records mapped from an image need no opcode validation.
+    static constexpr size_t DISPATCH_SIZE = 256;
+    static const std::array<OpcodeEntry, DISPATCH_SIZE> s_dispatch;
+    static constexpr std::array<OpcodeEntry, DISPATCH_SIZE> make_dispatch_table();
+
+    // Whether a fused CMP a, b + Jcc jumps, by the CompareCondition Fusion
+    // chose. Like s_dispatch it covers every byte value.
+    using Compare = bool (*)(uint32_t a, uint32_t b, const Registers& regs);
+    static const std::array<Compare, DISPATCH_SIZE> s_compare;
 
     template<typename F>
-    uint32_t get_value(const InstructionArg& arg, F&& err);    
+    uint32_t get_value(const DecodedInstruction& instr, size_t index, F&& err);
+    uint32_t branch_target(const DecodedInstruction& instr, const char* name);
+    // Guest address of memory operand `index`: base register plus displacement, mod 2^32.
+    uint32_t effective_address(const DecodedInstruction& instr, size_t index) const;
+    void push(uint32_t value);
+    uint32_t pop();
+    // Throws unless a dword can be popped with ESP = `esp`.
+    void check_pop(uint32_t esp) const;
+
+    // String instruction helpers.
+    struct StringRun {
+        uint32_t count;     // elements to process: ECX under a prefix, else 1
+        uint32_t width;
+        int32_t step;       // +width, or -width when DF is set
+    };
+    StringRun string_run(const DecodedInstruction& instr) const;
+    // Lowest address of `run.count` elements walked from `address`, after checking the range.
+    uint32_t string_range(uint32_t address, const StringRun& run) const;
+    uint32_t elements_in_memory(uint32_t address, const StringRun& run) const;
+    void advance(RegisterOpcode reg, const StringRun& run, uint32_t elements);
+    void finish_compare(const DecodedInstruction& instr, const StringRun& run, uint32_t elements,
+                        uint32_t a_value, uint32_t b_value);
+
+    // Helpers for fused handlers, whose operands Fusion has already checked.
+    uint32_t source_value(const DecodedInstruction& instr, size_t index) const;
+    const DecodedInstruction& fused_second() const;
 
 public:
+    // Size of the stack region at the top of guest memory.
+    static constexpr uint32_t STACK_SIZE = 64 * 1024;
+    // The heap is 2^HEAP_ORDER paragraphs (4 MiB) below the stack.
+    static constexpr uint32_t HEAP_ORDER = 18;
+
     VM();
+    static DecodedInstruction decode(const Instruction& instr);
     void execute(const Instruction& instr);
+    void execute(const DecodedInstruction& instr);
+
+    // Replaces the program buffer with an assembled program and rewinds the pc.
+    void load(std::vector<DecodedInstruction> program);
+    // Runs straight out of the image's code section; nothing is copied.
+    void load(std::shared_ptr<const ProgramImage> image);
+    // Puts the VM back in its just-constructed state without reallocating:
+    // registers, flags, pc, guest memory, stack, heap, vectors and counters
+    // are cleared. The program, its block cache and JIT code, the interrupt
+    // manager, the host pointer and the JIT and flag modes are kept.
+    void reset();
+    // Captures the whole guest-visible state: registers and flags, pc, guest
+    // memory including the stack, heap, vectors and the halted state, for
+    // restore() to return to any number of times, on this VM or others of the
+    // same memory size. Memory pages are shared copy-on-write, so this costs
+    // a pointer copy per mapped page and no page data. A program loaded from
+    // a vector is moved into an in-memory image first, so that the VMs
+    // restored from the snapshot share it. Throws std::runtime_error while the
+    // VM is parked. Host-side state kept by interrupt services, such as open
+    // files, is not part of the snapshot.
+    Snapshot snapshot();
+    // Puts the VM back in the snapshot's state; the counters keep counting.
+    // Restoring the snapshot this VM last took or restored only rewrites the
+    // pages stored to since, so it costs time in proportion to the dirty
+    // pages rather than to memory size; it also keeps the program's blocks
+    // and JIT code. Throws std::invalid_argument if the memory sizes differ.
+    void restore(const Snapshot& snapshot);
+    void run();
+    // Runs at most about `budget` instructions. The budget is checked between
+    // basic blocks, so a slice can overshoot by less than one block.
+    RunStatus run(uint64_t budget);
     void set_interrupt_manager(InterruptManager* intr);
+    // JIT compilation only applies while flags are in FlagMode::Lazy.
+    void set_jit_mode(JitMode mode);
+    const Jit* jit() const { return m_jit.get(); }
+    // Counts every instruction and taken jump into `profiler` (nullptr: stop).
+    // Profiled runs are interpreted, so the JIT is bypassed while one is set.
+    void set_profiler(Profiler* profiler) { m_profiler = profiler; }
+    // Opaque pointer for whoever runs the VM, so interrupt services can find
+    // their per-VM state without a lookup. The VM never uses it.
+    void set_host(void* host) { m_host = host; }
+    void* host() const { return m_host; }
+
+    // Guest handler of INT `vector`: an instruction index, or NO_VECTOR.
+    static constexpr uint32_t NO_VECTOR = UINT32_MAX;
+    void set_vector(uint8_t vector, uint32_t handler) { m_vectors[vector] = handler; }
+    uint32_t get_vector(uint8_t vector) const { return m_vectors[vector]; }
+
+    // Whether conditional jump `jcc` is taken for the given flags word.
+    static bool branch_taken(InstructionOpcode jcc, uint32_t eflags);
+
+    Registers& registers() { return m_registers; }
+    const Registers& registers() const { return m_registers; }
+    Memory& memory() { return m_memory; }
+    BuddyAllocator& heap() { return m_heap; }
+    const Memory& memory() const { return m_memory; }
+    uint32_t pc() const { return m_pc; }
+    // Number of fused superinstructions dispatched so far.
+    uint64_t fused_executed() const { return m_fused_executed; }
+    // Number of instructions retired so far; a fused pair counts as two.
+    uint64_t executed() const { return m_executed; }
+    // RETs whose target matched / missed the shadow return stack.
+    uint64_t returns_predicted() const { return m_returns_predicted; }
+    uint64_t returns_mispredicted() const { return m_returns_mispredicted; }
 
     // --- Interruptions ---
+    // An INT 21h service that cannot answer straight away parks the VM: the
+    // INT still retires, but run() returns RunStatus::Parked right after it.
+    // Whoever completes the request fills in the results (on_read_char()
+    // and friends) and calls resume() before running the VM again.
+    void park();
+    // Also lets a halted program continue after its HLT, e.g. from a
+    // snapshot taken at the end of a prologue.
+    void resume() { m_parked = false; m_halted = false; }
+    bool parked() const { return m_parked; }
+    // HLT and INT 21h AH=4Ch stop the program right after the instruction;
+    // run() then returns RunStatus::Halted until another program is loaded
+    // or the VM is resume()d.
+    void halt(uint8_t exit_code);
+    bool halted() const { return m_halted; }
+    // Exit code of the last program that halted on this VM, kept across load().
+    uint8_t exit_code() const { return m_exit_code; }
     void on_read_char(char c);
     void on_get_system_date(int year, int month, int day, int day_of_week);
         
 private:
     void step(int step = 1);
-    void process_instructions();
+    // Back to the program start, with no call, park, halt or heap state.
+    void rewind();
+    // Why the run loop stopped before reaching the end of the program.
+    RunStatus stop_status() const {
+        return m_halted ? RunStatus::Halted : m_parked ? RunStatus::Parked : RunStatus::Yielded;
+    }
+    RunStatus process_instructions(uint64_t budget = UINT64_MAX);
+    // The interpreter loop; with Profile = false it has no profiling code at all.
+    template<bool Profile>
+    RunStatus interpret();
+    RunStatus process_instructions_jit();
+    void run_block(const Jit::Block& block);
+    void verify_block(const Jit::Block& block);
 
     // --- Instructions ---
-    void exec_MOV(const std::vector<InstructionArg>& operands);
-    void exec_ADD(const std::vector<InstructionArg>& operands);
-    void exec_SUB(const std::vector<InstructionArg>& operands); 
-    void exec_MUL(const std::vector<InstructionArg>& operands);
-    void exec_DIV(const std::vector<InstructionArg>& operands);
-    void exec_AND(const std::vector<InstructionArg>& operands);
-    void exec_OR(const std::vector<InstructionArg>& operands);
-    void exec_XOR(const std::vector<InstructionArg>& operands);
-    void exec_NOT(const std::vector<InstructionArg>& operands);
-    void exec_PUSH(const std::vector<InstructionArg>& operands);
-    void exec_POP(const std::vector<InstructionArg>& operands);
-    void exec_JMP(const std::vector<InstructionArg>& operands);
-    void exec_CMP(const std::vector<InstructionArg>& operands);
-    void exec_JE(const std::vector<InstructionArg>& operands);
-    void exec_JNE(const std::vector<InstructionArg>& operands);
-    void exec_JZ(const std::vector<InstructionArg>& operands);
-    void exec_JNZ(const std::vector<InstructionArg>& operands);
-    void exec_JA(const std::vector<InstructionArg>& operands);
-    void exec_JNBE(const std::vector<InstructionArg>& operands);
-    void exec_JAE(const std::vector<InstructionArg>& operands);
-    void exec_JNB(const std::vector<InstructionArg>& operands);
-    void exec_JB(const std::vector<InstructionArg>& operands);
-    void exec_JNAE(const std::vector<InstructionArg>& operands);
-    void exec_JBE(const std::vector<InstructionArg>& operands);
-    void exec_JNA(const std::vector<InstructionArg>& operands);
-    void exec_JG(const std::vector<InstructionArg>& operands);
-    void exec_JNLE(const std::vector<InstructionArg>& operands);
-    void exec_JGE(const std::vector<InstructionArg>& operands);
-    void exec_JNL(const std::vector<InstructionArg>& operands);
-    void exec_JL(const std::vector<InstructionArg>& operands);
-    void exec_JNGE(const std::vector<InstructionArg>& operands);
-    void exec_JLE(const std::vector<InstructionArg>& operands);
-    void exec_JNG(const std::vector<InstructionArg>& operands);
-    void exec_JC(const std::vector<InstructionArg>& operands);
-    void exec_JNC(const std::vector<InstructionArg>& operands);
-    void exec_JO(const std::vector<InstructionArg>& operands);
-    void exec_JNO(const std::vector<InstructionArg>& operands);
-    void exec_JS(const std::vector<InstructionArg>& operands);
-    void exec_JNS(const std::vector<InstructionArg>& operands);
-    void exec_JP(const std::vector<InstructionArg>& operands);
-    void exec_JPE(const std::vector<InstructionArg>& operands);
-    void exec_JNP(const std::vector<InstructionArg>& operands);
-    void exec_JPO(const std::vector<InstructionArg>& operands);
-    void exec_INC(const std::vector<InstructionArg>& operands);
-    void exec_DEC(const std::vector<InstructionArg>& operands);
-    void exec_SAL(const std::vector<InstructionArg>& operands);
-    void exec_SAR(const std::vector<InstructionArg>& operands);
-    void exec_SHL(const std::vector<InstructionArg>& operands);
-    void exec_SHR(const std::vector<InstructionArg>& operands);
-    void exec_INT(const std::vector<InstructionArg>& operands);
-    void exec_NOP() {}
+    void exec_MOV(const DecodedInstruction& instr);
+    void exec_ADD(const DecodedInstruction& instr);
+    void exec_SUB(const DecodedInstruction& instr); 
+    void exec_MUL(const DecodedInstruction& instr);
+    void exec_DIV(const DecodedInstruction& instr);
+    void exec_AND(const DecodedInstruction& instr);
+    void exec_OR(const DecodedInstruction& instr);
+    void exec_XOR(const DecodedInstruction& instr);
+    void exec_NOT(const DecodedInstruction& instr);
+    void exec_PUSH(const DecodedInstruction& instr);
+    void exec_POP(const DecodedInstruction& instr);
+    void exec_JMP(const DecodedInstruction& instr);
+    void exec_CMP(const DecodedInstruction& instr);
+    void exec_JE(const DecodedInstruction& instr);
+    void exec_JNE(const DecodedInstruction& instr);
+    void exec_JZ(const DecodedInstruction& instr);
+    void exec_JNZ(const DecodedInstruction& instr);
+    void exec_JA(const DecodedInstruction& instr);
+    void exec_JNBE(const DecodedInstruction& instr);
+    void exec_JAE(const DecodedInstruction& instr);
+    void exec_JNB(const DecodedInstruction& instr);
+    void exec_JB(const DecodedInstruction& instr);
+    void exec_JNAE(const DecodedInstruction& instr);
+    void exec_JBE(const DecodedInstruction& instr);
+    void exec_JNA(const DecodedInstruction& instr);
+    void exec_JG(const DecodedInstruction& instr);
+    void exec_JNLE(const DecodedInstruction& instr);
+    void exec_JGE(const DecodedInstruction& instr);
+    void exec_JNL(const DecodedInstruction& instr);
+    void exec_JL(const DecodedInstruction& instr);
+    void exec_JNGE(const DecodedInstruction& instr);
+    void exec_JLE(const DecodedInstruction& instr);
+    void exec_JNG(const DecodedInstruction& instr);
+    void exec_JC(const DecodedInstruction& instr);
+    void exec_JNC(const DecodedInstruction& instr);
+    void exec_JO(const DecodedInstruction& instr);
+    void exec_JNO(const DecodedInstruction& instr);
+    void exec_JS(const DecodedInstruction& instr);
+    void exec_JNS(const DecodedInstruction& instr);
+    void exec_JP(const DecodedInstruction& instr);
+    void exec_JPE(const DecodedInstruction& instr);
+    void exec_JNP(const DecodedInstruction& instr);
+    void exec_JPO(const DecodedInstruction& instr);
+    void exec_INC(const DecodedInstruction& instr);
+    void exec_DEC(const DecodedInstruction& instr);
+    void exec_SAL(const DecodedInstruction& instr);
+    void exec_SAR(const DecodedInstruction& instr);
+    void exec_SHL(const DecodedInstruction& instr);
+    void exec_SHR(const DecodedInstruction& instr);
+    void exec_INT(const DecodedInstruction& instr);
+    void exec_CALL(const DecodedInstruction& instr);
+    void exec_RET(const DecodedInstruction& instr);
+    void exec_ENTER(const DecodedInstruction& instr);
+    void exec_LEAVE(const DecodedInstruction& instr);
+    void exec_MOVS(const DecodedInstruction& instr);
+    void exec_STOS(const DecodedInstruction& instr);
+    void exec_LODS(const DecodedInstruction& instr);
+    void exec_SCAS(const DecodedInstruction& instr);
+    void exec_CMPS(const DecodedInstruction& instr);
+    void exec_IRET(const DecodedInstruction& instr);
+    void exec_HLT(const DecodedInstruction& instr);
+    void exec_CLD(const DecodedInstruction& instr);
+    void exec_STD(const DecodedInstruction& instr);
+    void exec_NOP(const DecodedInstruction&) {}
+
+    // --- Superinstructions ---
+    void exec_CMP_JCC(const DecodedInstruction& instr);
+    void exec_DEC_JNZ(const DecodedInstruction& instr);
+    void exec_MOV_ADD(const DecodedInstruction& instr);
+
+    void exec_INVALID(const DecodedInstruction& instr);
+};
+
+class VM::Snapshot {
+public:
+    const Memory::Snapshot& memory() const { return m_memory; }
+    uint32_t pc() const { return m_pc; }
+
+private:
+    friend class VM;
+
+    Snapshot(const Registers& registers, uint32_t pc, Memory::Snapshot memory, const BuddyAllocator& heap)
+        : m_registers(registers), m_pc(pc), m_memory(std::move(memory)), m_heap(heap) {}
+
+    Registers m_registers;
+    uint32_t m_pc;
+    Memory::Snapshot m_memory;
+    BuddyAllocator m_heap;
+    std::array<uint32_t, VECTOR_COUNT> m_vectors {};
+    std::shared_ptr<const ProgramImage> m_image;
+    bool m_halted = false;
+    uint8_t m_exit_code {};
 };
@@ -0,0 +1,50 @@
+#include "VmPool.h"
+
+VmPool::VmPool(size_t max_idle) : m_max_idle(max_idle) {
+    m_idle.reserve(max_idle);
+}
+
+VmPool::Handle VmPool::acquire() {
+    {
+        std::lock_guard<std::mutex> lk(m_mtx);
+        if (!m_idle.empty()) {
+            std::unique_ptr<VM> vm = std::move(m_idle.back());
+            m_idle.pop_back();
+            ++m_reused;
+            return Handle(vm.release(), Release { this });
+        }
+        ++m_created;
+    }
+    return Handle(new VM(), Release { this });
+}
+
+// Resets on the releasing thread, outside the lock, so acquire() stays cheap.
+// What the caller attached may be gone before the VM is handed out again.
+void VmPool::release(VM* raw) {
+    std::unique_ptr<VM> vm(raw);
+    vm->reset();
+    vm->load(std::vector<DecodedInstruction> {});
+    vm->set_interrupt_manager(nullptr);
+    vm->set_profiler(nullptr);
+    vm->set_host(nullptr);
+
+    std::lock_guard<std::mutex> lk(m_mtx);
+    if (m_idle.size() < m_max_idle) {
+        m_idle.push_back(std::move(vm));
+    }
+}
+
+size_t VmPool::idle() const {
+    std::lock_guard<std::mutex> lk(m_mtx);
+    return m_idle.size();
+}
+
+uint64_t VmPool::created() const {
+    std::lock_guard<std::mutex> lk(m_mtx);
+    return m_created;
+}
+
+uint64_t VmPool::reused() const {
+    std::lock_guard<std::mutex> lk(m_mtx);
+    return m_reused;
+}
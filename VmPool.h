@@ -0,0 +1,47 @@
+#pragma once
+
+#include "VM.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Hands out warm VMs for hosts that run many short programs.
+//
+// Constructing a VM maps its stack and sets up memory, heap and block cache;
+// a VM given back to the pool is reset() instead and handed out again. It
+// also drops its program and its interrupt manager, profiler and host
+// pointer, none of which the pool owns, so every VM handed out is as bare as
+// a new one. Safe to use from several threads. The pool must outlive every
+// VM it hands out.
+class VmPool {
+public:
+    struct Release {
+        VmPool* pool;
+        void operator()(VM* vm) const { pool->release(vm); }
+    };
+    using Handle = std::unique_ptr<VM, Release>;
+
+    // Keeps at most `max_idle` VMs; any beyond that are destroyed when given back.
+    explicit VmPool(size_t max_idle = 64);
+
+    VmPool(const VmPool&) = delete;
+    VmPool& operator=(const VmPool&) = delete;
+
+    // A reset VM; goes back to the pool when the handle is destroyed.
+    Handle acquire();
+
+    size_t idle() const;
+    uint64_t created() const;
+    uint64_t reused() const;
+
+private:
+    size_t m_max_idle;
+    mutable std::mutex m_mtx;
+    std::vector<std::unique_ptr<VM>> m_idle;
+    uint64_t m_created {};
+    uint64_t m_reused {};
+
+    void release(VM* vm);
+};
@@ -0,0 +1,1011 @@
+#include "VM.h"
+#include "Fusion.h"
+#include "Engine.h"
+#include "ConsoleDevice.h"
+#include "FileServices.h"
+#include "VmPool.h"
+#include "Assembler.h"
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+struct Workload {
+    std::string name;
+    std::vector<Instruction> program;
+    uint64_t executed;
+};
+
+Workload make_arith_loop(uint32_t iterations) {
+    Workload w;
+    w.name = "arith_loop";
+    w.program = {
+        { InstructionOpcode::MOV, { RegisterOpcode::ECX, (int)iterations } },
+        { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0 } },
+        { InstructionOpcode::ADD, { RegisterOpcode::EAX, RegisterOpcode::ECX } },
+        { InstructionOpcode::XOR, { RegisterOpcode::EBX, RegisterOpcode::EAX } },
+        { InstructionOpcode::SUB, { RegisterOpcode::ECX, 1 } },
+        { InstructionOpcode::CMP, { RegisterOpcode::ECX, 0 } },
+        { InstructionOpcode::JNE, { 2 } },
+    };
+    w.executed = 2 + uint64_t(iterations) * 5;
+    return w;
+}
+
+Workload make_stack_loop(uint32_t iterations) {
+    Workload w;
+    w.name = "stack_loop";
+    w.program = {
+        { InstructionOpcode::MOV, { RegisterOpcode::ECX, (int)iterations } },
+        { InstructionOpcode::PUSH, { RegisterOpcode::ECX } },
+        { InstructionOpcode::POP, { RegisterOpcode::EDX } },
+        { InstructionOpcode::SHL, { RegisterOpcode::EDX, 1 } },
+        { InstructionOpcode::SUB, { RegisterOpcode::ECX, 1 } },
+        { InstructionOpcode::CMP, { RegisterOpcode::ECX, 0 } },
+        { InstructionOpcode::JNE, { 1 } },
+    };
+    w.executed = 1 + uint64_t(iterations) * 6;
+    return w;
+}
+
+Workload make_flags_loop(uint32_t iterations) {
+    Workload w;
+    w.name = "flags_loop";
+    w.program = {
+        { InstructionOpcode::MOV, { RegisterOpcode::ECX, (int)iterations } },
+        { InstructionOpcode::MOV, { RegisterOpcode::EAX, RegisterOpcode::ECX } },
+        { InstructionOpcode::AND, { RegisterOpcode::EAX, 0x0F0F } },
+        { InstructionOpcode::SHR, { RegisterOpcode::EAX, 3 } },
+        { InstructionOpcode::JP,  { 5 } },
+        { InstructionOpcode::ADD, { RegisterOpcode::EBX, RegisterOpcode::EAX } },
+        { InstructionOpcode::SUB, { RegisterOpcode::ECX, 1 } },
+        { InstructionOpcode::CMP, { RegisterOpcode::ECX, 0 } },
+        { InstructionOpcode::JG,  { 1 } },
+    };
+    w.executed = 1 + uint64_t(iterations) * 8;
+    return w;
+}
+
+// Counts up from -iterations while ECX <= 0, so the loop only runs if JLE
+// takes both the less and the equal case.
+Workload make_signed_loop(uint32_t iterations) {
+    Workload w;
+    w.name = "signed_loop";
+    w.program = {
+        { InstructionOpcode::MOV, { RegisterOpcode::ECX, -(int)iterations } },
+        { InstructionOpcode::ADD, { RegisterOpcode::EAX, RegisterOpcode::ECX } },
+        { InstructionOpcode::ADD, { RegisterOpcode::ECX, 1 } },
+        { InstructionOpcode::CMP, { RegisterOpcode::ECX, 0 } },
+        { InstructionOpcode::JLE, { 1 } },
+    };
+    w.executed = 1 + (uint64_t(iterations) + 1) * 4;
+    return w;
+}
+
+Workload make_fused_loop(uint32_t iterations) {
+    Workload w;
+    w.name = "fused_loop";
+    w.program = {
+        { InstructionOpcode::MOV, { RegisterOpcode::ECX, (int)iterations } },
+        { InstructionOpcode::MOV, { RegisterOpcode::EAX, RegisterOpcode::ECX } },
+        { InstructionOpcode::ADD, { RegisterOpcode::EAX, 7 } },
+        { InstructionOpcode::ADD, { RegisterOpcode::EBX, RegisterOpcode::EAX } },
+        { InstructionOpcode::SUB, { RegisterOpcode::ECX, 1 } },
+        { InstructionOpcode::CMP, { RegisterOpcode::ECX, 0 } },
+        { InstructionOpcode::JNE, { 1 } },
+    };
+    w.executed = 1 + uint64_t(iterations) * 6;
+    return w;
+}
+
+Workload make_call_loop(uint32_t iterations) {
+    Workload w;
+    w.name = "call_loop";
+    w.program = {
+        { InstructionOpcode::MOV, { RegisterOpcode::ECX, (int)iterations } },
+        { InstructionOpcode::CALL, { 7 } },
+        { InstructionOpcode::ADD, { RegisterOpcode::EBX, RegisterOpcode::EAX } },
+        { InstructionOpcode::SUB, { RegisterOpcode::ECX, 1 } },
+        { InstructionOpcode::CMP, { RegisterOpcode::ECX, 0 } },
+        { InstructionOpcode::JNE, { 1 } },
+        { InstructionOpcode::JMP, { 10 } },
+        { InstructionOpcode::MOV, { RegisterOpcode::EAX, RegisterOpcode::ECX } },
+        { InstructionOpcode::SHL, { RegisterOpcode::EAX, 1 } },
+        { InstructionOpcode::RET, {} },
+    };
+    w.executed = 2 + uint64_t(iterations) * 8;
+    return w;
+}
+
+Registers run_workload(const Workload& w, FlagMode mode, bool fuse, JitMode jit = JitMode::Off,
+                       Profiler* profiler = nullptr) {
+    std::vector<DecodedInstruction> code;
+    for (const auto& instr : w.program) {
+        code.push_back(VM::decode(instr));
+    }
+    if (fuse) {
+        Fusion::run(code);
+    }
+
+    VM vm;
+    vm.registers().set_flag_mode(mode);
+    vm.set_jit_mode(jit);
+    vm.set_profiler(profiler);
+    vm.load(std::move(code));
+
+    auto start = std::chrono::steady_clock::now();
+    vm.run();
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double mips = w.executed / seconds / 1e6;
+    std::cout << w.name << (mode == FlagMode::Lazy ? " [lazy" : " [eager") << (fuse ? "+fused" : "")
+              << (jit == JitMode::On ? "+jit" : jit == JitMode::Verify ? "+jit-verify" : "")
+              << (profiler ? "+profile]" : "]") << ": "
+              << w.executed << " instructions in "
+              << seconds << " s (" << mips << " MIPS)" << std::endl;
+
+    return vm.registers();
+}
+
+// Runs the workload with eager flags, lazy flags, lazy flags plus fusion,
+// the JIT (plain, and checked block by block) and the profiler; all of them
+// must end in the same state, and the profile must count every instruction.
+bool run_all(const Workload& w) {
+    Registers eager = run_workload(w, FlagMode::Eager, false);
+    Registers lazy = run_workload(w, FlagMode::Lazy, false);
+    Registers fused = run_workload(w, FlagMode::Lazy, true);
+    Registers jit = run_workload(w, FlagMode::Lazy, true, JitMode::On);
+    Registers verified = run_workload(w, FlagMode::Lazy, true, JitMode::Verify);
+    Profiler profiler;
+    Registers profiled = run_workload(w, FlagMode::Lazy, true, JitMode::Off, &profiler);
+
+    bool ok = true;
+    for (const auto& [name, regs] : { std::pair{ "lazy flags", &lazy }, std::pair{ "fusion", &fused },
+                                      std::pair{ "JIT", &jit }, std::pair{ "verified JIT", &verified },
+                                      std::pair{ "profiled", &profiled } }) {
+        if (!(eager == *regs)) {
+            std::cerr << w.name << ": " << name << " diverged from the eager run" << std::endl;
+            std::cerr << Debugger::info_about_flags(eager) << std::endl;
+            std::cerr << Debugger::info_about_flags(*regs) << std::endl;
+            ok = false;
+        }
+    }
+
+    std::vector<DecodedInstruction> code;
+    for (const auto& instr : w.program) {
+        code.push_back(VM::decode(instr));
+    }
+    Fusion::run(code);
+    uint64_t counted = 0;
+    for (const Profiler::Entry& entry : profiler.entries(code)) {
+        counted += entry.count;
+    }
+    if (counted != w.executed) {
+        std::cerr << w.name << ": profile counted " << counted << " of " << w.executed << " instructions"
+                  << std::endl;
+        ok = false;
+    }
+    return ok;
+}
+
+// Feeds the same random flag-setting operations, with the odd set_flag in
+// between, to an eager and a lazy Registers and compares EFLAGS after every
+// step. The eager side applies the handlers' original per-flag rules, so this
+// checks compute_flags(), written_flags() and when a pending op is folded in.
+bool run_flag_differential(uint64_t steps) {
+    static constexpr uint32_t edges[] = { 0, 1, 2, 0x7F, 0x80, 0xFF, 0x7FFFFFFF, 0x80000000, 0x80000001, 0xFFFFFFFF };
+    static constexpr Flag flags[] = { Flag::Carry, Flag::Parity, Flag::Zero, Flag::Sign, Flag::Direction,
+                                      Flag::Overflow };
+    std::mt19937 rng(7);
+    auto operand = [&] { return rng() % 2 ? edges[rng() % std::size(edges)] : static_cast<uint32_t>(rng()); };
+
+    Registers eager;
+    Registers lazy;
+    eager.set_flag_mode(FlagMode::Eager);
+    lazy.set_flag_mode(FlagMode::Lazy);
+
+    for (uint64_t i = 0; i < steps; ++i) {
+        if (rng() % 8 == 0) {
+            const Flag flag = flags[rng() % std::size(flags)];
+            const bool value = rng() % 2;
+            eager.set_flag(flag, value);
+            lazy.set_flag(flag, value);
+        } else {
+            const auto op = static_cast<FlagOp>(1 + rng() % 8);
+            const uint32_t a = operand();
+            uint32_t b = operand();
+            uint32_t result = 0;
+            switch (op) {
+                case FlagOp::Add:   result = a + b; break;
+                case FlagOp::Sub:
+                case FlagOp::Cmp:   result = a - b; break;
+                case FlagOp::And:   result = a & b; break;
+                case FlagOp::OrXor: result = rng() % 2 ? a | b : a ^ b; break;
+                case FlagOp::Shl:   b &= 0x1F; result = a << b; break;
+                case FlagOp::Sar:   b &= 0x1F; result = static_cast<uint32_t>(static_cast<int32_t>(a) >> b); break;
+                case FlagOp::Shr:   b &= 0x1F; result = a >> b; break;
+                case FlagOp::None:  break;
+            }
+            eager.update_flags(op, a, b, result);
+            lazy.update_flags(op, a, b, result);
+        }
+
+        if (eager.get_eflags() != lazy.get_eflags()) {
+            std::cerr << "flag_differential: eager and lazy flags differ after step " << i << std::endl;
+            std::cerr << Debugger::info_about_flags(eager) << std::endl;
+            std::cerr << Debugger::info_about_flags(lazy) << std::endl;
+            return false;
+        }
+    }
+    std::cout << "flag_differential: " << steps << " steps, eager and lazy flags agree" << std::endl;
+    return true;
+}
+
+// REP string instructions against a model that runs them one element at a
+// time, as x86 does: overlapping copies both ways, scans that hit or miss
+// and compares that stop or run out, over a page boundary. ESI, EDI, ECX,
+// EAX, ZF after a compare, and the memory must all match.
+bool run_string_check() {
+    enum class Kind { Movs, Stos, Lods, Scas, Cmps };
+    struct Case {
+        Kind kind;
+        uint32_t width;
+        RepPrefix prefix;
+        bool backward;
+        uint32_t esi, edi, ecx, eax;
+    };
+
+    constexpr uint32_t BASE = 0x3F00, SIZE = 0x200, MARK = BASE + 0x150;
+    // A pattern with period 61, so ranges 61 bytes apart compare equal,
+    // except for one byte the pattern never holds.
+    std::vector<uint8_t> initial(SIZE);
+    for (uint32_t i = 0; i < SIZE; ++i) {
+        initial[i] = static_cast<uint8_t>(i % 61);
+    }
+    initial[MARK - BASE] = 0xEE;
+
+    const Case cases[] = {
+        { Kind::Movs, 1, RepPrefix::Rep, false, BASE + 0x10, BASE + 0x13, 0x100, 0 },
+        { Kind::Movs, 1, RepPrefix::Rep, false, BASE + 0x10, BASE + 0x11, 0x100, 0 },
+        { Kind::Movs, 4, RepPrefix::Rep, false, BASE + 0x20, BASE + 0x22, 0x30, 0 },
+        { Kind::Movs, 1, RepPrefix::Rep, true, BASE + 0x180, BASE + 0x17C, 0x100, 0 },
+        { Kind::Movs, 1, RepPrefix::Rep, true, BASE + 0x100, BASE + 0x180, 0x80, 0 },
+        { Kind::Movs, 2, RepPrefix::Rep, true, BASE + 0x1F0, BASE + 0x1F1, 0x60, 0 },
+        { Kind::Stos, 2, RepPrefix::Rep, true, 0, BASE + 0x1FE, 0x40, 0x1234 },
+        { Kind::Lods, 1, RepPrefix::Rep, false, BASE + 5, 0, 0x10, 0 },
+        { Kind::Scas, 1, RepPrefix::RepNE, false, 0, BASE + 0x20, 0x1E0, 0xEE },
+        { Kind::Scas, 1, RepPrefix::RepNE, false, 0, BASE, 0x100, 0xEE },
+        { Kind::Scas, 1, RepPrefix::RepNE, true, 0, BASE + 0x1F0, 0x1F0, 0xEE },
+        { Kind::Scas, 1, RepPrefix::RepNE, false, 0, BASE, 0, 0xEE },
+        { Kind::Cmps, 1, RepPrefix::RepE, false, MARK - 122, MARK - 61, 0x80, 0 },
+        { Kind::Cmps, 1, RepPrefix::RepE, false, BASE, BASE + 61, 0x80, 0 },
+        { Kind::Cmps, 1, RepPrefix::RepE, true, BASE + 0x1A0, BASE + 0x1A0 - 61, 0x100, 0 },
+    };
+
+    struct State {
+        uint32_t esi, edi, ecx, eax;
+        bool zf;
+        std::vector<uint8_t> memory;
+    };
+    auto model = [&](const Case& c) {
+        State s { c.esi, c.edi, c.ecx, c.eax, false, initial };
+        auto load = [&](uint32_t address) {
+            uint32_t value = 0;
+            for (uint32_t i = 0; i < c.width; ++i) {
+                value |= uint32_t(s.memory.at(address + i - BASE)) << (8 * i);
+            }
+            return value;
+        };
+        auto store = [&](uint32_t address, uint32_t value) {
+            for (uint32_t i = 0; i < c.width; ++i) {
+                s.memory.at(address + i - BASE) = static_cast<uint8_t>(value >> (8 * i));
+            }
+        };
+        const uint32_t mask = c.width == 4 ? 0xFFFFFFFF : (1u << (8 * c.width)) - 1;
+        const uint32_t step = c.backward ? 0u - c.width : c.width;
+        for (uint32_t n = c.prefix == RepPrefix::None ? 1 : c.ecx; n > 0; --n) {
+            bool stop = false;
+            switch (c.kind) {
+                case Kind::Movs: store(s.edi, load(s.esi)); s.esi += step; s.edi += step; break;
+                case Kind::Stos: store(s.edi, s.eax & mask); s.edi += step; break;
+                case Kind::Lods: s.eax = (s.eax & ~mask) | load(s.esi); s.esi += step; break;
+                case Kind::Scas:
+                case Kind::Cmps:
+                    s.zf = (c.kind == Kind::Scas ? s.eax & mask : load(s.esi)) == load(s.edi);
+                    stop = s.zf == (c.prefix == RepPrefix::RepNE);
+                    s.edi += step;
+                    s.esi += c.kind == Kind::Cmps ? step : 0;
+                    break;
+            }
+            s.ecx -= c.prefix != RepPrefix::None;
+            if (stop) {
+                break;
+            }
+        }
+        return s;
+    };
+
+    static constexpr const char* mnemonics[] = { "MOVS", "STOS", "LODS", "SCAS", "CMPS" };
+    static constexpr const char* prefixes[] = { "", "REP ", "REPE ", "REPNE " };
+    size_t failed = 0;
+    for (const Case& c : cases) {
+        const std::string instruction = std::string(prefixes[static_cast<int>(c.prefix)]) +
+                                        mnemonics[static_cast<int>(c.kind)] + "BWD"[c.width / 2];
+        const std::string source = std::string(c.backward ? "STD\n" : "CLD\n") +
+                                   "MOV ESI, " + std::to_string(c.esi) + "\n" +
+                                   "MOV EDI, " + std::to_string(c.edi) + "\n" +
+                                   "MOV ECX, " + std::to_string(c.ecx) + "\n" +
+                                   "MOV EAX, " + std::to_string(c.eax) + "\n" + instruction + "\n";
+        VM vm;
+        vm.memory().write(BASE, initial.data(), SIZE);
+        vm.load(Assembler::assemble(source).code);
+        vm.run();
+
+        const State expected = model(c);
+        const Registers& regs = vm.registers();
+        std::vector<uint8_t> memory(SIZE);
+        vm.memory().read(BASE, memory.data(), SIZE);
+        const bool compares = c.kind == Kind::Scas || c.kind == Kind::Cmps;
+        if (regs.get(RegisterOpcode::ESI) != expected.esi || regs.get(RegisterOpcode::EDI) != expected.edi ||
+            regs.get(RegisterOpcode::ECX) != expected.ecx || regs.get(RegisterOpcode::EAX) != expected.eax ||
+            (compares && regs.get_flag(Flag::Zero) != expected.zf) || memory != expected.memory) {
+            std::cerr << "string_check: " << instruction << (c.backward ? " (DF=1)" : "") << " from ESI="
+                      << c.esi << " EDI=" << c.edi << " ECX=" << c.ecx << " differs from the model" << std::endl;
+            ++failed;
+        }
+    }
+    if (!failed) {
+        std::cout << "string_check: " << std::size(cases) << " REP string runs match the model" << std::endl;
+    }
+    return failed == 0;
+}
+
+// Runs `instances` copies of the workload on the multi-VM engine; every copy
+// must end in the same state as a single VM.
+bool run_engine(const Workload& w, size_t instances) {
+    Assembler::Program program;
+    for (const auto& instr : w.program) {
+        program.code.push_back(VM::decode(instr));
+    }
+    Fusion::run(program.code);
+
+    Registers expected = run_workload(w, FlagMode::Lazy, true);
+
+    Engine::Options options;
+    options.instances = instances;
+    Engine engine(ProgramImage::from_program(program), options);
+    Engine::Report report = engine.run();
+    std::cout << w.name << " [" << report.to_string() << "]" << std::endl;
+
+    bool ok = report.finished == instances;
+    for (size_t i = 0; i < engine.size(); ++i) {
+        if (!(engine.instance(i).vm.registers() == expected)) {
+            std::cerr << w.name << ": engine instance " << i << " diverged from a single VM" << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Instances that read `reads` characters each, doing `work` iterations of
+// arithmetic after every one, on the engine while a writer thread trickles the
+// characters into a pipe. Parked instances leave the workers free for the
+// others; every character must be read exactly once.
+bool run_async_input(size_t instances, uint32_t reads, uint32_t work) {
+    Assembler::Program program;
+    for (const Instruction& instr : std::vector<Instruction> {
+             { InstructionOpcode::MOV, { RegisterOpcode::ESI, (int)reads } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x700 } },     // AH=07h: read character
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::AND, { RegisterOpcode::EAX, 0xFF } },
+             { InstructionOpcode::ADD, { RegisterOpcode::EBX, RegisterOpcode::EAX } },
+             { InstructionOpcode::MOV, { RegisterOpcode::ECX, (int)work } },
+             { InstructionOpcode::ADD, { RegisterOpcode::EDX, RegisterOpcode::ECX } },
+             { InstructionOpcode::SUB, { RegisterOpcode::ECX, 1 } },
+             { InstructionOpcode::CMP, { RegisterOpcode::ECX, 0 } },
+             { InstructionOpcode::JNE, { 6 } },
+             { InstructionOpcode::SUB, { RegisterOpcode::ESI, 1 } },
+             { InstructionOpcode::CMP, { RegisterOpcode::ESI, 0 } },
+             { InstructionOpcode::JNE, { 1 } },
+         }) {
+        program.code.push_back(VM::decode(instr));
+    }
+    Fusion::run(program.code);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        std::cerr << "async_input: cannot create a pipe" << std::endl;
+        return false;
+    }
+
+    uint64_t expected = 0;
+    const uint64_t total = uint64_t(instances) * reads;
+    std::jthread writer([&] {
+        for (uint64_t i = 0; i < total; ++i) {
+            const char line[2] = { static_cast<char>('a' + i % 26), '\n' };
+            expected += line[0];
+            [[maybe_unused]] ssize_t n = write(fds[1], line, sizeof(line));
+            if (i % 16 == 15) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        }
+        close(fds[1]);
+    });
+
+    Engine::Options options;
+    options.instances = instances;
+    options.input = fds[0];
+    Engine engine(ProgramImage::from_program(program), options);
+    Engine::Report report = engine.run();
+    writer.join();
+    close(fds[0]);
+    std::cout << "async_input [" << report.to_string() << "]" << std::endl;
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < engine.size(); ++i) {
+        sum += engine.instance(i).vm.registers().get(RegisterOpcode::EBX);
+    }
+    if (report.finished != instances || sum != expected) {
+        std::cerr << "async_input: characters were lost or read twice" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Prints `count` characters with INT 21h AH=02h to /dev/null through a
+// console device: in cooked mode, which ends and flushes a line per
+// character as the console always did, and in raw mode, buffered. Then
+// checks the exact bytes a short AH=02h/09h program leaves in a file in
+// both modes, and that output still buffered is written out before a read.
+bool run_console_output(uint32_t count) {
+    std::vector<DecodedInstruction> code;
+    for (const Instruction& instr : std::vector<Instruction> {
+             { InstructionOpcode::MOV, { RegisterOpcode::ECX, (int)count } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x200 } },     // AH=02h: write character
+             { InstructionOpcode::MOV, { RegisterOpcode::EDX, RegisterOpcode::ECX } },
+             { InstructionOpcode::AND, { RegisterOpcode::EDX, 0x3F } },
+             { InstructionOpcode::ADD, { RegisterOpcode::EDX, 0x30 } },
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::SUB, { RegisterOpcode::ECX, 1 } },
+             { InstructionOpcode::CMP, { RegisterOpcode::ECX, 0 } },
+             { InstructionOpcode::JNE, { 2 } },
+         }) {
+        code.push_back(VM::decode(instr));
+    }
+
+    const int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "console_output: cannot open /dev/null" << std::endl;
+        return false;
+    }
+    for (bool raw : { false, true }) {
+        ConsoleDevice console(fd);
+        console.set_raw(raw);
+        InterruptManager manager;
+        manager.set_service(InterruptType::WriteChar, [&](const Interrupt& intr) {
+            console.write(static_cast<char>(intr.registers.get(RegisterOpcode::DL)));
+        });
+
+        VM vm;
+        vm.set_interrupt_manager(&manager);
+        vm.load(code);
+        auto start = std::chrono::steady_clock::now();
+        vm.run();
+        console.flush();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "console_output [" << (raw ? "raw" : "cooked") << "]: " << count << " characters in "
+                  << seconds << " s, " << console.syscalls() << " write calls" << std::endl;
+    }
+    close(fd);
+
+    namespace fs = std::filesystem;
+    const fs::path path = fs::temp_directory_path() / "slave16_bench_console";
+    auto contents = [&] {
+        std::ifstream in(path, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    };
+
+    constexpr int TEXT = 0x1000;
+    std::vector<DecodedInstruction> program;
+    for (const Instruction& instr : std::vector<Instruction> {
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x200 } },     // AH=02h 'H'
+             { InstructionOpcode::MOV, { RegisterOpcode::EDX, 'H' } },
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x900 } },     // AH=09h "a\nb$"
+             { InstructionOpcode::MOV, { RegisterOpcode::EDX, TEXT } },
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x200 } },     // AH=02h 'c'
+             { InstructionOpcode::MOV, { RegisterOpcode::EDX, 'c' } },
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x700 } },     // AH=07h: read
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EDX, RegisterOpcode::EAX } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x200 } },     // AH=02h: echo it
+             { InstructionOpcode::INT, { Interrupt::API } },
+         }) {
+        program.push_back(VM::decode(instr));
+    }
+
+    struct Expected {
+        bool raw;
+        std::string before_read;
+        std::string output;
+    };
+    bool ok = true;
+    for (const Expected& expected : { Expected { false, "H\na\nb\nc\n", "H\na\nb\nc\nx\n" },
+                                      Expected { true, "Ha\nbc", "Ha\nbcx" } }) {
+        std::string before_read;
+        {
+            const int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out < 0) {
+                std::cerr << "console_output: cannot create " << path << std::endl;
+                return false;
+            }
+            ConsoleDevice console(out);
+            console.set_raw(expected.raw);
+            InterruptManager manager;
+            manager.set_service(InterruptType::WriteChar, [&](const Interrupt& intr) {
+                console.write(static_cast<char>(intr.registers.get(RegisterOpcode::DL)));
+            });
+            manager.set_service(InterruptType::WriteString, [&](const Interrupt& intr) {
+                console.write(intr.vm.memory().read_string(intr.registers.get(RegisterOpcode::EDX), '$'));
+            });
+            manager.set_service(InterruptType::ReadCharNoEcho, [&](const Interrupt& intr) {
+                console.input_requested();
+                before_read = contents();
+                intr.vm.on_read_char('x');
+            });
+
+            VM vm;
+            vm.set_interrupt_manager(&manager);
+            vm.memory().write(TEXT, "a\nb$cd", 7);
+            vm.load(program);
+            vm.run();
+            console.flush();
+            close(out);
+        }
+        const std::string output = contents();
+        const char* mode = expected.raw ? "raw" : "cooked";
+        if (before_read != expected.before_read) {
+            std::cerr << "console_output [" << mode << "]: " << before_read.size()
+                      << " bytes written before the read, expected " << expected.before_read.size() << std::endl;
+            ok = false;
+        }
+        if (output != expected.output) {
+            std::cerr << "console_output [" << mode << "]: wrote \"" << output << "\", expected \""
+                      << expected.output << "\"" << std::endl;
+            ok = false;
+        }
+    }
+    fs::remove(path);
+    return ok;
+}
+
+// Copies a `megabytes` MiB file through guest memory with AH=3Fh/40h in
+// `chunk` byte pieces; the copy must match the original.
+bool run_file_copy(uint32_t megabytes, uint32_t chunk) {
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() / "slave16_bench_files";
+    fs::create_directories(dir);
+    std::string data(size_t(megabytes) << 20, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 2654435761u >> 24);
+    }
+    std::ofstream(dir / "in", std::ios::binary).write(data.data(), data.size());
+
+    constexpr int NAMES = 0x1000, BUFFER = 0x100000;
+    std::vector<DecodedInstruction> code;
+    for (const Instruction& instr : std::vector<Instruction> {
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x3D00 } },    // open "in" for reading
+             { InstructionOpcode::MOV, { RegisterOpcode::EDX, NAMES } },
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::MOV, { RegisterOpcode::ESI, RegisterOpcode::EAX } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x3C00 } },    // create "out"
+             { InstructionOpcode::MOV, { RegisterOpcode::EDX, NAMES + 3 } },
+             { InstructionOpcode::MOV, { RegisterOpcode::ECX, 0 } },
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EDI, RegisterOpcode::EAX } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x3F00 } },    // 9: read a chunk
+             { InstructionOpcode::MOV, { RegisterOpcode::EBX, RegisterOpcode::ESI } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EDX, BUFFER } },
+             { InstructionOpcode::MOV, { RegisterOpcode::ECX, (int)chunk } },
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::CMP, { RegisterOpcode::EAX, 0 } },
+             { InstructionOpcode::JE,  { 21 } },
+             { InstructionOpcode::MOV, { RegisterOpcode::ECX, RegisterOpcode::EAX } },
+             { InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x4000 } },    // write it out
+             { InstructionOpcode::MOV, { RegisterOpcode::EBX, RegisterOpcode::EDI } },
+             { InstructionOpcode::INT, { Interrupt::API } },
+             { InstructionOpcode::JMP, { 9 } },
+             { InstructionOpcode::NOP, {} },
+         }) {
+        code.push_back(VM::decode(instr));
+    }
+
+    bool ok = false;
+    {
+        InterruptManager manager;
+        FileServices files(dir);
+        files.install(manager);
+
+        VM vm;
+        vm.set_interrupt_manager(&manager);
+        vm.memory().write(NAMES, "in\0out", 7);
+        vm.load(code);
+        auto start = std::chrono::steady_clock::now();
+        vm.run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        files.release(vm);
+        std::cout << "file_copy [" << chunk / 1024 << " KiB chunks]: " << megabytes << " MiB in " << seconds
+                  << " s (" << megabytes / seconds << " MiB/s)" << std::endl;
+
+        std::ifstream copy(dir / "out", std::ios::binary);
+        std::string copied((std::istreambuf_iterator<char>(copy)), std::istreambuf_iterator<char>());
+        ok = copied == data;
+    }
+    fs::remove_all(dir);
+    if (!ok) {
+        std::cerr << "file_copy: the copy differs from the original" << std::endl;
+    }
+    return ok;
+}
+
+// A guest creating, opening and deleting files through a link in the sandbox
+// root that dangles outside it: each call must fail with AccessDenied, and no
+// file may appear outside the root.
+bool run_file_sandbox() {
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() / "slave16_bench_sandbox";
+    const fs::path root = dir / "root", outside = dir / "outside";
+    fs::remove_all(dir);
+    fs::create_directories(root);
+    fs::create_symlink(outside, root / "link");
+    fs::create_directory_symlink(dir, root / "up");
+
+    constexpr int NAMES = 0x1000;
+    const char names[] = "link\0up/outside\0../outside";
+    const std::pair<int, int> calls[] = {
+        { 0x3C00, NAMES },          // create "link"
+        { 0x3D02, NAMES },          // open "link"
+        { 0x3C00, NAMES + 5 },      // create "up/outside"
+        { 0x3C00, NAMES + 16 },     // create "../outside"
+        { 0x4100, NAMES + 5 },      // delete "up/outside"
+    };
+
+    bool ok = true;
+    {
+        InterruptManager manager;
+        FileServices files(root);
+        files.install(manager);
+        VM vm;
+        vm.set_interrupt_manager(&manager);
+        vm.memory().write(NAMES, names, sizeof names);
+        for (auto [function, name] : calls) {
+            vm.load({
+                VM::decode({ InstructionOpcode::MOV, { RegisterOpcode::EAX, function } }),
+                VM::decode({ InstructionOpcode::MOV, { RegisterOpcode::EDX, name } }),
+                VM::decode({ InstructionOpcode::MOV, { RegisterOpcode::ECX, 0 } }),
+                VM::decode({ InstructionOpcode::INT, { Interrupt::API } }),
+            });
+            vm.run();
+            const Registers& regs = vm.registers();
+            if (!regs.get_flag(Flag::Carry) || regs.get(RegisterOpcode::AX) != FileServices::AccessDenied) {
+                std::cerr << "file_sandbox: AX=" << std::hex << function << " on " << names + (name - NAMES)
+                          << " was not refused" << std::dec << std::endl;
+                ok = false;
+            }
+        }
+        files.release(vm);
+    }
+    if (fs::exists(outside)) {
+        std::cerr << "file_sandbox: a file was created outside the root" << std::endl;
+        ok = false;
+    }
+    fs::remove_all(dir);
+    if (ok) {
+        std::cout << "file_sandbox: " << std::size(calls) << " escapes through links refused" << std::endl;
+    }
+    return ok;
+}
+
+// Many short-lived blocks of 1-64 paragraphs, up to `live` at a time, on a
+// VM's heap; once everything is freed the heap must be whole again.
+bool run_heap(uint64_t operations, size_t live) {
+    VM vm;
+    BuddyAllocator& heap = vm.heap();
+    std::vector<uint32_t> blocks;
+    std::mt19937 rng(42);
+    uint64_t failed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < operations; ++i) {
+        if (blocks.size() < live && (blocks.empty() || rng() % 2)) {
+            const uint32_t address = heap.allocate(1 + rng() % 64);
+            if (address == BuddyAllocator::NO_BLOCK) {
+                ++failed;
+            } else {
+                blocks.push_back(address);
+            }
+        } else {
+            std::swap(blocks[rng() % blocks.size()], blocks.back());
+            heap.free(blocks.back());
+            blocks.pop_back();
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (uint32_t address : blocks) {
+        heap.free(address);
+    }
+    std::cout << "heap: " << operations << " allocations and frees in " << seconds << " s ("
+              << operations / seconds / 1e6 << " M/s), " << failed << " failed" << std::endl;
+
+    if (heap.largest_free() != (1u << VM::HEAP_ORDER) || heap.allocated_blocks() != 0) {
+        std::cerr << "heap: freed blocks did not merge back" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Runs a tiny program `count` times, each time on a freshly constructed VM
+// and on one from a VmPool; every run must compute the same EAX. Pooled VMs
+// must not carry an interrupt manager over to the next caller.
+bool run_vm_churn(uint64_t count) {
+    Assembler::Program program;
+    for (const Instruction& instr : std::vector<Instruction> {
+             { InstructionOpcode::MOV, { RegisterOpcode::ECX, 5 } },
+             { InstructionOpcode::PUSH, { RegisterOpcode::ECX } },
+             { InstructionOpcode::POP, { RegisterOpcode::EDX } },
+             { InstructionOpcode::ADD, { RegisterOpcode::EAX, RegisterOpcode::EDX } },
+             { InstructionOpcode::SUB, { RegisterOpcode::ECX, 1 } },
+             { InstructionOpcode::CMP, { RegisterOpcode::ECX, 0 } },
+             { InstructionOpcode::JNE, { 1 } },
+             { InstructionOpcode::HLT, {} },
+         }) {
+        program.code.push_back(VM::decode(instr));
+    }
+    std::shared_ptr<const ProgramImage> image = ProgramImage::from_program(program);
+
+    uint64_t wrong = 0;
+    auto report = [&](const char* name, auto start) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "vm_churn [" << name << "]: " << count << " VMs in " << seconds << " s ("
+                  << count / seconds << " VMs/s)" << std::endl;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < count; ++i) {
+        VM vm;
+        vm.load(image);
+        vm.run();
+        wrong += vm.registers().get(RegisterOpcode::EAX) != 15;
+    }
+    report("new", start);
+
+    VmPool pool;
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < count; ++i) {
+        VmPool::Handle vm = pool.acquire();
+        vm->load(image);
+        vm->run();
+        wrong += vm->registers().get(RegisterOpcode::EAX) != 15;
+    }
+    report("pooled", start);
+
+    // Every other caller brings an interrupt manager of its own, which is
+    // gone before the VM is handed out again: the next caller, who attaches
+    // none, must get a VM that has none either.
+    std::vector<DecodedInstruction> terminate = {
+        VM::decode({ InstructionOpcode::MOV, { RegisterOpcode::EAX, 0x4C07 } }),
+        VM::decode({ InstructionOpcode::INT, { Interrupt::API } }),
+    };
+    for (uint64_t i = 0; i < count; ++i) {
+        VmPool::Handle vm = pool.acquire();
+        vm->load(terminate);
+        if (i % 2 == 0) {
+            InterruptManager manager;
+            vm->set_interrupt_manager(&manager);
+            vm->run();
+            wrong += !vm->halted() || vm->exit_code() != 7;
+            continue;
+        }
+        try {
+            vm->run();
+            ++wrong;
+        } catch (const std::runtime_error&) {
+            // INT 21h with no interrupt manager attached.
+        }
+    }
+
+    if (wrong) {
+        std::cerr << "vm_churn: " << wrong << " runs computed the wrong result" << std::endl;
+    }
+    return wrong == 0;
+}
+
+// A prologue writes `pages` pages of guest memory and halts; each of `count`
+// inputs then runs a short body that reads from and writes to a few of them.
+// Compares re-running the prologue for every input on a reset VM with
+// restoring a snapshot taken after it.
+bool run_snapshot_fork(uint32_t pages, uint64_t count) {
+    const std::string source =
+        "        MOV EBX, 65536\n"
+        "        MOV ECX, " + std::to_string(pages) + "\n"
+        "fill:   MOV DWORD [EBX], ECX\n"
+        "        ADD EBX, 4096\n"
+        "        SUB ECX, 1\n"
+        "        CMP ECX, 0\n"
+        "        JNE fill\n"
+        "        HLT\n"
+        "        MOV ECX, 4\n"         // body: input in EAX
+        "        MOV EBX, 65536\n"
+        "body:   ADD EAX, DWORD [EBX]\n"
+        "        MOV DWORD [EBX], EAX\n"
+        "        ADD EBX, 8192\n"
+        "        SUB ECX, 1\n"
+        "        CMP ECX, 0\n"
+        "        JNE body\n";
+    std::shared_ptr<const ProgramImage> image = ProgramImage::from_program(Assembler::assemble(source));
+    // pages + (pages - 2) + (pages - 4) + (pages - 6) on top of the input.
+    auto expected = [pages](uint32_t input) { return input + 4 * pages - 12; };
+
+    uint64_t wrong = 0;
+    auto report = [&](const char* name, auto start) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "snapshot_fork [" << name << ", " << pages << " pages]: " << count << " runs in "
+                  << seconds << " s (" << count / seconds << " runs/s)" << std::endl;
+    };
+    auto run_body = [&](VM& vm, uint32_t input) {
+        vm.resume();
+        vm.registers().set(RegisterOpcode::EAX, input);
+        vm.run();
+        wrong += vm.registers().get(RegisterOpcode::EAX) != expected(input);
+    };
+
+    VM vm;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < count; ++i) {
+        vm.reset();
+        vm.load(image);
+        vm.run();
+        run_body(vm, static_cast<uint32_t>(i));
+    }
+    report("rerun prologue", start);
+
+    vm.reset();
+    vm.load(image);
+    vm.run();
+    const VM::Snapshot snapshot = vm.snapshot();
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < count; ++i) {
+        vm.restore(snapshot);
+        run_body(vm, static_cast<uint32_t>(i));
+    }
+    report("restore", start);
+
+    // Resetting after a restore must zero the snapshot's pages, not keep them.
+    vm.reset();
+    for (uint32_t page = 0; page < pages; ++page) {
+        wrong += vm.memory().load32(65536 + page * Memory::PAGE_SIZE) != 0;
+    }
+
+    if (wrong) {
+        std::cerr << "snapshot_fork: " << wrong << " runs computed the wrong result" << std::endl;
+    }
+    return wrong == 0;
+}
+
+struct CountingHandler : IInterruptHandler {
+    void handle_interrupt(const Interrupt&) override {
+        thread_local uint64_t handled = 0;
+        ++handled;
+    }
+};
+
+// The mutex-guarded broadcast InterruptManager used to do, for comparison.
+struct LockedDispatch {
+    std::vector<IInterruptHandler*> handlers;
+    std::mutex mtx;
+
+    void notify(const Interrupt& intr) {
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto handler : handlers) {
+            handler->handle_interrupt(intr);
+        }
+    }
+};
+
+// `threads` threads raise `per_thread` interrupts each through `notify`.
+template<typename Notify>
+double time_interrupts(size_t threads, uint64_t per_thread, Notify&& notify) {
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::jthread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&] {
+                VM vm;
+                Interrupt intr(InterruptType::WriteChar, vm.registers(), vm);
+                for (uint64_t i = 0; i < per_thread; ++i) {
+                    notify(intr);
+                }
+            });
+        }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Many threads raising interrupts at once, through the old locked handler
+// list and through InterruptManager's vector table snapshot, while another thread keeps
+// registering and unregistering a second handler.
+void run_interrupt_contention(size_t threads, uint64_t per_thread) {
+    CountingHandler handler;
+    CountingHandler churn;
+
+    LockedDispatch locked;
+    locked.handlers.push_back(&handler);
+    double locked_seconds = time_interrupts(threads, per_thread, [&](const Interrupt& intr) {
+        locked.notify(intr);
+    });
+
+    InterruptManager manager;
+    manager.register_handler(handler, { InterruptType::WriteChar });
+    std::atomic<bool> done = false;
+    uint64_t updates = 0;
+    std::jthread writer([&] {
+        while (!done.load(std::memory_order_relaxed)) {
+            manager.register_handler(churn, { InterruptType::GetDOSVersion });
+            manager.unregister_handler(churn);
+            updates += 2;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    });
+    double snapshot_seconds = time_interrupts(threads, per_thread, [&](const Interrupt& intr) {
+        manager.notify(intr);
+    });
+    done = true;
+    writer.join();
+
+    const double total = double(threads) * per_thread;
+    std::cout << "interrupts x" << threads << " threads [locked]: " << total / locked_seconds / 1e6
+              << " M/s" << std::endl;
+    std::cout << "interrupts x" << threads << " threads [snapshot, " << updates << " updates]: "
+              << total / snapshot_seconds / 1e6 << " M/s" << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+    uint32_t iterations = argc > 1 ? std::stoul(argv[1]) : 2000000;
+
+    bool ok = true;
+    ok &= run_all(make_arith_loop(iterations));
+    ok &= run_all(make_stack_loop(iterations));
+    ok &= run_all(make_flags_loop(iterations));
+    ok &= run_all(make_fused_loop(iterations));
+    ok &= run_all(make_signed_loop(iterations));
+    ok &= run_all(make_call_loop(iterations));
+    ok &= run_flag_differential(iterations);
+    ok &= run_string_check();
+    ok &= run_engine(make_arith_loop(iterations / 16), 64);
+    ok &= run_async_input(16, 256, iterations / 1000);
+    ok &= run_console_output(iterations / 2);
+    ok &= run_file_copy(64, 1 << 20);
+    ok &= run_file_sandbox();
+    ok &= run_heap(iterations, 1024);
+    ok &= run_vm_churn(iterations / 20);
+    ok &= run_snapshot_fork(1024, iterations / 200);
+
+    const size_t threads = std::max(4u, std::thread::hardware_concurrency());
+    run_interrupt_contention(threads, iterations / 2);
+
+    return ok ? 0 : 1;
+}
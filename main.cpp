@@ -1,6 +1,67 @@
 #include "REPL.h"
+#include "ProgramImage.h"
+#include <string>
 
-int main (void) {
+int main(int argc, char** argv) {
     REPL repl;
-    repl.run();
+
+    try {
+        RunOptions options;
+        std::string output;
+        std::string input;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "-o" && i + 1 < argc) {
+                output = argv[++i];
+            } else if (arg == "--no-fuse") {
+                options.fuse = false;
+            } else if (arg == "--jit") {
+                options.jit = JitMode::On;
+            } else if (arg == "--jit-verify") {
+                options.jit = JitMode::Verify;
+            } else if (arg == "--stats") {
+                options.stats = true;
+            } else if (arg == "--profile") {
+                options.profile = true;
+            } else if (arg == "--profile-out" && i + 1 < argc) {
+                options.profile = true;
+                options.profile_out = argv[++i];
+            } else if (arg == "--root" && i + 1 < argc) {
+                options.root = argv[++i];
+            } else if (arg == "--raw") {
+                options.raw_output = true;
+            } else if (arg == "--async-io") {
+                options.async_io = true;
+            } else if (arg == "--instances" && i + 1 < argc) {
+                options.instances = std::stoul(argv[++i]);
+            } else if (arg == "--threads" && i + 1 < argc) {
+                options.threads = std::stoul(argv[++i]);
+            } else if (arg == "--slice" && i + 1 < argc) {
+                options.slice = std::stoull(argv[++i]);
+            } else if (arg.starts_with("-")) {
+                throw std::invalid_argument("Unknown option: " + arg);
+            } else {
+                input = arg;
+            }
+        }
+
+        if (!output.empty()) {
+            if (input.empty()) {
+                throw std::invalid_argument("-o requires a source file");
+            }
+            Assembler::Program program = Assembler::assemble_file(input);
+            if (options.fuse) {
+                Fusion::run(program.code);
+            }
+            ProgramImage::write_file(output, program);
+        } else if (!input.empty()) {
+            return repl.run_file(input, options);
+        } else {
+            repl.run();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
 }